@@ -26,11 +26,13 @@ public:
 
 	void LoadIdentity();
 
-	void SetModel() const;
 	void SetView(const glm::mat4& view) const;
 	void SetOrthographic(const GLfloat& left, const GLfloat& right, const GLfloat& bottom, const GLfloat& top, const GLfloat& near, const GLfloat& far) const;
 	void SetPerspective(const GLfloat& FOV, const GLfloat& aspectRatio, const GLfloat& near, const GLfloat& far) const;
 
+	// Projection SetPerspective uploads, e.g. to build the view frustum
+	static glm::mat4 Perspective(const GLfloat& FOV, const GLfloat& aspectRatio, const GLfloat& near, const GLfloat& far);
+
 	void Translate(const glm::vec3& translate);
 	void Translate(const GLfloat& x, const GLfloat& y, const GLfloat& z);
 	void Scale(const glm::vec3& scale);
@@ -40,6 +42,8 @@ public:
 
 	void MultMatrix(const GLfloat mat[16]);
 
+	const glm::mat4& GetModel() const;
+
 private:
 	glm::mat4 _model;
 	std::stack<glm::mat4> _stack;
@@ -0,0 +1,31 @@
+#pragma once
+#ifndef FRUSTUM_H_INCLUDED
+#define FRUSTUM_H_INCLUDED
+
+#include <glm/glm.hpp>
+
+// Box around a local box once model (affine) maps it to the outer space,
+// the same box all eight transformed corners would give
+void TransformAabb(const glm::mat4& model, const float aabbMin[3], const float aabbMax[3], glm::vec3& outMin, glm::vec3& outMax);
+
+// View frustum planes in world space, extracted from the projection times
+// view matrix (Gribb and Hartmann). Used to skip nodes and meshes whose
+// bounding boxes are off screen.
+class Frustum
+{
+public:
+	Frustum() = default;
+	~Frustum() = default;
+
+	void Extract(const glm::mat4& viewProjection);
+
+	// False only if the box, in the space model maps to world, is entirely
+	// outside one of the planes
+	bool Intersects(const glm::mat4& model, const float aabbMin[3], const float aabbMax[3]) const;
+
+private:
+	// left, right, bottom, top, near, far; normals point inwards
+	glm::vec4 _planes[6];
+};
+
+#endif
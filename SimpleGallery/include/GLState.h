@@ -0,0 +1,165 @@
+#pragma once
+#ifndef GLSTATE_H_INCLUDED
+#define GLSTATE_H_INCLUDED
+
+#include <vector>
+
+#include <GL/glew.h>
+
+// Shadow copy of the GL state the application changes. Every state change
+// goes through here and calls that wouldn't change anything are dropped,
+// so callers can set the state they need without knowing what's bound.
+// Resources are deleted through it too so a recycled name is never taken
+// for one that's still bound.
+//
+// GL thread only. Element array binds are VAO state and go to GL directly.
+class GLState
+{
+public:
+	// State changes counted separately
+	enum StateType
+	{
+		Program,
+		Capability,
+		Blend,
+		Raster,
+		Stencil,
+		VertexArray,
+		Texture,
+		Buffer,
+		UniformBlock,
+		Uniform,
+		NumStateTypes
+	};
+
+	struct Stats
+	{
+		unsigned long issued[NumStateTypes];
+		unsigned long filtered[NumStateTypes];
+	};
+
+	// Texture units that are tracked
+	static const GLuint NumTextureUnits = 4;
+
+	GLState(const GLState&) = delete;
+	GLState& operator=(const GLState&) = delete;
+
+	static GLState& Instance();
+
+	void UseProgram(GLuint program);
+
+	// GL_BLEND, GL_DEPTH_TEST, GL_STENCIL_TEST, GL_MULTISAMPLE and GL_CULL_FACE
+	void Enable(GLenum capability);
+	void Disable(GLenum capability);
+	void BlendFunc(GLenum source, GLenum destination);
+
+	void PolygonMode(GLenum mode);
+	void ClearColor(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha);
+	void ColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha);
+
+	void StencilFunc(GLenum func, GLint ref, GLuint mask);
+	void StencilOp(GLenum stencilFail, GLenum depthFail, GLenum depthPass);
+
+	void BindVertexArray(GLuint vao);
+
+	// Binds to the active unit, or to unit after making it the active one
+	void BindTexture(GLenum target, GLuint texture);
+	void BindTexture(GLuint unit, GLenum target, GLuint texture);
+
+	// GL_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_COPY_WRITE_BUFFER and GL_PIXEL_UNPACK_BUFFER
+	void BindBuffer(GLenum target, GLuint buffer);
+	// Uniform buffer ranges, also the generic GL_UNIFORM_BUFFER binding
+	void BindBufferRange(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+	// Uniforms of the program in use
+	void Uniform1i(GLint location, GLint value);
+	void Uniform3f(GLint location, GLfloat x, GLfloat y, GLfloat z);
+	void Uniform3fv(GLint location, const GLfloat* value) { Uniform3f(location, value[0], value[1], value[2]); }
+
+	void DeleteTextures(GLsizei n, const GLuint* textures);
+	void DeleteBuffers(GLsizei n, const GLuint* buffers);
+	void DeleteVertexArrays(GLsizei n, const GLuint* vaos);
+
+	// Starts counting a new frame, the finished frame's counts stay readable
+	void BeginFrame();
+	const Stats& LastFrame() const { return _lastFrame; }
+
+	// Prints a frame's counts per state type
+	static void ReportStats(const Stats& stats);
+
+private:
+	GLState() = default;
+	~GLState() = default;
+
+	enum CapabilitySlot
+	{
+		BlendSlot,
+		DepthTestSlot,
+		StencilTestSlot,
+		MultisampleSlot,
+		CullFaceSlot,
+		NumCapabilities
+	};
+
+	enum BufferSlot
+	{
+		ArrayBufferSlot,
+		UniformBufferSlot,
+		CopyWriteBufferSlot,
+		PixelUnpackBufferSlot,
+		NumBufferSlots
+	};
+
+	struct BufferRange
+	{
+		GLuint buffer;
+		GLintptr offset;
+		GLsizeiptr size;
+	};
+
+	// Last value set at a uniform location, set tells if there is one
+	struct UniformValue
+	{
+		bool set;
+		GLint i;
+		GLfloat f[3];
+	};
+
+	struct ProgramUniforms
+	{
+		GLuint program;
+		std::vector<UniformValue> values;
+	};
+
+	// Counts a change and tells whether it has to be issued
+	bool changed(StateType type, bool differs);
+	UniformValue* uniform(GLint location);
+
+	static int capabilitySlot(GLenum capability);
+	static int bufferSlot(GLenum target);
+	static int textureSlot(GLenum target);
+
+	// GL defaults, except the capabilities which start unknown
+	GLuint _program = 0;
+	int _capabilities[NumCapabilities] = {-1, -1, -1, -1, -1};
+	GLenum _blendSource = GL_ONE;
+	GLenum _blendDestination = GL_ZERO;
+	GLenum _polygonMode = GL_FILL;
+	GLfloat _clearColor[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+	GLboolean _colorMask[4] = {GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE};
+	GLenum _stencilFunc = GL_ALWAYS;
+	GLint _stencilRef = 0;
+	GLuint _stencilMask = ~0u;
+	GLenum _stencilOp[3] = {GL_KEEP, GL_KEEP, GL_KEEP};
+	GLuint _vao = 0;
+	GLuint _activeUnit = 0;
+	GLuint _textures[NumTextureUnits][2] = {};
+	GLuint _buffers[NumBufferSlots] = {};
+	std::vector<BufferRange> _uniformBlocks;
+	std::vector<ProgramUniforms> _uniforms;
+
+	Stats _frame = {};
+	Stats _lastFrame = {};
+};
+
+#endif
@@ -0,0 +1,79 @@
+#pragma once
+#ifndef INSTANCEBUFFER_H_INCLUDED
+#define INSTANCEBUFFER_H_INCLUDED
+
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+// Model matrices of a frame's draws, read by the Instances block of
+// shaders/full.vert. An instanced batch adds all its matrices, any other
+// draw adds one. Each draw binds its range (see RenderQueue) so
+// gl_InstanceID indexes from its first matrix. Every matrix goes up with
+// its normal matrix so the vertex shader doesn't invert anything.
+//
+// The buffer is a ring of NumRegions frame regions. A fence is placed when a
+// frame ends and its region is only written again once that fence has
+// passed, so the uploads never wait on the GPU implicitly.
+class InstanceBuffer
+{
+public:
+	// An element of the instances array in shaders/full.vert, std140 puts
+	// the mat3's columns 16 bytes apart
+	struct Transform
+	{
+		glm::mat4 model;
+		glm::vec4 normal[3];
+	};
+
+	// Size of the instances array in shaders/full.vert
+	static const GLsizei MaxInstances = 64;
+	// Bytes of the whole block, a bound range must cover all of it
+	static const GLsizeiptr BlockSize = sizeof(Transform) * MaxInstances;
+	// Frames that can be in flight at once
+	static const int NumRegions = 3;
+
+	InstanceBuffer() = default;
+	~InstanceBuffer() = default;
+
+	InstanceBuffer(const InstanceBuffer&) = delete;
+	InstanceBuffer& operator=(const InstanceBuffer&) = delete;
+
+	void Init();
+	void Shutdown();
+
+	// Fences the finished frame and moves to the next region, waits only if
+	// the GPU is still reading that region NumRegions frames later
+	void Begin();
+
+	// Copies up to MaxInstances matrices, returns their byte offset from
+	// the start of the frame's region
+	GLintptr Add(const glm::mat4* matrices, GLsizei count);
+
+	// The matrix and its normal matrix. Rotations, mirrors and uniform
+	// scales use the upper 3x3 as is, only other transforms are inverted.
+	static Transform MakeTransform(const glm::mat4& model);
+
+	// Writes the matrices added since the last upload in one go, ranges
+	// added before stay where they are
+	void Upload();
+
+	GLuint Buffer() const { return _buffer; }
+	// Byte offset of the current frame's region in Buffer()
+	GLintptr RegionOffset() const { return static_cast<GLintptr>(_region * _regionSize); }
+
+private:
+	void allocate(GLsizeiptr regionSize);
+
+	GLuint _buffer = 0;
+	GLint _alignment = 256;
+	GLsizeiptr _regionSize = 0;
+	int _region = 0;
+	GLsync _fences[NumRegions] = {};
+	// The frame's matrices, the first _uploaded bytes are already in the region
+	std::vector<char> _staging;
+	size_t _uploaded = 0;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+#ifndef LIGHTBUFFER_H_INCLUDED
+#define LIGHTBUFFER_H_INCLUDED
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+// Light parameters of the Lights block in shaders/full.frag. The structs
+// mirror its std140 layout, pad members included, so a whole block is one
+// upload. The frame's lights are written into Edit() and Upload only sends
+// them when they differ from the last upload.
+class LightBuffer
+{
+public:
+	// Array sizes of the Lights block
+	static const int MaxDirLights = 10;
+	static const int MaxPointLights = 10;
+	static const int MaxSpotLights = 10;
+
+	struct DirLight
+	{
+		float direction[3];
+		float pad0;
+		float ambient[3];
+		float pad1;
+		float diffuse[3];
+		float pad2;
+		float specular[3];
+		float pad3;
+	};
+
+	struct PointLight
+	{
+		float position[3];
+		float constant;
+		float linear;
+		float quadratic;
+		float pad0[2];
+		float ambient[3];
+		float pad1;
+		float diffuse[3];
+		float pad2;
+		float specular[3];
+		float pad3;
+	};
+
+	struct SpotLight
+	{
+		float position[3];
+		float pad0;
+		float direction[3];
+		float cutOff;
+		float outerCutOff;
+		float constant;
+		float linear;
+		float quadratic;
+		float ambient[3];
+		float pad1;
+		float diffuse[3];
+		float pad2;
+		float specular[3];
+		float pad3;
+	};
+
+	struct Block
+	{
+		DirLight dirLights[MaxDirLights];
+		PointLight pointLights[MaxPointLights];
+		SpotLight spotLights[MaxSpotLights];
+		SpotLight flashLight;
+		float viewPos[3];
+		float pad0;
+	};
+
+	LightBuffer() = default;
+	~LightBuffer() = default;
+
+	LightBuffer(const LightBuffer&) = delete;
+	LightBuffer& operator=(const LightBuffer&) = delete;
+
+	// Creates the buffer and binds it to the Lights block's binding point
+	void Init(GLuint bindingPoint);
+	void Shutdown();
+
+	Block& Edit() { return _block; }
+
+	// Sends the block if it changed since the last upload, returns whether it did
+	bool Upload();
+
+	static void Set(float (&dst)[3], const glm::vec3& value);
+
+private:
+	GLuint _buffer = 0;
+	Block _block = {};
+	Block _uploaded = {};
+	bool _valid = false;
+};
+
+#endif
@@ -2,10 +2,55 @@
 
 #include <GL/glew.h>
 
+struct Material
+{
+	float diffuse[4];
+	float ambient[4];
+	float specular[4];
+	float emissive[4];
+	float shininess;
+	int texCount;
+	// Layer of the diffuse texture when it's a texture array, otherwise -1
+	int texLayer;
+};
+
+// Levels of detail a mesh can have, including the full detail mesh
+const int MaxMeshLods = 4;
+
 struct Mesh
 {
+    // VAO of the vertex arena block holding the mesh, shared with other meshes
     GLuint vao;
     GLuint texIndex;
     GLuint uniformBlockIndex;
     int numFaces;
+    // Where the mesh lives inside the arena block, indexOffset is in bytes
+    GLint baseVertex;
+    GLenum indexType;
+    GLsizeiptr indexOffset;
+    // Coarser levels of detail index the same vertices, level 0 is the full
+    // mesh (numFaces at indexOffset). lodError is the simplification error
+    // of each level in the mesh's own units.
+    int numLods;
+    int lodFaces[MaxMeshLods];
+    GLsizeiptr lodOffset[MaxMeshLods];
+    float lodError[MaxMeshLods];
+    // Bounds in the space of the nodes referencing the mesh
+    float aabbMin[3];
+    float aabbMax[3];
+};
+
+// Node of a model's hierarchy, meshes and children are ranges of Model::links
+struct Node
+{
+    // Column major, ready for CTM::MultMatrix
+    float transform[16];
+    unsigned int firstMesh;
+    unsigned int numMeshes;
+    unsigned int firstChild;
+    unsigned int numChildren;
+    // Bounds of the node's meshes and children, in the space after its
+    // transform. Empty (min > max) if the subtree has no meshes.
+    float aabbMin[3];
+    float aabbMax[3];
 };
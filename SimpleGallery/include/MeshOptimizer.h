@@ -0,0 +1,41 @@
+#pragma once
+#ifndef MESHOPTIMIZER_H_INCLUDED
+#define MESHOPTIMIZER_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Triangle and vertex reordering and level of detail generation run when a
+// model is cooked, see ModelCache::Cook
+namespace MeshOptimizer
+{
+	// Post-transform cache size Tipsify targets, small enough for any GPU
+	const unsigned int TargetCacheSize = 16;
+	// FIFO cache size used to report ACMR
+	const unsigned int ReportCacheSize = 32;
+
+	// Average cache miss ratio, vertices transformed per triangle with a FIFO
+	// post-transform cache. 0.5 is ideal for large grids, 3 means no reuse.
+	float ACMR(const uint32_t* indices, size_t numIndices, size_t numVertices, unsigned int cacheSize = ReportCacheSize);
+
+	// Reorders triangles for post-transform cache hits (Tipsify, Sander et al. 2007)
+	void OptimizeVertexCache(uint32_t* indices, size_t numIndices, size_t numVertices, unsigned int cacheSize = TargetCacheSize);
+
+	// Renumbers vertices in the order the triangles first use them so vertex
+	// fetch walks memory forward. remap[old] is the new index; unused vertices
+	// are moved to the end.
+	void OptimizeVertexFetch(uint32_t* indices, size_t numIndices, size_t numVertices, std::vector<uint32_t>& remap);
+
+	// Applies a remap from OptimizeVertexFetch to a vertex stream
+	void RemapStream(float* stream, size_t numVertices, unsigned int components, const std::vector<uint32_t>& remap);
+
+	// Vertex clustering (Rossignac and Borrel 1993): vertices sharing a grid
+	// cell of cellSize collapse onto the one closest to the cell's average and
+	// triangles that collapse or repeat are dropped. output indexes the same
+	// vertices as the input, so a coarser level needs no vertex data of its own.
+	void SimplifyClusters(const uint32_t* indices, size_t numIndices, const float* positions, size_t numVertices,
+	                      const float aabbMin[3], float cellSize, std::vector<uint32_t>& output);
+}
+
+#endif
@@ -1,51 +1,108 @@
 #pragma once
 
+#include <functional>
 #include <vector>
 #include <unordered_map>
 
 #include <GL/glew.h>
-#include <assimp/Importer.hpp>
-#include <assimp/PostProcess.h>
-#include <assimp/Scene.h>
+#include <glm/glm.hpp>
+
+namespace Assimp
+{
+	class Importer;
+}
 
 #include "Mesh.h"
+#include "ModelCache.h"
+#include "VertexArena.h"
 
-struct Material
+// Assimp post-processing per model, trading import time for mesh quality.
+// Fast only triangulates and fills in missing normals, Balanced also welds
+// vertices and drops degenerate data, Quality is Assimp's realtime quality preset.
+enum class ImportProfile
 {
-	float diffuse[4];
-	float ambient[4];
-	float specular[4];
-	float emissive[4];
-	float shininess;
-	int texCount;
+	Fast,
+	Balanced,
+	Quality
 };
 
-// Vertex Attribute Locations
-static GLuint vertexLoc = 0, normalLoc = 1, texCoordLoc = 2;
+unsigned int ImportProfileFlags(ImportProfile profile);
+const char* ImportProfileName(ImportProfile profile);
+
+// Time an import took, filled when the model cache was stale. The first
+// entry is the whole import, any others its per-step breakdown
+struct ImportStep
+{
+	const char* name;
+	double milliseconds;
+};
 
 struct Model
 {
 	std::string dirName = "models/helicopter/";
 	std::string modelname = "helicopter.obj";
 	bool opaque;
+	// stream textures coarse to fine by distance to the viewer, set before Upload
+	bool streamTextures = false;
+	// same-sized textures share a texture array, set before Upload
+	bool textureArrays = false;
+	// never moves, drawn from world space batches built at Upload, set before Upload
+	bool isStatic = false;
+	// post-processing used when the model has to be imported, set before Import
+	ImportProfile importProfile = ImportProfile::Quality;
+	std::vector<ImportStep> importTimings;
+	// also time a stale import's post-process steps one at a time, reads
+	// the model a second time
+	static bool importBreakdown;
 
 	~Model();
 
 	void SetModelFile(std::string dirName, std::string modelName)
+	{
+		if (Import(dirName, modelName))
+			Upload();
+	}
+
+	// CPU side of loading (file read, Assimp post-processing, bounding box).
+	// Doesn't touch OpenGL so it can run on a worker thread.
+	bool Import(std::string dirName, std::string modelName)
 	{
 		this->dirName = dirName;
 		this->modelname = modelName;
-		Import3DFromFile();
+		return Import3DFromFile();
+	}
+
+	// GL side of loading, must run on the GL thread after Import succeeded.
+	// The cooked scene is released afterwards, only the runtime tables remain.
+	void Upload()
+	{
 		LoadGLTextures();
 		genVAOsAndUniformBuffer();
+		genNodes();
+		if (streamTextures)
+			genTextureBounds();
+		if (isStatic)
+			genStaticBatches();
+		releaseCookedScene();
 	}
 
+	// Picks the finest mip level of every streamed texture from how close
+	// the viewer is to the meshes sampling it
+	void UpdateTextureStreaming(const glm::vec3& viewer) const;
+
+	// Calls visit for every mesh reference in the node hierarchy with the
+	// index of the mesh and the transform from its node to the model's space
+	void ForEachMesh(const std::function<void(unsigned int mesh, const glm::mat4& transform)>& visit) const;
+
 	std::vector<Mesh> meshes;
-	// Create an instance of the Importer class
-	Assimp::Importer importer;
+	// node hierarchy, nodes[0] is the root
+	std::vector<Node> nodes;
+	// mesh and child indices referenced by the nodes
+	std::vector<unsigned int> links;
 
-	// the global Assimp scene object
-	const aiScene* scene = nullptr;
+	// post-processed meshes, materials and node hierarchy, only held from
+	// Import until Upload has copied what rendering needs
+	ModelCache::CookedScene cooked;
 
 	// scale factor for the model to fit in the window
 	float scaleFactor;
@@ -53,27 +110,56 @@ struct Model
 	// map image filenames to textureIds
 	// pointer to texture Array
 	std::unordered_map<std::string, GLuint> textureIdMap;
+	// layer of each image in a texture array, arrays belong to this model
+	std::unordered_map<std::string, int> textureLayers;
+	std::vector<GLuint> arrayTextures;
 	std::unordered_map<std::string, GLuint> materialMap;
 
+	// world space bounds of the meshes sampling each streamed texture
+	struct TextureBounds
+	{
+		GLuint texture;
+		glm::vec3 min;
+		glm::vec3 max;
+	};
+	std::vector<TextureBounds> streamedTextures;
+
+	// static models merged into one world space mesh per material, texture
+	// and staticBatchRegion. Bounds and level of detail errors are in world
+	// units, every batch draws with the identity matrix in staticTransforms.
+	std::vector<Mesh> staticBatches;
+	GLuint staticTransforms = 0;
+	// region of a world position, batches don't span regions so they can
+	// still be culled one by one, set before Upload
+	std::function<int(const glm::vec3&)> staticBatchRegion;
+
 #define aisgl_min(x,y) (x<y?x:y)
 #define aisgl_max(x,y) (y>x?y:x)
 private:
-	void get_bounding_box_for_node(const aiNode* nd, aiVector3D* min, aiVector3D* max);
+	bool Import3DFromFile();
 
 
-	void get_bounding_box(aiVector3D* min, aiVector3D* max);
+	bool importWithProfile(Assimp::Importer& importer, const std::string& pFile);
+	void timeImportSteps(const std::string& pFile);
 
 
-	bool Import3DFromFile();
+	int LoadGLTextures();
 
 
-	int LoadGLTextures();
+	ArenaRange uploadMeshes(std::vector<GLint>& firstVertex, std::vector<GLsizeiptr>& firstIndexByte);
 
 
-	void set_float4(float f[4], float a, float b, float c, float d);
+	void genVAOsAndUniformBuffer();
 
-	void color4_to_float4(const aiColor4D* c, float f[4]);
 
+	void genNodes();
 
-	void genVAOsAndUniformBuffer();
+
+	void genTextureBounds();
+
+
+	void genStaticBatches();
+
+
+	void releaseCookedScene();
 };
@@ -0,0 +1,167 @@
+#pragma once
+#ifndef MODELCACHE_H_INCLUDED
+#define MODELCACHE_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <assimp/scene.h>
+
+#include "Mesh.h"
+
+// Binary cache of a post-processed Assimp scene ("cooked" model).
+// The file is written next to the source model the first time it is imported
+// and memory mapped on later launches so Assimp can be skipped entirely.
+// Triangles are stored in post-transform cache order and vertices in the
+// order the triangles first use them. Meshes carry up to MaxMeshLods levels
+// of detail simplified by vertex clustering, as extra index lists.
+//
+// Layout (all offsets are relative to the start of the file):
+//   Header | MaterialRecord[] | MeshRecord[] | NodeRecord[] | uint32 links[] | vertex/index data | lod indices
+namespace ModelCache
+{
+	const uint32_t Magic = 0x434D4753; // "SGMC"
+	const uint32_t Version = 5;
+
+	// Identifies the source file the cache was cooked from
+	struct SourceStamp
+	{
+		uint64_t mtime;
+		uint64_t size;
+		uint64_t hash;
+	};
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		SourceStamp model;
+		SourceStamp materials;
+		uint32_t numMaterials;
+		uint32_t numMeshes;
+		uint32_t numNodes;
+		uint32_t numLinks;
+		// Assimp post-process steps the scene was cooked with
+		uint32_t postProcess;
+		float sceneMin[3];
+		float sceneMax[3];
+		uint64_t fileSize;
+	};
+
+	struct MaterialRecord
+	{
+		Material material;
+		uint32_t hasOpacity;
+		char name[64];
+		char diffuseTexture[188];
+	};
+
+	enum MeshFlags : uint32_t
+	{
+		HasNormals = 1 << 0,
+		HasTexCoords = 1 << 1
+	};
+
+	struct MeshRecord
+	{
+		uint32_t numVertices;
+		uint32_t numFaces;
+		uint32_t materialIndex;
+		uint32_t flags;
+		float aabbMin[3];
+		float aabbMax[3];
+		// Byte offsets of the vertex streams, 0 if the stream is absent
+		uint64_t positions;
+		uint64_t normals;
+		uint64_t texCoords;
+		uint64_t indices;
+		// Levels of detail, level 0 is numFaces at indices
+		uint32_t numLods;
+		uint32_t lodFaces[MaxMeshLods];
+		float lodError[MaxMeshLods];
+		uint64_t lodIndices[MaxMeshLods];
+	};
+
+	struct NodeRecord
+	{
+		// Column major, ready for CTM::MultMatrix
+		float transform[16];
+		// Ranges into the links table
+		uint32_t firstMesh;
+		uint32_t numMeshes;
+		uint32_t firstChild;
+		uint32_t numChildren;
+	};
+
+	// Read-only memory mapping of a cache file
+	class MappedFile
+	{
+	public:
+		MappedFile() = default;
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool Open(const std::string& path);
+		void Close();
+
+		const char* Data() const { return _data; }
+		size_t Size() const { return _size; }
+
+	private:
+		const char* _data = nullptr;
+		size_t _size = 0;
+		void* _file = nullptr;
+		void* _mapping = nullptr;
+	};
+
+	// View over a cooked model, backed either by a mapped cache file or by
+	// an in-memory blob freshly cooked from Assimp
+	struct CookedScene
+	{
+		const Header* header = nullptr;
+		const MaterialRecord* materials = nullptr;
+		const MeshRecord* meshes = nullptr;
+		const NodeRecord* nodes = nullptr;
+		const uint32_t* links = nullptr;
+
+		const float* Positions(const MeshRecord& mesh) const;
+		const float* Normals(const MeshRecord& mesh) const;
+		const float* TexCoords(const MeshRecord& mesh) const;
+		const unsigned int* Indices(const MeshRecord& mesh) const;
+		const unsigned int* Indices(const MeshRecord& mesh, uint32_t lod) const;
+
+		bool Empty() const { return header == nullptr; }
+		void Release();
+
+		std::vector<char> blob;
+		MappedFile mapped;
+
+	private:
+		const char* base() const;
+	};
+
+	// Prints a multi-line report with one write. Models are imported and
+	// cooked on the worker pool, their reports would interleave line by line.
+	void PrintReport(const std::string& report);
+
+	SourceStamp StampFile(const std::string& path, bool computeHash);
+	// Same, false if the file can't be stat'ed rather than an all zero stamp
+	bool StampFile(const std::string& path, bool computeHash, SourceStamp& stamp);
+
+	// Checks a recorded stamp against the file on disk. A touched file whose
+	// contents did not change is still considered fresh, stamp is then updated.
+	bool IsFresh(const std::string& path, SourceStamp& recorded, bool& restamped);
+
+	// Returns true if the cache at cachePath was cooked from the given sources
+	// with the given post-process steps and maps it into scene. Falls back to
+	// hashing when only the mtime differs.
+	bool Load(const std::string& cachePath, const std::string& modelPath, const std::string& materialPath, uint32_t postProcess, CookedScene& scene);
+
+	// Cooks an Assimp scene into scene.blob and writes it to cachePath
+	bool Cook(const aiScene* source, const std::string& modelPath, const std::string& materialPath, uint32_t postProcess, const std::string& cachePath, CookedScene& scene);
+}
+
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+#ifndef RENDERQUEUE_H_INCLUDED
+#define RENDERQUEUE_H_INCLUDED
+
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "InstanceBuffer.h"
+#include "Mesh.h"
+#include "ShaderPermutations.h"
+
+// Passes in submission order, the top bits of a sort key
+enum class RenderPass
+{
+	Opaque,
+	Reflection,
+	Translucent
+};
+
+// Draws are queued as packets during traversal and issued on Submit, sorted
+// by a 64-bit key so packets sharing state end up next to each other. Binds
+// go through GLState, which drops the ones that match what's bound.
+//
+// Every draw is instanced, its model matrices are a range of a uniform
+// buffer bound to the Instances block: the frame's InstanceBuffer region or
+// a model's resident static transforms.
+//
+// Key layout, most significant first:
+//   pass (2) | shader variant (4) | material UBO (16) | texture (16) | VAO (10) | sequence (16)
+class RenderQueue
+{
+public:
+	struct Bindings
+	{
+		GLuint materialUniLoc;
+		GLuint instancesUniLoc;
+	};
+
+	struct Stats
+	{
+		unsigned long draws;
+	};
+
+	RenderQueue() = default;
+	~RenderQueue() = default;
+
+	RenderQueue(const RenderQueue&) = delete;
+	RenderQueue& operator=(const RenderQueue&) = delete;
+
+	// Matrices added through the queue go to transforms, it's uploaded
+	// before each Submit draws. Each packet draws with the program shaders
+	// selects for its variant.
+	void Init(const Bindings& bindings, InstanceBuffer* transforms, const ShaderPermutations* shaders);
+
+	// Pass of the packets added from now on
+	void SetPass(RenderPass pass) { _pass = pass; }
+
+	// Buffer value of AddInstanced for ranges of the frame's InstanceBuffer region
+	static const GLuint FrameTransforms = 0;
+
+	// Model matrix for the packets that follow, returns its offset in the
+	// frame's InstanceBuffer region
+	GLintptr AddTransform(const glm::mat4& model);
+
+	void Add(const Mesh& mesh, int lod, GLuint material, GLuint texture, unsigned int variant, GLintptr transform);
+	// Draws instanceCount instances whose matrices are in buffer from
+	// instanceOffset on, an InstanceBuffer batch (buffer FrameTransforms) or
+	// a model's static transforms
+	void AddInstanced(const Mesh& mesh, int lod, GLuint material, GLuint texture, unsigned int variant,
+	                  GLuint buffer, GLintptr instanceOffset, GLsizei instanceCount);
+
+	// Sorts and issues the queued packets, then empties the queue. The state
+	// of the last packet stays bound, GL state outside the packets
+	// (blending, stencil, ...) is left to the caller.
+	void Submit();
+
+	// Starts counting a new frame, the finished frame's counts stay readable
+	void BeginFrame();
+	const Stats& LastFrame() const { return _lastFrame; }
+
+private:
+	struct DrawPacket
+	{
+		uint64_t key;
+		const Mesh* mesh;
+		int lod;
+		GLuint material;
+		GLuint texture;
+		unsigned int variant;
+		GLuint instanceBuffer;
+		GLintptr instanceOffset;
+		GLsizei instanceCount;
+	};
+
+	struct SortEntry
+	{
+		uint64_t key;
+		uint32_t packet;
+	};
+
+	uint64_t makeKey(unsigned int variant, GLuint material, GLuint texture, GLuint vao) const;
+	void sort();
+
+	Bindings _bindings = {};
+	InstanceBuffer* _transforms = nullptr;
+	const ShaderPermutations* _shaders = nullptr;
+	RenderPass _pass = RenderPass::Opaque;
+
+	std::vector<DrawPacket> _packets;
+	std::vector<SortEntry> _order;
+	std::vector<SortEntry> _scratch;
+
+	Stats _frame = {};
+	Stats _lastFrame = {};
+};
+
+#endif
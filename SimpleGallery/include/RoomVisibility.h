@@ -0,0 +1,69 @@
+#pragma once
+#ifndef ROOMVISIBILITY_H_INCLUDED
+#define ROOMVISIBILITY_H_INCLUDED
+
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+// Cell and portal visibility for the gallery: rooms are cells, the doorways
+// in the walls between neighbouring rooms are portals. Each frame the rooms
+// seen from the camera's room are found by walking through the doorways,
+// narrowing the screen rectangle at every doorway passed.
+class RoomVisibility
+{
+public:
+	RoomVisibility() = default;
+	~RoomVisibility() = default;
+
+	// Rooms are squares of roomSize around the given x, z centers, rooms
+	// whose centers are roomSize apart share a wall with a doorway in the middle
+	void Setup(const GLfloat centers[][2], int numRooms, GLfloat roomSize);
+
+	// Recomputes the visible rooms for a camera at eye
+	void Update(const glm::vec3& eye, const glm::mat4& viewProjection);
+
+	// Room containing the point, -1 if it's outside the gallery
+	int RoomAt(GLfloat x, GLfloat z) const;
+
+	bool Visible(int room) const;
+	// Whether the room holding the point is visible, points outside every room are
+	bool Visible(GLfloat x, GLfloat z) const;
+	// False only if the box, in the space model maps to world, lies within
+	// a single room that can't be seen
+	bool Intersects(const glm::mat4& model, const float aabbMin[3], const float aabbMax[3]) const;
+
+	int NumRooms() const { return static_cast<int>(_rooms.size()); }
+	int NumVisible() const;
+
+private:
+	// Screen rectangle in normalized device coordinates
+	struct Rect
+	{
+		GLfloat minX, minY, maxX, maxY;
+	};
+
+	struct Room
+	{
+		glm::vec2 center;
+		std::vector<int> portals;
+	};
+
+	struct Portal
+	{
+		int rooms[2];
+		// Doorway opening, a vertical quad on the shared wall
+		glm::vec3 corners[4];
+	};
+
+	static int clipToNearPlane(const Portal& portal, const glm::mat4& viewProjection, glm::vec4 clipped[8]);
+	void flood(int room, const Rect& rect, const glm::vec3& eye, const glm::mat4& viewProjection, std::vector<bool>& onPath);
+
+	std::vector<Room> _rooms;
+	std::vector<Portal> _portals;
+	std::vector<bool> _visible;
+	GLfloat _roomSize = 0.0f;
+};
+
+#endif
@@ -3,30 +3,49 @@
 #define SHADER_H_INCLUDED
 
 #include <iostream>
+#include <string>
 
 #include <GL/glew.h>
 
 class Shader
 {
 public:
+	// Locations of the uniforms the application sets, looked up once when the
+	// program links. -1 for the ones the program doesn't use.
+	struct Uniforms
+	{
+		GLint texUnit;
+		GLint texArrayUnit;
+		GLint compactVertices;
+		GLint positionScale;
+		GLint positionBias;
+	};
+
 	Shader() = default;
 	~Shader() = default;
 
 	explicit Shader(const char* path);
 
-	void Setup(const char* path);
-	void Setup(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr);
+	// defines go right after the #version line of every stage
+	void Setup(const char* path, const std::string& defines = std::string());
+	void Setup(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr,
+	           const std::string& defines = std::string());
 
 	void Use() const;
 
 	const GLuint& operator()() const;
 
+	const Uniforms& Locations() const { return _uniforms; }
+
 private:
 	const std::string _vertexShaderExt = ".vert";
 	const std::string _fragmentShaderExt = ".frag";
 	GLuint _program;
+	Uniforms _uniforms = {};
 
 	static void checkCompileErrors(const GLuint& shader, const std::string& type);
+	static void insertDefines(std::string& code, const std::string& defines);
+	void resolveUniforms();
 };
 
 #endif
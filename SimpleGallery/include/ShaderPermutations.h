@@ -0,0 +1,79 @@
+#pragma once
+#ifndef SHADERPERMUTATIONS_H_INCLUDED
+#define SHADERPERMUTATIONS_H_INCLUDED
+
+#include <string>
+
+#include <GL/glew.h>
+
+#include "Shader.h"
+
+// Per-draw variant bits, part of a draw's sort key. They pick the texture
+// source of the draw's program.
+namespace ShaderVariant
+{
+	// texId of RenderModel/RenderStatic replaces the mesh's texture
+	const unsigned int ForceTextured = 1 << 0;
+	// The mesh's material has a texture of its own
+	const unsigned int Textured = 1 << 1;
+	// That texture is a layer of a texture array
+	const unsigned int TextureArray = 1 << 2;
+}
+
+// Every program a shader can be drawn with, built once at startup with the
+// branches resolved by #defines (see the top of shaders/full.frag) so each
+// fragment runs straight-line code for its mode:
+//   lit or unlit, set by Window::SetDrawingMode
+//   material colour, 2D texture or texture array, from a draw's variant
+//   point light bucket, the frame's visible lights
+// Lit programs loop over a fixed number of lights, the slots the frame
+// doesn't use must hold lights that add nothing.
+class ShaderPermutations
+{
+public:
+	// Where a program's surface colour comes from
+	enum Sampling
+	{
+		MaterialColor,
+		Texture2D,
+		TextureArray,
+		NumSamplings
+	};
+
+	// Point lights the lit programs loop over, a frame takes the smallest
+	// bucket that holds its lights
+	static const int NumPointLightBuckets = 3;
+	static const int PointLightBuckets[NumPointLightBuckets];
+
+	ShaderPermutations() = default;
+	~ShaderPermutations() = default;
+
+	ShaderPermutations(const ShaderPermutations&) = delete;
+	ShaderPermutations& operator=(const ShaderPermutations&) = delete;
+
+	// Builds path.vert/path.frag for every permutation, lit programs loop
+	// over dirLights directional and spotLights spot lights
+	void Setup(const char* path, int dirLights, int spotLights);
+
+	// Mode of the draws that follow
+	void SetMode(bool lighting, bool textured);
+	// Point lights in the frame, returns the slots the lit programs read
+	int SetPointLights(int count);
+
+	// Program of a draw with the given ShaderVariant bits in the current mode
+	const Shader& Select(unsigned int variant) const;
+
+	// Every program, to set what they share at startup
+	static const int NumPrograms = NumSamplings * (1 + NumPointLightBuckets);
+	Shader& operator[](int index) { return _programs[index]; }
+
+private:
+	static std::string defines(Sampling sampling, int pointLights, int dirLights, int spotLights);
+
+	Shader _programs[NumPrograms];
+	bool _lighting = true;
+	bool _textured = true;
+	int _bucket = NumPointLightBuckets - 1;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+#ifndef TEXTURECOOK_H_INCLUDED
+#define TEXTURECOOK_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+
+// Offline ("cooked") textures: the full mip chain computed on the CPU and,
+// where the driver exposes S3TC, block compressed to DXT1/DXT5. Cooked images
+// are written next to their source as <image>.sgtx and uploaded as is, which
+// skips both image decoding and glGenerateMipmap on later launches.
+namespace TextureCook
+{
+	const uint32_t Magic = 0x58544753; // "SGTX"
+	const uint32_t Version = 1;
+
+	struct Level
+	{
+		int width;
+		int height;
+		size_t offset;
+		size_t size;
+	};
+
+	struct CookedImage
+	{
+		// GL_RGBA for uncompressed levels, otherwise the S3TC internal format
+		GLenum format = GL_RGBA;
+		int width = 0;
+		int height = 0;
+		// levels may hold only part of the chain, starting at firstLevel
+		int firstLevel = 0;
+		int numLevels = 0;
+		std::vector<Level> levels;
+		std::vector<unsigned char> data;
+
+		bool Compressed() const { return format != GL_RGBA; }
+	};
+
+	// Builds the mip chain of an RGBA8 image and compresses it if allowed
+	void Cook(const unsigned char* rgba, int width, int height, bool compress, CookedImage& image);
+
+	// Loads a cooked image if it is fresh and matches the wanted compression.
+	// A non zero maxSize loads only the mip tail, levels no larger than maxSize.
+	bool Load(const std::string& cachePath, const std::string& sourcePath, bool compress, CookedImage& image, int maxSize = 0);
+
+	// Reads only the format, size and level count of a fresh cooked image
+	bool LoadInfo(const std::string& cachePath, const std::string& sourcePath, bool compress, CookedImage& image);
+
+	// Content hash of the source a cooked image was made from, only while the
+	// source's mtime and size still match the record. Doesn't read the source.
+	bool RecordedHash(const std::string& cachePath, const std::string& sourcePath, uint64_t& hash);
+
+	// Loads levels [first, last] of a cooked image already known to be fresh
+	bool LoadLevels(const std::string& cachePath, int first, int last, CookedImage& image);
+
+	// Saves a complete mip chain
+	bool Save(const std::string& cachePath, const std::string& sourcePath, const CookedImage& image);
+
+	// Bytes of one width x height level in format
+	size_t LevelSize(int width, int height, GLenum format);
+
+	// First level of a width x height chain that is no larger than maxSize
+	int TailLevel(int width, int height, int maxSize);
+
+	// Drops every level outside [first, last]
+	void KeepLevels(CookedImage& image, int first, int last);
+}
+
+#endif
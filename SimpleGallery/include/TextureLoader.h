@@ -0,0 +1,165 @@
+#pragma once
+#ifndef TEXTURELOADER_H_INCLUDED
+#define TEXTURELOADER_H_INCLUDED
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "TextureCook.h"
+#include "ThreadPool.h"
+
+// Loads image files on the worker pool and streams them to the GPU through
+// a ring of pixel unpack buffers. Images are cooked (mip chain, S3TC) on first
+// use and loaded from the cooked file afterwards. Requested textures are
+// usable immediately, they sample a placeholder until their real pixels are resident.
+class TextureLoader
+{
+public:
+	TextureLoader() = default;
+	~TextureLoader() = default;
+
+	TextureLoader(const TextureLoader&) = delete;
+	TextureLoader& operator=(const TextureLoader&) = delete;
+
+	static TextureLoader& Instance();
+
+	// GL thread only
+	void Init();
+	void Shutdown();
+
+	// Returns a texture name right away and queues the file for decoding.
+	// One-off loads pass cook false so no cooked file is left next to the
+	// image. GL thread only.
+	GLuint Request(const std::string& filename, bool cook = true);
+
+	// Deletes a texture from Request. A decode still in flight is dropped
+	// when it lands, the name is only freed then so it can't be recycled
+	// under it. GL thread only.
+	void Discard(const GLuint& texture);
+
+	// Like Request but only the mip tail is loaded up front, finer levels
+	// stream in and out following SetStreamLevel. GL thread only.
+	GLuint RequestStreamed(const std::string& filename);
+
+	// Size and format an image will load with, false until it has been
+	// cooked. Doesn't touch OpenGL.
+	bool Probe(const std::string& filename, int& width, int& height, GLenum& format) const;
+
+	// Returns a GL_TEXTURE_2D_ARRAY with one layer per file, in order, and
+	// queues every file for decoding. The files must have probed the given
+	// size and format, a layer that loads differently is left out. Streamed
+	// arrays stream all layers together, down to the finest level any of
+	// them wants. GL thread only.
+	GLuint RequestArray(const std::vector<std::string>& filenames, int width, int height, GLenum format, bool streamed);
+
+	bool IsArray(const GLuint& texture) const { return _arrays.find(texture) != _arrays.end(); }
+
+	// Texture unit arrays are bound to, texArrayUnit in shaders/full.frag
+	static const GLint ArrayUnit = 1;
+
+	// Finest mip level wanted for a streamed texture, 0 is full resolution.
+	// Missing levels are loaded one per pump, coarse to fine; finer resident
+	// levels are evicted right away.
+	void SetStreamLevel(const GLuint& texture, int level);
+
+	// Uploads decoded images until the time budget is spent or every unpack
+	// buffer is still in flight. Call once per frame on the GL thread.
+	void Pump(double budgetMs = 4.0);
+
+	// Number of requested textures that aren't resident yet
+	int Pending() const { return _pending; }
+
+	// DevIL's bound image is process wide, code outside the loader holds
+	// this for its whole DevIL sequence while decodes may be running
+	static std::unique_lock<std::mutex> LockDevIL() { return std::unique_lock<std::mutex>(_decodeMutex); }
+
+private:
+	struct DecodedImage
+	{
+		GLuint texture;
+		std::string filename;
+		bool success;
+		// Finer level of an already resident streamed texture
+		bool refinement;
+		// Layer of an array texture, -1 for 2D textures
+		int layer;
+		// Load and save the cooked file, false decodes the source only
+		bool cook;
+		TextureCook::CookedImage cooked;
+	};
+
+	struct StreamState
+	{
+		std::string filename;
+		GLenum format;
+		// Finest level on the GPU, tailLevel is -1 until the tail is resident
+		int residentLevel;
+		int tailLevel;
+		// Finest level that can be loaded, raised if a refinement fails
+		int finestLevel;
+		int wantedLevel;
+		bool loading;
+	};
+
+	struct ArrayState
+	{
+		std::vector<std::string> filenames;
+		int width;
+		int height;
+		GLenum format;
+		// Level every layer is loading, it's only sampled once all are in
+		int loadingLevel;
+		int pendingLayers;
+		bool failed;
+	};
+
+	struct UploadSlot
+	{
+		GLuint pbo;
+		GLsizeiptr capacity;
+		GLsync fence;
+	};
+
+	static const int NumUploadSlots = 4;
+	// Streamed textures start with the levels no larger than this
+	static const int StreamTailSize = 64;
+
+	// DevIL keeps the bound image in global state, decodes have to take turns
+	static std::mutex _decodeMutex;
+
+	UploadSlot _slots[NumUploadSlots] = {};
+	int _nextSlot = 0;
+	int _pending = 0;
+	bool _compress = false;
+	std::atomic<bool> _cancelled{false};
+
+	BlockingQueue<DecodedImage> _decoded;
+	std::deque<DecodedImage> _ready;
+	std::unordered_map<GLuint, StreamState> _streams;
+	std::unordered_map<GLuint, ArrayState> _arrays;
+	// 2D textures from Request still decoding, true once discarded
+	std::unordered_map<GLuint, bool> _inFlight;
+
+	GLuint request(const std::string& filename, bool streamed, bool cook);
+	void queueDecode(const GLuint& texture, const std::string& filename, int layer, bool streamed, bool cook);
+	void queueRefinement(const GLuint& texture, const std::string& filename, int layer, int level);
+	void updateStreams();
+	void evict(const GLuint& texture, StreamState& stream, int level) const;
+
+	void decode(DecodedImage& image) const;
+	void decodeTail(DecodedImage& image) const;
+	void decodeRefinement(DecodedImage& image) const;
+	bool decodeSource(DecodedImage& image) const;
+	bool upload(const DecodedImage& image);
+	void setPlaceholder(const GLuint& texture) const;
+	void allocateArrayLevels(const GLuint& texture, const ArrayState& array, int first, int last) const;
+	void finishArrayLevel(const GLuint& texture, ArrayState& array, bool refinement);
+};
+
+#endif
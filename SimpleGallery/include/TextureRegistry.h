@@ -0,0 +1,52 @@
+#pragma once
+#ifndef TEXTUREREGISTRY_H_INCLUDED
+#define TEXTUREREGISTRY_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include <GL/glew.h>
+
+// Process wide set of textures keyed by a hash of the image file's contents.
+// Every distinct image is decoded and uploaded once no matter how many models
+// or paths refer to it; textures are deleted when the last user releases them.
+class TextureRegistry
+{
+public:
+	TextureRegistry(const TextureRegistry&) = delete;
+	TextureRegistry& operator=(const TextureRegistry&) = delete;
+
+	static TextureRegistry& Instance();
+
+	// GL thread only. Streamed textures load their mip tail first, see
+	// TextureLoader::RequestStreamed; a shared texture keeps its first mode.
+	// A file that can't be stat'ed is never shared.
+	GLuint Acquire(const std::string& filename, bool streamed = false);
+	void Release(const GLuint& texture);
+
+	// Prints hit/miss counts and the video memory saved by sharing
+	void ReportStats() const;
+
+private:
+	TextureRegistry() = default;
+	~TextureRegistry() = default;
+
+	struct Entry
+	{
+		GLuint texture;
+		uint64_t fileSize;
+		std::string filename;
+		int refCount;
+		int acquires;
+	};
+
+	std::unordered_map<uint64_t, Entry> _entries;
+	std::unordered_map<GLuint, uint64_t> _keys;
+	unsigned int _hits = 0;
+	unsigned int _misses = 0;
+
+	static size_t residentBytes(const GLuint& texture);
+};
+
+#endif
@@ -0,0 +1,94 @@
+#pragma once
+#ifndef THREADPOOL_H_INCLUDED
+#define THREADPOOL_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Unbounded multi-producer/multi-consumer queue
+template <typename T>
+class BlockingQueue
+{
+public:
+	void Push(T value)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_items.push_back(std::move(value));
+		}
+		_ready.notify_one();
+	}
+
+	// Blocks until an item is available or the queue is closed.
+	// Returns false once the queue is closed and drained.
+	bool Pop(T& value)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_ready.wait(lock, [this] { return !_items.empty() || _closed; });
+		if (_items.empty())
+			return false;
+		value = std::move(_items.front());
+		_items.pop_front();
+		return true;
+	}
+
+	// Never blocks, returns false if nothing is queued
+	bool TryPop(T& value)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_items.empty())
+			return false;
+		value = std::move(_items.front());
+		_items.pop_front();
+		return true;
+	}
+
+	void Close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_closed = true;
+		}
+		_ready.notify_all();
+	}
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _ready;
+	std::deque<T> _items;
+	bool _closed = false;
+};
+
+// Fixed set of worker threads for CPU side loading work.
+// Tasks must not touch OpenGL, the context is only current on the main thread.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned int numThreads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Process wide pool sized to the number of cores
+	static ThreadPool& Instance();
+
+	void Submit(std::function<void()> task);
+
+	// Finishes queued tasks and joins the workers
+	void Shutdown();
+
+	unsigned int Size() const { return static_cast<unsigned int>(_workers.size()); }
+
+private:
+	BlockingQueue<std::function<void()>> _tasks;
+	std::vector<std::thread> _workers;
+
+	void workerLoop(unsigned int index);
+};
+
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Records timed zones from any thread and writes them as a Chrome trace
+// (chrome://tracing or https://ui.perfetto.dev). Recording stops once the
+// trace is written so per-frame work isn't traced after startup.
+class Trace
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	Trace(const Trace&) = delete;
+	Trace& operator=(const Trace&) = delete;
+
+	static Trace& Instance();
+
+	bool Enabled() const { return _enabled; }
+
+	// Labels the calling thread in the trace viewer
+	void NameThread(const std::string& name);
+
+	// Adds a complete zone, detail shows up in the zone's arguments
+	void Record(const char* name, const std::string& detail, Clock::time_point start, Clock::time_point end);
+
+	// Time the trace started at, zone times are relative to it
+	Clock::time_point Start() const { return _start; }
+
+	// Writes every zone recorded so far and stops recording
+	bool Write(const std::string& path);
+
+private:
+	Trace();
+	~Trace() = default;
+
+	struct Event
+	{
+		const char* name;
+		std::string detail;
+		long long start;
+		long long duration;
+		int thread;
+	};
+
+	struct ThreadName
+	{
+		int thread;
+		std::string name;
+	};
+
+	const Clock::time_point _start;
+	std::atomic<bool> _enabled{true};
+	std::atomic<int> _nextThread{1};
+
+	std::mutex _mutex;
+	std::vector<Event> _events;
+	std::vector<ThreadName> _threadNames;
+
+	int threadId();
+	static std::string escape(const std::string& text);
+};
+
+// Times its own lifetime, e.g. TraceZone zone("Model::Import3DFromFile", pFile);
+class TraceZone
+{
+public:
+	explicit TraceZone(const char* name, const std::string& detail = std::string());
+	~TraceZone();
+
+	TraceZone(const TraceZone&) = delete;
+	TraceZone& operator=(const TraceZone&) = delete;
+
+private:
+	const char* _name;
+	std::string _detail;
+	Trace::Clock::time_point _start;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+#ifndef VERTEXARENA_H_INCLUDED
+#define VERTEXARENA_H_INCLUDED
+
+#include <cstdint>
+#include <vector>
+
+#include <GL/glew.h>
+
+// Vertex Attribute Locations
+static GLuint vertexLoc = 0, normalLoc = 1, texCoordLoc = 2;
+
+// Interleaved vertex as stored in the arena
+struct Vertex
+{
+	float position[3];
+	float normal[3];
+	float texCoord[2];
+};
+
+// Half the size of Vertex: position as unorm16 relative to the mesh's
+// bounding box, octahedral normal as two snorm16 and half float texcoords.
+// full.vert decodes it when compactVertices is set.
+struct CompactVertex
+{
+	uint16_t position[4];
+	int16_t normal[2];
+	uint16_t texCoord[2];
+};
+
+enum class VertexFormat
+{
+	Float,
+	Compact
+};
+
+// Quantizes vertices against a mesh bounding box, see CompactVertex
+void PackVertices(const Vertex* vertices, GLsizei numVertices, const float aabbMin[3], const float aabbMax[3], CompactVertex* packed);
+
+// A contiguous range of vertices and indices inside one arena block
+struct ArenaRange
+{
+	GLuint vao;
+	GLint firstVertex;
+	// Byte offset of the range's index data in the block's index buffer
+	GLsizeiptr indexOffset;
+};
+
+// Sub-allocates the geometry of every model from a few large interleaved
+// vertex buffers and index buffers. Each block has one VAO; meshes draw from
+// it with glDrawElementsBaseVertex using their vertex and index offsets.
+class VertexArena
+{
+public:
+	VertexArena(const VertexArena&) = delete;
+	VertexArena& operator=(const VertexArena&) = delete;
+
+	static VertexArena& Instance();
+
+	// Layout of every vertex in the arena, only settable before the first upload
+	void SetFormat(VertexFormat format);
+	VertexFormat Format() const { return _format; }
+	GLsizei Stride() const { return _format == VertexFormat::Compact ? sizeof(CompactVertex) : sizeof(Vertex); }
+
+	// Reserves and fills space for numVertices vertices and indexBytes of index
+	// data. Vertices are Vertex or CompactVertex as set by SetFormat; indices
+	// may mix 16 and 32 bit meshes, each aligned to its index size, and are
+	// relative to the start of the range. GL thread only.
+	ArenaRange Upload(const void* vertices, GLsizei numVertices, const void* indices, GLsizeiptr indexBytes);
+
+	// Deletes every block, GL thread only
+	void Shutdown();
+
+	size_t NumBlocks() const { return _blocks.size(); }
+
+	// Bytes of vertex and index data uploaded so far
+	size_t VertexBytes() const;
+	size_t IndexBytes() const;
+
+private:
+	VertexArena() = default;
+	~VertexArena() = default;
+
+	// Big enough for every model in the gallery to share one block
+	static const GLsizei BlockVertices = 1 << 19;
+	static const GLsizeiptr BlockIndexBytes = sizeof(GLuint) * (3 << 19);
+
+	struct Block
+	{
+		GLuint vao;
+		GLuint vertexBuffer;
+		GLuint indexBuffer;
+		GLsizei vertexCapacity;
+		GLsizeiptr indexCapacity;
+		GLsizei usedVertices;
+		GLsizeiptr usedIndexBytes;
+	};
+
+	std::vector<Block> _blocks;
+	VertexFormat _format = VertexFormat::Float;
+
+	Block& blockFor(GLsizei numVertices, GLsizeiptr indexBytes);
+};
+
+#endif
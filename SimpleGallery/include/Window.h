@@ -7,7 +7,7 @@
 #include "CTM.h"
 #include "Camera.h"
 #include "Model.h"
-#include "Shader.h"
+#include "ShaderPermutations.h"
 
 #define GLUT_KEY_ESCAPE 27
 #define GLUT_KEY_PAGE_UP_CUSTOM 1000
@@ -88,7 +88,10 @@ struct Window
 
     bool textured;
 
-    Shader* _shader;
+    // Draw coarser levels of detail for distant meshes
+    bool levelOfDetail;
+
+    ShaderPermutations* _shaders;
 
     bool lights[9];
     bool spotLights[2];
@@ -98,13 +101,12 @@ struct Window
     void Display();
 
     // Configuration methods
-    void SetShader(Shader* shader);
+    void SetShaders(ShaderPermutations* shaders);
     void SetDrawingMode();
     void SetAntiAliasing() const;
     void SetBlending() const;
-    void SetTexture() const;
     void SetTimeOfDay() const;
-    void SetViewMatrix(const Shader& shader) const;
+    void SetViewMatrix() const;
 
     std::string GetDisplayStateString();
 
@@ -1,5 +1,12 @@
 #version 330 core
 
+// Built once per permutation by ShaderPermutations, which defines
+//   TEXTURE_2D or TEXTURE_ARRAY  surface colour from texUnit or a layer of
+//                                texArrayUnit, the material's colours if neither
+//   LIGHTING                     lit by DIR_LIGHTS, POINT_LIGHTS and
+//                                SPOT_LIGHTS lights plus the flash light,
+//                                the surface colour as is if not defined
+
 layout (std140) uniform Material {
     vec4 diffuse;
     vec4 ambient;
@@ -7,6 +14,7 @@ layout (std140) uniform Material {
     vec4 emissive;
     float shininess;
     int texCount;
+    int texLayer;
 };
 
 struct DirLight {
@@ -54,21 +62,23 @@ in vec2 TexCoords;
 
 out vec4 OutColor;
 
-uniform vec3 viewPos;
-
-uniform DirLight dirLights[MAX_DIR_LIGHTS];
-uniform PointLight pointLights[MAX_POINT_LIGHTS];
-uniform SpotLight spotLights[MAX_SPOT_LIGHTS];
-uniform SpotLight flashLight;
-uniform int numOfDirLights = 0;
-uniform int numOfPointLights = 0;
-uniform int numOfSpotLights = 0;
-uniform bool flashLightOn;
+// Filled from LightBuffer::Block, sizes must match LightBuffer's. Slots
+// the frame doesn't use hold lights with no colour.
+layout (std140) uniform Lights {
+    DirLight dirLights[MAX_DIR_LIGHTS];
+    PointLight pointLights[MAX_POINT_LIGHTS];
+    SpotLight spotLights[MAX_SPOT_LIGHTS];
+    SpotLight flashLight;
+    vec3 viewPos;
+};
 
 uniform sampler2D texUnit;
-uniform bool lighting;
-uniform bool isTextured;
-uniform bool forceTextured;
+// Materials with a texLayer sample their texture from this array instead
+uniform sampler2DArray texArrayUnit;
+
+// Surface colours the lights are multiplied with
+vec4 surfaceColor;
+vec4 surfaceSpecular;
 
 // Function prototypes
 vec4 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir);
@@ -79,58 +89,48 @@ void SetLightColor(vec3 lambient, vec3 ldiffuse, vec3 lspecular, inout vec4 _amb
 
 void main()
 {
+#if defined(TEXTURE_2D)
+    surfaceColor = texture(texUnit, TexCoords);
+    surfaceSpecular = surfaceColor;
+#elif defined(TEXTURE_ARRAY)
+    surfaceColor = texture(texArrayUnit, vec3(TexCoords, float(texLayer)));
+    surfaceSpecular = surfaceColor;
+#else
+    surfaceColor = diffuse;
+    surfaceSpecular = specular;
+#endif
+
+#ifdef LIGHTING
     // Properties
     vec3 norm = normalize(Normal);
     vec3 viewDir = normalize(viewPos - FragPos);
-    vec4 result;
-    
-    if (lighting) {
-        // == ======================================
-        // Our lighting is set up in 3 phases: directional, point lights and an optional flashlight
-        // For each phase, a calculate function is defined that calculates the corresponding color
-        // per lamp. In the main() function we take all the calculated colors and sum them up for
-        // this fragment's final color.
-        // == ======================================
-        // Phase 1: Directional lighting
-        if (numOfDirLights > 0 && numOfDirLights <= MAX_DIR_LIGHTS) {
-            for (int i = 0; i < numOfDirLights; ++i) {
-                result += CalcDirLight(dirLights[i], norm, viewDir);
-            }
-        }
-        
-        // Phase 2: Point lights
-        if (numOfPointLights > 0 && numOfPointLights <= MAX_POINT_LIGHTS) {
-            for (int i = 0; i < numOfPointLights; ++i) {
-                result += CalcPointLight(pointLights[i], norm, FragPos, viewDir);  
-            }
-        }
-        
-        // Phase 3: Spot light
-        if (numOfSpotLights > 0 && numOfSpotLights <= MAX_SPOT_LIGHTS) {
-            for (int i = 0; i < numOfSpotLights; ++i) {
-                result += CalcSpotLight(spotLights[i], norm, FragPos, viewDir);
-            }
-        }
- 
-        if (flashLightOn) {
-            result += CalcSpotLight(flashLight, norm, FragPos, viewDir);
-        }
-    } else {
-        if (isTextured) {
-            if (forceTextured) {
-                result = texture(texUnit, TexCoords);
-            } else {
-                if (texCount == 0) {
-                    result = diffuse;
-                } else {
-                    result = texture(texUnit, TexCoords);
-                }
-            }
-        } else {
-            result = diffuse;
-        }
+    vec4 result = vec4(0.0f);
+
+    // == ======================================
+    // Our lighting is set up in 3 phases: directional, point lights and spot lights plus the flashlight
+    // For each phase, a calculate function is defined that calculates the corresponding color
+    // per lamp. In the main() function we take all the calculated colors and sum them up for
+    // this fragment's final color.
+    // == ======================================
+    // Phase 1: Directional lighting
+    for (int i = 0; i < DIR_LIGHTS; ++i) {
+        result += CalcDirLight(dirLights[i], norm, viewDir);
     }
 
+    // Phase 2: Point lights
+    for (int i = 0; i < POINT_LIGHTS; ++i) {
+        result += CalcPointLight(pointLights[i], norm, FragPos, viewDir);
+    }
+
+    // Phase 3: Spot light
+    for (int i = 0; i < SPOT_LIGHTS; ++i) {
+        result += CalcSpotLight(spotLights[i], norm, FragPos, viewDir);
+    }
+    result += CalcSpotLight(flashLight, norm, FragPos, viewDir);
+#else
+    vec4 result = surfaceColor;
+#endif
+
     result += vec4(emissive.xyz, 0.0f);
     
     OutColor = result;
@@ -211,25 +211,7 @@ vec4 CalcSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
 
 void SetLightColor(vec3 lambient, vec3 ldiffuse, vec3 lspecular, inout vec4 _ambient, inout vec4 _diffuse, inout vec4 _specular, float diff, float spec)
 {
-    if (isTextured) {
-        if (forceTextured) {
-            _ambient = vec4(lambient, 1.0f) * texture(texUnit, TexCoords);
-            _diffuse = vec4(ldiffuse, 1.0f) * vec4(vec3(diff), 0.0f) * texture(texUnit, TexCoords);
-            _specular = vec4(lspecular, 1.0f) * vec4(vec3(spec), 0.0f) * texture(texUnit, TexCoords);
-        } else {
-            if (texCount == 0) {
-                _ambient = vec4(lambient, 1.0f) * diffuse;
-                _diffuse = vec4(ldiffuse, 1.0f) * vec4(vec3(diff), 0.0f) * diffuse;
-                _specular = vec4(lspecular, 1.0f) * vec4(vec3(spec), 0.0f) * specular;
-            } else {
-            _ambient = vec4(lambient, 1.0f) * texture(texUnit, TexCoords);
-            _diffuse = vec4(ldiffuse, 1.0f) * vec4(vec3(diff), 0.0f) * texture(texUnit, TexCoords);
-            _specular = vec4(lspecular, 1.0f) * vec4(vec3(spec), 0.0f) * texture(texUnit, TexCoords);
-            }
-        }
-    } else {
-        _ambient = vec4(lambient, 1.0f) * diffuse;
-        _diffuse = vec4(ldiffuse, 1.0f) * vec4(vec3(diff), 0.0f) * diffuse;
-        _specular = vec4(lspecular, 1.0f) * vec4(vec3(spec), 0.0f) * specular;
-    }
-}
\ No newline at end of file
+    _ambient = vec4(lambient, 1.0f) * surfaceColor;
+    _diffuse = vec4(ldiffuse, 1.0f) * vec4(vec3(diff), 0.0f) * surfaceColor;
+    _specular = vec4(lspecular, 1.0f) * vec4(vec3(spec), 0.0f) * surfaceSpecular;
+}
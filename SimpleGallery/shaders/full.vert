@@ -14,10 +14,43 @@ layout (std140) uniform Matrices {
     mat4 model;
 };
 
+// Every draw takes its model matrices from this block, a single draw is
+// one instance. The normal matrix is worked out on the CPU, see
+// InstanceBuffer::MakeTransform. Size must match InstanceBuffer::MaxInstances
+struct Transform {
+    mat4 model;
+    mat3 normal;
+};
+
+layout (std140) uniform Instances {
+    Transform instances[64];
+};
+
+// Compact vertices: position is unorm16 within the mesh's bounding box,
+// normal is octahedral encoded in x and y
+uniform bool compactVertices = false;
+uniform vec3 positionScale = vec3(1.0f);
+uniform vec3 positionBias = vec3(0.0f);
+
+vec3 DecodeOctahedral(vec2 e)
+{
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return normalize(n);
+}
+
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f);
-    FragPos = vec3(model * vec4(position, 1.0f));
-    Normal = mat3(transpose(inverse(model))) * normal;
+    vec3 localPosition = positionBias + positionScale * position;
+    vec3 localNormal = compactVertices ? DecodeOctahedral(normal.xy) : normal;
+
+    mat4 world = instances[gl_InstanceID].model;
+    vec4 worldPosition = world * vec4(localPosition, 1.0f);
+
+    gl_Position = projection * view * worldPosition;
+    FragPos = vec3(worldPosition);
+    Normal = instances[gl_InstanceID].normal * localNormal;
     TexCoords = texCoords;
 }
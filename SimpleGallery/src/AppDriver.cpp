@@ -5,10 +5,24 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
-#include "Shader.h"
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+#include "ShaderPermutations.h"
 #include "Camera.h"
+#include "Frustum.h"
+#include "GLState.h"
+#include "InstanceBuffer.h"
+#include "LightBuffer.h"
 #include "Mesh.h"
 #include "Model.h"
+#include "RenderQueue.h"
+#include "RoomVisibility.h"
+#include "TextureLoader.h"
+#include "TextureRegistry.h"
+#include "ThreadPool.h"
+#include "Trace.h"
 #include "Window.h"
 
 const int WINDOW_WIDTH = 800;
@@ -22,14 +36,47 @@ Model maze, ground, fan, pedestal, table, vases,
 
 // Shader settings
 // Uniform binding points
-GLuint matricesUniLoc = 1, materialUniLoc = 2;
-GLuint texUnit = 0;
-Shader shader;
+GLuint matricesUniLoc = 1, materialUniLoc = 2, instancesUniLoc = 3, lightsUniLoc = 4;
+ShaderPermutations shaders;
+LightBuffer lightBuffer;
+
+// Texture sharing stats are printed once everything is resident
+bool texturesReported = false;
+
+// Startup zones are written here once every texture is resident
+const std::string startupTraceFile = "startup-trace.json";
 
 // Frame counting and FPS computation
 long time, timebase = 0, frame = 0;
 std::string frameRateText;
 
+// Levels of detail: the coarsest level whose error projects under
+// LodPixelError pixels is drawn, a level only changes once it is past the
+// threshold by LodHysteresis so meshes near it don't pop every frame
+const GLfloat LodPixelError = 2.0f;
+const GLfloat LodHysteresis = 0.25f;
+// Pixels a world unit covers at distance 1, set each frame from the projection
+GLfloat lodPixelScale = 1.0f;
+// Level drawn last frame per mesh instance, keyed by mesh and model position
+std::unordered_map<uint64_t, int> lodSelections;
+// Triangles submitted this frame and during the last one
+unsigned long trianglesDrawn = 0, lastFrameTriangles = 0;
+
+// Camera frustum of the current frame, nodes and meshes outside it are skipped
+Frustum frustum;
+// Model matrices of the frame's draws, ring-buffered over the frames in flight
+InstanceBuffer instanceBuffer;
+// Traversal queues draws here, they are sorted by state before being issued
+RenderQueue renderQueue;
+// Draw calls issued this frame and during the last one, and how many an
+// uninstanced frame would have needed
+unsigned long drawCalls = 0, drawCallsUninstanced = 0, lastFrameDrawCalls = 0, lastFrameDrawCallsUninstanced = 0;
+
+// Rooms seen from the camera's room through the doorways
+RoomVisibility roomVisibility;
+// Meshes skipped by culling this frame and during the last one
+unsigned long meshesCulled = 0, lastFrameMeshesCulled = 0;
+
 std::string timeOfDay = "Day time";
 std::string displayState;
 
@@ -37,6 +84,10 @@ Window mainWindow(WINDOW_WIDTH, WINDOW_HEIGHT);
 GLfloat deltaTime = 0.0f;
 GLfloat lastFrame = 0.0f;
 
+// Lights the lit shaders always loop over, dark while switched off
+const int NUM_OF_DIR_LIGHTS = 1;
+const int NUM_OF_SPOT_LIGHTS = 2;
+
 // Coordinates taken from Blender
 const int NUM_OF_POINT_LIGHTS = 9;
 const GLfloat pointLightY = 5.54441f;
@@ -52,6 +103,8 @@ const GLfloat pointLightLocations[NUM_OF_POINT_LIGHTS][2] = {
 	{-13.0f, 0.0f},
 	{-13.0f, 13.0f}
 };
+// Each point light hangs in the middle of a room, rooms are this wide
+const GLfloat ROOM_SIZE = 13.0f;
 
 const int NUM_OF_PEDESTALS = 36;
 const GLfloat pedestalY = 0.41272f;
@@ -129,119 +182,254 @@ void reshapeCallback(int w, int h)
 	glViewport(0, 0, w, h);
 }
 
-void RenderModel(const Model& model, const aiNode* nd)
+// Picks the level of detail of a mesh drawn with the given model matrix
+int SelectLod(const Mesh& mesh, const glm::mat4& model)
+{
+	if (mesh.numLods <= 1 || !mainWindow.levelOfDetail)
+		return 0;
+
+	// World space bounding sphere, scaled by the largest axis of the model matrix
+	const glm::vec3 aabbMin = glm::make_vec3(mesh.aabbMin);
+	const glm::vec3 aabbMax = glm::make_vec3(mesh.aabbMax);
+	const auto center = glm::vec3(model * glm::vec4(0.5f * (aabbMin + aabbMax), 1.0f));
+	const auto scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+	const auto distance = glm::length(center - mainWindow.camera.Position) - 0.5f * glm::length(aabbMax - aabbMin) * scale;
+
+	// Instances are told apart by where the model matrix puts their origin,
+	// rotation doesn't move it so spinning ornaments keep their level
+	const auto quantize = [](GLfloat v) { return static_cast<uint64_t>(static_cast<int64_t>(std::floor(v * 4.0f)) & 0xFFFF); };
+	const auto key = reinterpret_cast<uintptr_t>(&mesh) * 0x9E3779B97F4A7C15ULL
+		^ (quantize(model[3].x) | quantize(model[3].y) << 16 | quantize(model[3].z) << 32);
+	auto& lod = lodSelections[key];
+	if (distance <= 0.0f)
+	{
+		lod = 0;
+		return lod;
+	}
+
+	const auto pixelsPerUnit = lodPixelScale * scale / distance;
+	lod = std::min(lod, mesh.numLods - 1);
+	while (lod + 1 < mesh.numLods && mesh.lodError[lod + 1] * pixelsPerUnit < LodPixelError * (1.0f - LodHysteresis))
+		++lod;
+	while (lod > 0 && mesh.lodError[lod] * pixelsPerUnit > LodPixelError * (1.0f + LodHysteresis))
+		--lod;
+	return lod;
+}
+
+// Material and texture a mesh is drawn with in the current drawing mode,
+// texture is 0 in the modes that don't sample one
+void MeshMaterial(const Mesh& mesh, GLuint& material, GLuint& texture)
+{
+	if (mainWindow.drawingMode == DrawingMode::WIREFRAME)
+	{
+		material = mainWindow.currentMatId;
+		texture = 0;
+		return;
+	}
+
+	material = mesh.uniformBlockIndex;
+	switch (mainWindow.solidMode)
+	{
+	case SolidMode::BASIC:
+	case SolidMode::LIGHTINGONLY:
+		texture = 0;
+		break;
+	default:
+		texture = mesh.texIndex;
+		break;
+	}
+}
+
+// Material, texture and shader variant of a mesh, texId replaces the mesh's
+// own texture in the textured modes when it isn't 0
+void MeshState(const Mesh& mesh, const GLuint& texId, GLuint& material, GLuint& texture, unsigned int& variant)
 {
-	// Get node transformation matrix
-	aiMatrix4x4 m = nd->mTransformation;
-	// OpenGL matrices are column major
-	m.Transpose();
+	MeshMaterial(mesh, material, texture);
+	variant = 0;
+	if (texId != 0 && mainWindow.drawingMode != DrawingMode::WIREFRAME &&
+		mainWindow.solidMode != SolidMode::BASIC && mainWindow.solidMode != SolidMode::LIGHTINGONLY)
+	{
+		texture = texId;
+		variant |= ShaderVariant::ForceTextured;
+	}
+	else if (texture != 0)
+	{
+		variant |= ShaderVariant::Textured;
+		if (TextureLoader::Instance().IsArray(texture))
+			variant |= ShaderVariant::TextureArray;
+	}
+}
 
-	// save model matrix and apply node transformation
+// Queues a mesh under the transform of its node
+void QueueMesh(const Mesh& mesh, GLintptr transform, const GLuint& texId)
+{
+	GLuint material, texture;
+	unsigned int variant;
+	MeshState(mesh, texId, material, texture, variant);
+
+	const auto lod = SelectLod(mesh, mainWindow.ctm.GetModel());
+	renderQueue.Add(mesh, lod, material, texture, variant, transform);
+	trianglesDrawn += mesh.lodFaces[lod];
+	++drawCalls;
+	++drawCallsUninstanced;
+}
+
+// Meshes of a node and all its children
+unsigned long CountMeshes(const Model& model, const Node& nd)
+{
+	unsigned long count = nd.numMeshes;
+	for (unsigned int n = 0; n < nd.numChildren; ++n)
+	{
+		count += CountMeshes(model, model.nodes[model.links[nd.firstChild + n]]);
+	}
+	return count;
+}
+
+// Queues the meshes of a node and its children, texId as for QueueMesh
+void RenderNode(const Model& model, const Node& nd, const GLuint& texId)
+{
+	// save model matrix and apply node transformation, already column major
 	mainWindow.ctm.PushMatrix();
 
-	float aux[16];
-	memcpy(aux, &m, sizeof(float) * 16);
+	mainWindow.ctm.MultMatrix(nd.transform);
 
-	mainWindow.ctm.MultMatrix(aux);
-	mainWindow.ctm.SetModel();
+	// skip the whole subtree when its bounds are off screen or in a room that can't be seen
+	if (!frustum.Intersects(mainWindow.ctm.GetModel(), nd.aabbMin, nd.aabbMax) ||
+		!roomVisibility.Intersects(mainWindow.ctm.GetModel(), nd.aabbMin, nd.aabbMax))
+	{
+		meshesCulled += CountMeshes(model, nd);
+		mainWindow.ctm.PopMatrix();
+		return;
+	}
+	const GLintptr transform = nd.numMeshes > 0 ? renderQueue.AddTransform(mainWindow.ctm.GetModel()) : 0;
 
-	// draw all meshes assigned to this node
-	for (unsigned int n = 0; n < nd->mNumMeshes; ++n)
+	// queue all meshes assigned to this node
+	for (unsigned int n = 0; n < nd.numMeshes; ++n)
 	{
-		if (mainWindow.drawingMode == DrawingMode::WIREFRAME)
+		const auto& mesh = model.meshes[model.links[nd.firstMesh + n]];
+		if (nd.numMeshes > 1 && !frustum.Intersects(mainWindow.ctm.GetModel(), mesh.aabbMin, mesh.aabbMax))
 		{
-			glBindBufferRange(GL_UNIFORM_BUFFER, materialUniLoc, mainWindow.currentMatId, 0, sizeof(Material));
+			++meshesCulled;
+			continue;
 		}
-		else
-		{
-			switch (mainWindow.solidMode)
-			{
-			case SolidMode::BASIC:
-			case SolidMode::LIGHTINGONLY:
-				// bind material uniform
-				glBindBufferRange(GL_UNIFORM_BUFFER, materialUniLoc, model.meshes[nd->mMeshes[n]].uniformBlockIndex, 0, sizeof(Material));
-				break;
-			default:
-				// bind material uniform
-				glBindBufferRange(GL_UNIFORM_BUFFER, materialUniLoc, model.meshes[nd->mMeshes[n]].uniformBlockIndex, 0, sizeof(Material));
-				// bind texture
-				glBindTexture(GL_TEXTURE_2D, model.meshes[nd->mMeshes[n]].texIndex);
-				break;
-			}
-		}
-
-		// bind VAO
-		glBindVertexArray(model.meshes[nd->mMeshes[n]].vao);
-		glDrawElements(GL_TRIANGLES, model.meshes[nd->mMeshes[n]].numFaces * 3, GL_UNSIGNED_INT, nullptr);
-		glBindVertexArray(0);
-		glBindTexture(GL_TEXTURE_2D, 0);
+		QueueMesh(mesh, transform, texId);
 	}
 
-	// draw all children
-	for (unsigned int n = 0; n < nd->mNumChildren; ++n)
+	// queue all children
+	for (unsigned int n = 0; n < nd.numChildren; ++n)
 	{
-		RenderModel(model, nd->mChildren[n]);
+		RenderNode(model, model.nodes[model.links[nd.firstChild + n]], texId);
 	}
 
 	mainWindow.ctm.PopMatrix();
 }
 
-void RenderWithTex(const Model& model, const aiNode* nd, const GLuint& texId)
+// Render starting from the model's root node
+void RenderModel(const Model& model)
 {
-	// Get node transformation matrix
-	aiMatrix4x4 m = nd->mTransformation;
-	// OpenGL matrices are column major
-	m.Transpose();
+	if (!model.nodes.empty())
+		RenderNode(model, model.nodes[0], 0);
+}
 
-	// save model matrix and apply node transformation
-	mainWindow.ctm.PushMatrix();
+// Queues the batches of a static model, they were merged and moved into
+// world space at load and draw with the identity matrix already on the GPU
+void RenderStatic(const Model& model, const GLuint& texId = 0)
+{
+	const glm::mat4 identity;
+	for (const auto& batch : model.staticBatches)
+	{
+		if (!frustum.Intersects(identity, batch.aabbMin, batch.aabbMax) ||
+			!roomVisibility.Intersects(identity, batch.aabbMin, batch.aabbMax))
+		{
+			++meshesCulled;
+			continue;
+		}
 
-	float aux[16];
-	memcpy(aux, &m, sizeof(float) * 16);
+		GLuint material, texture;
+		unsigned int variant;
+		MeshState(batch, texId, material, texture, variant);
 
-	mainWindow.ctm.MultMatrix(aux);
-	mainWindow.ctm.SetModel();
+		const auto lod = SelectLod(batch, identity);
+		renderQueue.AddInstanced(batch, lod, material, texture, variant, model.staticTransforms, 0, 1);
+		trianglesDrawn += batch.lodFaces[lod];
+		++drawCalls;
+		++drawCallsUninstanced;
+	}
+}
+
+// One instanced draw, a mesh at one level of detail for a batch of instances
+struct InstancedBatch
+{
+	const Mesh* mesh;
+	int lod;
+	GLintptr offset;
+	GLsizei count;
+};
+
+// Culls the instances of a model, picks every mesh's level of detail per
+// instance and adds their matrices to the instance buffer, one batch per
+// mesh and level. The batches can be drawn once the buffer is uploaded.
+void CollectInstances(const Model& model, const std::vector<glm::mat4>& instances, std::vector<InstancedBatch>& batches)
+{
+	batches.clear();
+	if (model.nodes.empty())
+		return;
+
+	const auto& root = model.nodes[0];
+	const auto rootTransform = glm::make_mat4(root.transform);
+	std::vector<glm::mat4> visible;
+	for (const auto& instance : instances)
+	{
+		const auto world = instance * rootTransform;
+		if (frustum.Intersects(world, root.aabbMin, root.aabbMax) && roomVisibility.Intersects(world, root.aabbMin, root.aabbMax))
+			visible.push_back(instance);
+		else
+			meshesCulled += CountMeshes(model, root);
+	}
+	if (visible.empty())
+		return;
 
-	// draw all meshes assigned to this node
-	for (unsigned int n = 0; n < nd->mNumMeshes; ++n)
+	// Walk the hierarchy once, each mesh gets the matrices of every visible instance
+	std::vector<glm::mat4> lods[MaxMeshLods];
+	model.ForEachMesh([&](unsigned int index, const glm::mat4& transform)
 	{
-		if (mainWindow.drawingMode == DrawingMode::WIREFRAME)
+		const auto& mesh = model.meshes[index];
+		for (auto& lod : lods)
 		{
-			glBindBufferRange(GL_UNIFORM_BUFFER, materialUniLoc, mainWindow.currentMatId, 0, sizeof(Material));
+			lod.clear();
 		}
-		else
+		for (const auto& instance : visible)
 		{
-			switch (mainWindow.solidMode)
+			const auto world = instance * transform;
+			lods[SelectLod(mesh, world)].push_back(world);
+		}
+
+		for (auto lod = 0; lod < MaxMeshLods; ++lod)
+		{
+			const auto& matrices = lods[lod];
+			for (size_t first = 0; first < matrices.size(); first += InstanceBuffer::MaxInstances)
 			{
-			case SolidMode::BASIC:
-			case SolidMode::LIGHTINGONLY:
-				// bind material uniform
-				glBindBufferRange(GL_UNIFORM_BUFFER, materialUniLoc, model.meshes[nd->mMeshes[n]].uniformBlockIndex, 0, sizeof(Material));
-				break;
-			default:
-				// bind texture
-				glUniform1i(glGetUniformLocation(shader(), "forceTextured"), true);
-				glBindBufferRange(GL_UNIFORM_BUFFER, materialUniLoc, model.meshes[nd->mMeshes[n]].uniformBlockIndex, 0, sizeof(Material));
-				glBindTexture(GL_TEXTURE_2D, texId);
-				break;
+				const auto count = static_cast<GLsizei>(std::min<size_t>(InstanceBuffer::MaxInstances, matrices.size() - first));
+				batches.push_back({&mesh, lod, instanceBuffer.Add(&matrices[first], count), count});
 			}
 		}
+	});
+}
 
-		// bind VAO
-		glBindVertexArray(model.meshes[nd->mMeshes[n]].vao);
-		glDrawElements(GL_TRIANGLES, model.meshes[nd->mMeshes[n]].numFaces * 3, GL_UNSIGNED_INT, nullptr);
-		glBindVertexArray(0);
-		glBindTexture(GL_TEXTURE_2D, 0);
-		glUniform1i(glGetUniformLocation(shader(), "forceTextured"), false);
-	}
-
-	// draw all children
-	for (unsigned int n = 0; n < nd->mNumChildren; ++n)
+void RenderInstanced(const std::vector<InstancedBatch>& batches)
+{
+	for (const auto& batch : batches)
 	{
-		RenderWithTex(model, nd->mChildren[n], texId);
+		const auto& mesh = *batch.mesh;
+		GLuint material, texture;
+		unsigned int variant;
+		MeshState(mesh, 0, material, texture, variant);
+		renderQueue.AddInstanced(mesh, batch.lod, material, texture, variant, RenderQueue::FrameTransforms, batch.offset, batch.count);
+
+		trianglesDrawn += mesh.lodFaces[batch.lod] * batch.count;
+		++drawCalls;
+		drawCallsUninstanced += batch.count;
 	}
-
-	mainWindow.ctm.PopMatrix();
 }
 
 void PrintText(const GLfloat& x, const GLfloat& y, void* font, const char* const str)
@@ -260,7 +448,7 @@ void renderHelpInstructions()
 {
 	// Note: This uses compatibility mode to render bitmap characters
 	// TODO Implement freetype inplace of glutBitmapCharacter
-	glUseProgram(0); // Use fixed function shader
+	GLState::Instance().UseProgram(0); // Use fixed function shader
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
 	gluOrtho2D(0, 800, 0, 600); // left, right, down, up
@@ -309,7 +497,8 @@ void renderHelpInstructions()
 	PrintText(310, 360, GLUT_BITMAP_HELVETICA_12, "o - Toggle anti aliasing");
 	PrintText(310, 340, GLUT_BITMAP_HELVETICA_12, "t - Toggle translucent surfaces");
 	PrintText(310, 320, GLUT_BITMAP_HELVETICA_12, "i - Toggle day/night");
-	PrintText(310, 300, GLUT_BITMAP_HELVETICA_12, "ESC - Quit");
+	PrintText(310, 300, GLUT_BITMAP_HELVETICA_12, "g - Toggle levels of detail");
+	PrintText(310, 280, GLUT_BITMAP_HELVETICA_12, "ESC - Quit");
 	PrintText(610, 520, GLUT_BITMAP_HELVETICA_12, "----- Light controls -----");
 	PrintText(610, 500, GLUT_BITMAP_HELVETICA_12, "1 - Toggle light 1");
 	PrintText(610, 480, GLUT_BITMAP_HELVETICA_12, "2 - Toggle light 2");
@@ -324,114 +513,116 @@ void renderHelpInstructions()
 	PrintText(610, 300, GLUT_BITMAP_HELVETICA_12, "' - Toggle spot light 2");
 }
 
-void SetDirLight(const Shader& shader, const int& index)
+void SetDirLight(LightBuffer::Block& lights, const int& index)
 {
-	const auto name = "dirLights[" + std::to_string(index) + "].";
-	glUniform3f(glGetUniformLocation(shader(), (name + "direction").c_str()), 0.0f, -1.0f, 0.0f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "ambient").c_str()), 0.5f, 0.5f, 0.5f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "diffuse").c_str()), 0.5f, 0.5f, 0.5f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "specular").c_str()), 0.5f, 0.5f, 0.5f);
+	auto& light = lights.dirLights[index];
+	LightBuffer::Set(light.direction, glm::vec3(0.0f, -1.0f, 0.0f));
+	LightBuffer::Set(light.ambient, glm::vec3(0.5f, 0.5f, 0.5f));
+	LightBuffer::Set(light.diffuse, glm::vec3(0.5f, 0.5f, 0.5f));
+	LightBuffer::Set(light.specular, glm::vec3(0.5f, 0.5f, 0.5f));
 }
 
-void SetPointLight(const Shader& shader, const int& index)
+void SetPointLight(LightBuffer::Block& lights, const int& index)
 {
-	const auto name = "pointLights[" + std::to_string(index) + "].";
-	glUniform3f(glGetUniformLocation(shader(), (name + "position").c_str()), 0.0f, 0.0f, 0.0f);
-	glUniform1f(glGetUniformLocation(shader(), (name + "constant").c_str()), 1.0f);
-	glUniform1f(glGetUniformLocation(shader(), (name + "linear").c_str()), 0.09f);
-	glUniform1f(glGetUniformLocation(shader(), (name + "quadratic").c_str()), 0.032f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "ambient").c_str()), 0.5f, 0.5f, 0.5f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "diffuse").c_str()), 0.5f, 0.5f, 0.5f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "specular").c_str()), 0.5f, 0.5f, 0.5f);
+	auto& light = lights.pointLights[index];
+	LightBuffer::Set(light.position, glm::vec3(0.0f, 0.0f, 0.0f));
+	light.constant = 1.0f;
+	light.linear = 0.09f;
+	light.quadratic = 0.032f;
+	LightBuffer::Set(light.ambient, glm::vec3(0.5f, 0.5f, 0.5f));
+	LightBuffer::Set(light.diffuse, glm::vec3(0.5f, 0.5f, 0.5f));
+	LightBuffer::Set(light.specular, glm::vec3(0.5f, 0.5f, 0.5f));
 }
 
-void SetSpotLight(const Shader& shader, const int& index)
+void SetSpotLight(LightBuffer::Block& lights, const int& index)
 {
-	const auto name = "spotLights[" + std::to_string(index) + "].";
-	glUniform3f(glGetUniformLocation(shader(), (name + "position").c_str()), 0.0f, 1.0f, 0.0f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "direction").c_str()), 0.0f, -1.0f, 0.0f);
-	glUniform1f(glGetUniformLocation(shader(), (name + "cutOff").c_str()), glm::cos(glm::radians(52.5f)));
-	glUniform1f(glGetUniformLocation(shader(), (name + "outerCutOff").c_str()), glm::cos(glm::radians(55.0f)));
-	glUniform1f(glGetUniformLocation(shader(), (name + "constant").c_str()), 1.0f);
-	glUniform1f(glGetUniformLocation(shader(), (name + "linear").c_str()), 0.09f);
-	glUniform1f(glGetUniformLocation(shader(), (name + "quadratic").c_str()), 0.032f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "ambient").c_str()), 0.5f, 0.5f, 0.5f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "diffuse").c_str()), 0.5f, 0.5f, 0.5f);
-	glUniform3f(glGetUniformLocation(shader(), (name + "specular").c_str()), 0.5f, 0.5f, 0.5f);
+	auto& light = lights.spotLights[index];
+	LightBuffer::Set(light.position, glm::vec3(0.0f, 1.0f, 0.0f));
+	LightBuffer::Set(light.direction, glm::vec3(0.0f, -1.0f, 0.0f));
+	light.cutOff = glm::cos(glm::radians(52.5f));
+	light.outerCutOff = glm::cos(glm::radians(55.0f));
+	light.constant = 1.0f;
+	light.linear = 0.09f;
+	light.quadratic = 0.032f;
+	LightBuffer::Set(light.ambient, glm::vec3(0.5f, 0.5f, 0.5f));
+	LightBuffer::Set(light.diffuse, glm::vec3(0.5f, 0.5f, 0.5f));
+	LightBuffer::Set(light.specular, glm::vec3(0.5f, 0.5f, 0.5f));
 }
 
-void SetFlashLight(const Shader& shader, const Camera& camera, const glm::vec3& diffuse, const GLfloat& intensity)
+void SetFlashLight(LightBuffer::Block& lights, const Camera& camera, const glm::vec3& diffuse, const GLfloat& intensity)
 {
 	auto temp = diffuse * intensity;
-	glUniform3f(glGetUniformLocation(shader(), "flashLight.position"), camera.Position.x, camera.Position.y, camera.Position.z);
-	glUniform3f(glGetUniformLocation(shader(), "flashLight.direction"), camera.Front.x, camera.Front.y, camera.Front.z);
-	glUniform1f(glGetUniformLocation(shader(), "flashLight.cutOff"), glm::cos(glm::radians(12.5f)));
-	glUniform1f(glGetUniformLocation(shader(), "flashLight.outerCutOff"), glm::cos(glm::radians(15.0f)));
-	glUniform1f(glGetUniformLocation(shader(), "flashLight.constant"), 1.0f);
-	glUniform1f(glGetUniformLocation(shader(), "flashLight.linear"), 0.09f);
-	glUniform1f(glGetUniformLocation(shader(), "flashLight.quadratic"), 0.032f);
-	glUniform3f(glGetUniformLocation(shader(), "flashLight.ambient"), temp.x, temp.y, temp.z);
-	glUniform3f(glGetUniformLocation(shader(), "flashLight.diffuse"), temp.x, temp.y, temp.z);
-	glUniform3f(glGetUniformLocation(shader(), "flashLight.specular"), temp.x, temp.y, temp.z);
+	auto& light = lights.flashLight;
+	LightBuffer::Set(light.position, camera.Position);
+	LightBuffer::Set(light.direction, camera.Front);
+	light.cutOff = glm::cos(glm::radians(12.5f));
+	light.outerCutOff = glm::cos(glm::radians(15.0f));
+	light.constant = 1.0f;
+	light.linear = 0.09f;
+	light.quadratic = 0.032f;
+	LightBuffer::Set(light.ambient, temp);
+	LightBuffer::Set(light.diffuse, temp);
+	LightBuffer::Set(light.specular, temp);
 }
 
-void SetNumOfDirLights(const Shader& shader, int numOfDirLights)
+void SetDirLightColor(LightBuffer::Block& lights, const int& index, const glm::vec3& diffuse)
 {
-	glUniform1i(glGetUniformLocation(shader(), "numOfDirLights"), numOfDirLights);
+	auto& light = lights.dirLights[index];
+	LightBuffer::Set(light.ambient, diffuse);
+	LightBuffer::Set(light.diffuse, diffuse);
+	LightBuffer::Set(light.specular, diffuse);
 }
 
-void SetNumOfSpotLights(const Shader& shader, int numOfSpotLights)
+void SetPointLightPosition(LightBuffer::Block& lights, const int& index, const glm::vec3& position)
 {
-	glUniform1i(glGetUniformLocation(shader(), "numOfSpotLights"), numOfSpotLights);
+	LightBuffer::Set(lights.pointLights[index].position, position);
 }
 
-void SetNumOfPointLights(const Shader& shader, int numOfPointLights)
+void SetPointLightColor(LightBuffer::Block& lights, const int& index, const glm::vec3& diffuse)
 {
-	glUniform1i(glGetUniformLocation(shader(), "numOfPointLights"), numOfPointLights);
+	auto& light = lights.pointLights[index];
+	LightBuffer::Set(light.ambient, diffuse);
+	LightBuffer::Set(light.diffuse, diffuse);
+	LightBuffer::Set(light.specular, diffuse);
 }
 
-void SetPointLightPosition(const Shader& shader, const int& index, const glm::vec3& position)
+void SetSpotLightPosition(LightBuffer::Block& lights, const int& index, const glm::vec3& position)
 {
-	const auto name = "pointLights[" + std::to_string(index) + "].";
-	glUniform3f(glGetUniformLocation(shader(), (name + "position").c_str()), position.x, position.y, position.z);
+	LightBuffer::Set(lights.spotLights[index].position, position);
 }
 
-void SetPointLightColor(const Shader& shader, const int& index, const glm::vec3& diffuse)
+void SetSpotLightDirection(LightBuffer::Block& lights, const int& index, const glm::vec3& direction)
 {
-	const auto name = "pointLights[" + std::to_string(index) + "].";
-	glUniform3f(glGetUniformLocation(shader(), (name + "ambient").c_str()), diffuse.x, diffuse.y, diffuse.z);
-	glUniform3f(glGetUniformLocation(shader(), (name + "diffuse").c_str()), diffuse.x, diffuse.y, diffuse.z);
-	glUniform3f(glGetUniformLocation(shader(), (name + "specular").c_str()), diffuse.x, diffuse.y, diffuse.z);
+	LightBuffer::Set(lights.spotLights[index].direction, direction);
 }
 
-void SetSpotLightPosition(const Shader& shader, const int& index, const glm::vec3& position)
+void SetSpotLightColor(LightBuffer::Block& lights, const int& index, const glm::vec3& diffuse)
 {
-	const auto name = "spotLights[" + std::to_string(index) + "].";
-	glUniform3f(glGetUniformLocation(shader(), (name + "position").c_str()), position.x, position.y, position.z);
+	auto& light = lights.spotLights[index];
+	LightBuffer::Set(light.ambient, diffuse);
+	LightBuffer::Set(light.diffuse, diffuse);
+	LightBuffer::Set(light.specular, diffuse);
 }
 
-void SetSpotLightDirection(const Shader& shader, const int& index, const glm::vec3& direction)
+// State changes GLState issued and dropped over a frame
+unsigned long IssuedStateChanges(const GLState::Stats& stats)
 {
-	const auto name = "spotLights[" + std::to_string(index) + "].";
-	glUniform3f(glGetUniformLocation(shader(), (name + "direction").c_str()), direction.x, direction.y, direction.z);
-}
-
-void SetSpotLightColor(const Shader& shader, const int& index, const glm::vec3& diffuse)
-{
-	const auto name = "spotLights[" + std::to_string(index) + "].";
-	glUniform3f(glGetUniformLocation(shader(), (name + "ambient").c_str()), diffuse.x, diffuse.y, diffuse.z);
-	glUniform3f(glGetUniformLocation(shader(), (name + "diffuse").c_str()), diffuse.x, diffuse.y, diffuse.z);
-	glUniform3f(glGetUniformLocation(shader(), (name + "specular").c_str()), diffuse.x, diffuse.y, diffuse.z);
-}
-
-void ToggleFlashLight(const Shader& shader, bool flashLightToggle)
-{
-	glUniform1i(glGetUniformLocation(shader(), "flashLightOn"), flashLightToggle);
+	unsigned long changes = 0;
+	for (auto type = 0; type < GLState::NumStateTypes; ++type)
+	{
+		changes += stats.issued[type];
+	}
+	return changes;
 }
 
-void SetLighting(const Shader& shader, bool lightingToggle)
+unsigned long FilteredStateChanges(const GLState::Stats& stats)
 {
-	glUniform1i(glGetUniformLocation(shader(), "lighting"), lightingToggle);
+	unsigned long changes = 0;
+	for (auto type = 0; type < GLState::NumStateTypes; ++type)
+	{
+		changes += stats.filtered[type];
+	}
+	return changes;
 }
 
 void displayCallback()
@@ -440,219 +631,222 @@ void displayCallback()
 	const auto height = glutGet(GLUT_WINDOW_HEIGHT);
 	auto ratio = (1.0f * width) / height;
 
-	shader.Use();
+	// Upload textures that finished decoding since the last frame, portraits
+	// near the camera get their finer mips streamed in
+	portraits.UpdateTextureStreaming(mainWindow.camera.Position);
+	TextureLoader::Instance().Pump();
+	if (!texturesReported && TextureLoader::Instance().Pending() == 0)
+	{
+		TextureRegistry::Instance().ReportStats();
+		GLState::ReportStats(GLState::Instance().LastFrame());
+		texturesReported = true;
+
+		Trace::Instance().Record("Startup", "", Trace::Instance().Start(), Trace::Clock::now());
+		Trace::Instance().Write(startupTraceFile);
+	}
 
 	mainWindow.ctm.SetPerspective(mainWindow.camera.Zoom, ratio, 0.1f, 100.0f);
+	const auto viewProjection = CTM::Perspective(mainWindow.camera.Zoom, ratio, 0.1f, 100.0f) * mainWindow.camera.GetViewMatrix();
+	frustum.Extract(viewProjection);
+	roomVisibility.Update(mainWindow.camera.Position, viewProjection);
+	lastFrameMeshesCulled = meshesCulled;
+	meshesCulled = 0;
+	lodPixelScale = height / (2.0f * tan(glm::radians(mainWindow.camera.Zoom) / 2.0f));
+	lastFrameTriangles = trianglesDrawn;
+	trianglesDrawn = 0;
+	renderQueue.BeginFrame();
+	GLState::Instance().BeginFrame();
+	instanceBuffer.Begin();
+	lastFrameDrawCalls = drawCalls;
+	lastFrameDrawCallsUninstanced = drawCallsUninstanced;
+	drawCalls = 0;
+	drawCallsUninstanced = 0;
 	mainWindow.SetTimeOfDay();
 	mainWindow.SetDrawingMode();
 	mainWindow.SetAntiAliasing();
-	mainWindow.SetViewMatrix(shader);
-	mainWindow.SetTexture();
+	mainWindow.SetViewMatrix();
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-	SetNumOfSpotLights(shader, 2);
-	SetSpotLight(shader, 0);
-	SetSpotLight(shader, 1);
-	SetSpotLightPosition(shader, 0, glm::vec3(20.0f * sin(glutGet(GLUT_ELAPSED_TIME) / 1000.0f), 2.0f, 0.0f));
-	SetSpotLightPosition(shader, 1, glm::vec3(0.0f, 2.0f, -20.0f * sin(glutGet(GLUT_ELAPSED_TIME) / 1000.0f)));
+	auto& lights = lightBuffer.Edit();
+	LightBuffer::Set(lights.viewPos, mainWindow.camera.Position);
+	SetSpotLight(lights, 0);
+	SetSpotLight(lights, 1);
+	SetSpotLightPosition(lights, 0, glm::vec3(20.0f * sin(glutGet(GLUT_ELAPSED_TIME) / 1000.0f), 2.0f, 0.0f));
+	SetSpotLightPosition(lights, 1, glm::vec3(0.0f, 2.0f, -20.0f * sin(glutGet(GLUT_ELAPSED_TIME) / 1000.0f)));
 	if (mainWindow.spotLights[0])
 	{
-		SetSpotLightColor(shader, 0, sin(glutGet(GLUT_ELAPSED_TIME) / 100.0f) * glm::vec3(0.0f, 1.0f, 0.0f));
+		SetSpotLightColor(lights, 0, sin(glutGet(GLUT_ELAPSED_TIME) / 100.0f) * glm::vec3(0.0f, 1.0f, 0.0f));
 	}
 	else
 	{
-		SetSpotLightColor(shader, 0, glm::vec3(0.0f, 0.0f, 0.0f));
+		SetSpotLightColor(lights, 0, glm::vec3(0.0f, 0.0f, 0.0f));
 	}
 
 	if (mainWindow.spotLights[1])
 	{
-		SetSpotLightColor(shader, 1, 10.0f * sin(glutGet(GLUT_ELAPSED_TIME) / 100.0f) * glm::vec3(1.0f, 0.0f, 0.0f));
+		SetSpotLightColor(lights, 1, 10.0f * sin(glutGet(GLUT_ELAPSED_TIME) / 100.0f) * glm::vec3(1.0f, 0.0f, 0.0f));
 	}
 	else
 	{
-		SetSpotLightColor(shader, 1, glm::vec3(0.0f, 0.0f, 0.0f));
+		SetSpotLightColor(lights, 1, glm::vec3(0.0f, 0.0f, 0.0f));
 	}
 
 
-	if (mainWindow.timeOfDay)
+	for (auto i = 0; i < NUM_OF_DIR_LIGHTS; ++i)
 	{
-		SetNumOfDirLights(shader, 1);
-		for (auto i = 0; i < 1; ++i)
+		SetDirLight(lights, i);
+		if (!mainWindow.timeOfDay)
 		{
-			SetDirLight(shader, i);
+			SetDirLightColor(lights, i, glm::vec3(0.0f, 0.0f, 0.0f));
 		}
 	}
-	else
-	{
-		SetNumOfDirLights(shader, 0);
-	}
 
-	SetFlashLight(shader, mainWindow.camera, mainWindow.flashLightDiffuse, mainWindow.intensity);
-	ToggleFlashLight(shader, mainWindow.flashLightOn);
-	SetLighting(shader, mainWindow.lighting);
+	SetFlashLight(lights, mainWindow.camera, mainWindow.flashLightDiffuse, mainWindow.flashLightOn ? mainWindow.intensity : 0.0f);
 
-	glDisable(GL_BLEND);
+	renderQueue.SetPass(RenderPass::Opaque);
 	mainWindow.ctm.LoadIdentity();
 	mainWindow.ctm.Rotate(static_cast<GLfloat>(glutGet(GLUT_ELAPSED_TIME)), glm::vec3(0.0f, 1.0f, 0.0f));
-	mainWindow.ctm.SetModel();
-	RenderModel(fan, fan.scene->mRootNode);
+	RenderModel(fan);
 
-	SetNumOfPointLights(shader, NUM_OF_POINT_LIGHTS);
+	// Only lights of visible rooms are passed to the shader, packed into the
+	// first slots. Lights aren't shadowed so this also stops them shining
+	// through walls into the rooms around.
+	auto numVisibleLights = 0;
 	for (auto i = 0; i < NUM_OF_POINT_LIGHTS; ++i)
 	{
-		SetPointLight(shader, i);
-		SetPointLightPosition(shader, i, glm::vec3(pointLightLocations[i][0], pointLightY, pointLightLocations[i][1]));
+		if (!roomVisibility.Visible(pointLightLocations[i][0], pointLightLocations[i][1]))
+			continue;
 
-		glDisable(GL_BLEND);
-		mainWindow.ctm.LoadIdentity();
-		mainWindow.ctm.Translate(pointLightLocations[i][0], 0.0f, pointLightLocations[i][1]); // y axis not needed
-		mainWindow.ctm.SetModel();
-		RenderModel(ceilingLamp, ceilingLamp.scene->mRootNode);
+		const auto slot = numVisibleLights++;
+		SetPointLight(lights, slot);
+		SetPointLightPosition(lights, slot, glm::vec3(pointLightLocations[i][0], pointLightY, pointLightLocations[i][1]));
 
 		if (mainWindow.lights[i])
 		{
-			SetPointLightColor(shader, i, glm::vec3(0.5f, 0.5f, 0.5f));
+			SetPointLightColor(lights, slot, glm::vec3(0.5f, 0.5f, 0.5f));
 		}
 		else
 		{
-			SetPointLightColor(shader, i, glm::vec3(0.0f, 0.0f, 0.0f));
+			SetPointLightColor(lights, slot, glm::vec3(0.0f, 0.0f, 0.0f));
 		}
 	}
+	// The shaders loop over a bucket of lights, the slots past the visible
+	// ones are dark
+	const auto numLightSlots = shaders.SetPointLights(numVisibleLights);
+	for (auto slot = numVisibleLights; slot < numLightSlots; ++slot)
+	{
+		SetPointLight(lights, slot);
+		SetPointLightColor(lights, slot, glm::vec3(0.0f, 0.0f, 0.0f));
+	}
+	lightBuffer.Upload();
 
-	auto ornamentChooser = 0;
-	for (auto i = 0; i < NUM_OF_PEDESTALS; ++i)
+	// Ceiling lamps, pedestals and ornaments are drawn instanced, the
+	// matrices of all their instances go up in one upload
+	std::vector<glm::mat4> lampInstances, mirroredLampInstances, pedestalInstances, ornamentInstances[4];
+	for (auto i = 0; i < NUM_OF_POINT_LIGHTS; ++i)
 	{
-		glDisable(GL_BLEND);
-		mainWindow.ctm.LoadIdentity();
-		mainWindow.ctm.Translate(pedestalLocations[i][0], 0.0f, pedestalLocations[i][1]);
-		mainWindow.ctm.SetModel();
-		RenderModel(pedestal, pedestal.scene->mRootNode);
+		if (!roomVisibility.Visible(pointLightLocations[i][0], pointLightLocations[i][1]))
+			continue;
 
-		switch (ornamentChooser)
-		{
-		case 0:
-			glDisable(GL_BLEND);
-			mainWindow.ctm.LoadIdentity();
-			mainWindow.ctm.Translate(pedestalLocations[i][0], 0.0f, pedestalLocations[i][1]);
-			mainWindow.ctm.Rotate(glutGet(GLUT_ELAPSED_TIME) / 10.0f, glm::vec3(0.0f, 1.0f, 0.0f));
-			mainWindow.ctm.SetModel();
-			RenderModel(star, star.scene->mRootNode);
-			ornamentChooser = 1;
-			break;
-		case 1:
-			glDisable(GL_BLEND);
-			mainWindow.ctm.LoadIdentity();
-			mainWindow.ctm.Translate(pedestalLocations[i][0], 0.0f, pedestalLocations[i][1]);
-			mainWindow.ctm.Rotate(glutGet(GLUT_ELAPSED_TIME) / 10.0f, glm::vec3(0.0f, -1.0f, 0.0f));
-			mainWindow.ctm.SetModel();
-			RenderModel(pentCrystal, pentCrystal.scene->mRootNode);
-			ornamentChooser = 2;
-			break;
-		case 2:
-			glDisable(GL_BLEND);
-			mainWindow.ctm.LoadIdentity();
-			mainWindow.ctm.Translate(pedestalLocations[i][0], 0.0f, pedestalLocations[i][1]);
-			mainWindow.ctm.Rotate(glutGet(GLUT_ELAPSED_TIME) / 10.0f, glm::vec3(0.0f, 1.0f, 0.0f));
-			mainWindow.ctm.SetModel();
-			RenderModel(pentPrism, pentPrism.scene->mRootNode);
-			ornamentChooser = 3;
-			break;
-		case 3:
-			glDisable(GL_BLEND);
-			mainWindow.ctm.LoadIdentity();
-			mainWindow.ctm.Translate(pedestalLocations[i][0], 0.0f, pedestalLocations[i][1]);
-			mainWindow.ctm.Rotate(glutGet(GLUT_ELAPSED_TIME) / 10.0f, glm::vec3(0.0f, -1.0f, 0.0f));
-			mainWindow.ctm.SetModel();
-			RenderModel(pie, pie.scene->mRootNode);
-			ornamentChooser = 0;
-			break;
-		}
+		const auto lamp = glm::translate(glm::mat4(), glm::vec3(pointLightLocations[i][0], 0.0f, pointLightLocations[i][1])); // y axis not needed
+		lampInstances.push_back(lamp);
+		mirroredLampInstances.push_back(glm::scale(lamp, glm::vec3(1.0f, -1.0f, 1.0f)));
 	}
 
+	// Ornaments cycle through star, pent crystal, pent prism and pie, every
+	// other one spinning the opposite way
+	const GLfloat spin = glutGet(GLUT_ELAPSED_TIME) / 10.0f;
+	for (auto i = 0; i < NUM_OF_PEDESTALS; ++i)
+	{
+		if (!roomVisibility.Visible(pedestalLocations[i][0], pedestalLocations[i][1]))
+			continue;
 
-	glDisable(GL_BLEND);
-	mainWindow.ctm.LoadIdentity();
-	mainWindow.ctm.SetModel();
-	RenderModel(benches, benches.scene->mRootNode);
-
-	glDisable(GL_BLEND);
-	mainWindow.ctm.LoadIdentity();
-	mainWindow.ctm.SetModel();
-	RenderModel(table, table.scene->mRootNode);
+		const auto base = glm::translate(glm::mat4(), glm::vec3(pedestalLocations[i][0], 0.0f, pedestalLocations[i][1]));
+		pedestalInstances.push_back(base);
+		const auto axis = i % 2 == 0 ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(0.0f, -1.0f, 0.0f);
+		ornamentInstances[i % 4].push_back(glm::rotate(base, glm::radians(spin), axis));
+	}
 
-	glDisable(GL_BLEND);
-	mainWindow.ctm.LoadIdentity();
-	mainWindow.ctm.SetModel();
-	RenderModel(vases, vases.scene->mRootNode);
+	const Model* ornaments[4] = {&star, &pentCrystal, &pentPrism, &pie};
+	const auto reflect = mainWindow.blending && mainWindow.camera.Position.y > 0.0f;
+	std::vector<InstancedBatch> lampBatches, mirroredLampBatches, pedestalBatches, ornamentBatches[4];
+	CollectInstances(ceilingLamp, lampInstances, lampBatches);
+	if (reflect)
+		CollectInstances(ceilingLamp, mirroredLampInstances, mirroredLampBatches);
+	CollectInstances(pedestal, pedestalInstances, pedestalBatches);
+	for (auto k = 0; k < 4; ++k)
+	{
+		CollectInstances(*ornaments[k], ornamentInstances[k], ornamentBatches[k]);
+	}
 
-	glDisable(GL_BLEND);
-	mainWindow.ctm.LoadIdentity();
-	mainWindow.ctm.SetModel();
-	RenderWithTex(portrait, portrait.scene->mRootNode, mainWindow.screenshotTexId);
+	// Opaque models, the queue sorts them by state before drawing
+	GLState::Instance().Disable(GL_BLEND);
+	renderQueue.SetPass(RenderPass::Opaque);
+	RenderInstanced(lampBatches);
+	RenderInstanced(pedestalBatches);
+	for (const auto& batches : ornamentBatches)
+	{
+		RenderInstanced(batches);
+	}
 
-	glDisable(GL_BLEND);
-	mainWindow.ctm.LoadIdentity();
-	mainWindow.ctm.SetModel();
-	RenderModel(portraits, portraits.scene->mRootNode);
+	RenderStatic(benches);
+	RenderStatic(table);
+	RenderStatic(vases);
+	RenderStatic(portrait, mainWindow.screenshotTexId);
+	RenderStatic(portraits);
+	RenderStatic(maze);
+	renderQueue.Submit();
 
 	if (mainWindow.blending)
 	{
-		glDisable(GL_DEPTH_TEST);
-		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-		glEnable(GL_STENCIL_TEST);
-		glStencilFunc(GL_ALWAYS, 1, 0xff);
-		glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+		GLState::Instance().Disable(GL_DEPTH_TEST);
+		GLState::Instance().ColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		GLState::Instance().Enable(GL_STENCIL_TEST);
+		GLState::Instance().StencilFunc(GL_ALWAYS, 1, 0xff);
+		GLState::Instance().StencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
 
-		glDisable(GL_BLEND);
-		mainWindow.ctm.LoadIdentity();
-		mainWindow.ctm.SetModel();
-		RenderModel(ground, ground.scene->mRootNode);
+		RenderStatic(ground);
+		renderQueue.Submit();
 
-		glEnable(GL_DEPTH_TEST);
-		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-		glStencilFunc(GL_EQUAL, 1, 0xff);
-		glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+		GLState::Instance().Enable(GL_DEPTH_TEST);
+		GLState::Instance().ColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		GLState::Instance().StencilFunc(GL_EQUAL, 1, 0xff);
+		GLState::Instance().StencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
 
-		if (mainWindow.camera.Position.y > 0.0f)
+		if (reflect)
 		{
-			glDisable(GL_BLEND);
+			renderQueue.SetPass(RenderPass::Reflection);
 			mainWindow.ctm.LoadIdentity();
 			mainWindow.ctm.Rotate(static_cast<GLfloat>(glutGet(GLUT_ELAPSED_TIME)), glm::vec3(0.0f, 1.0f, 0.0f));
 			mainWindow.ctm.Scale(glm::vec3(1.0f, -1.0f, 1.0f));
-			mainWindow.ctm.SetModel();
-			RenderModel(fan, fan.scene->mRootNode);
-
-			for (auto i = 0; i < NUM_OF_POINT_LIGHTS; ++i)
-			{
-				glDisable(GL_BLEND);
-				mainWindow.ctm.LoadIdentity();
-				mainWindow.ctm.Translate(pointLightLocations[i][0], 0.0f, pointLightLocations[i][1]); // y axis not needed
-				mainWindow.ctm.Scale(glm::vec3(1.0f, -1.0f, 1.0f));
-				mainWindow.ctm.SetModel();
-				RenderModel(ceilingLamp, ceilingLamp.scene->mRootNode);
-			}
+			RenderModel(fan);
+			RenderInstanced(mirroredLampBatches);
+			renderQueue.Submit();
 		}
 
-		glDisable(GL_STENCIL_TEST);
+		GLState::Instance().Disable(GL_STENCIL_TEST);
 	}
 
 	mainWindow.SetBlending();
-	mainWindow.ctm.LoadIdentity();
-	mainWindow.ctm.SetModel();
-	RenderModel(ground, ground.scene->mRootNode);
-
-	glDisable(GL_BLEND);
-	mainWindow.ctm.LoadIdentity();
-	mainWindow.ctm.SetModel();
-	RenderModel(maze, maze.scene->mRootNode);
+	renderQueue.SetPass(RenderPass::Translucent);
+	RenderStatic(ground);
+	renderQueue.Submit();
+	GLState::Instance().Disable(GL_BLEND);
 
 	// FPS computation and display
 	frame++;
 	time = glutGet(GLUT_ELAPSED_TIME);
 	if (time - timebase > 1000)
 	{
-		frameRateText = "FPS: " + std::to_string(frame * 1000.0f / (time - timebase));
+		frameRateText = "FPS: " + std::to_string(frame * 1000.0f / (time - timebase))
+			+ ", draws: " + std::to_string(lastFrameDrawCalls)
+			+ " (" + std::to_string(lastFrameDrawCallsUninstanced) + " uninstanced)"
+			+ ", state changes: " + std::to_string(IssuedStateChanges(GLState::Instance().LastFrame()))
+			+ " (" + std::to_string(FilteredStateChanges(GLState::Instance().LastFrame())) + " filtered)"
+			+ ", triangles: " + std::to_string(lastFrameTriangles)
+			+ ", culled meshes: " + std::to_string(lastFrameMeshesCulled)
+			+ ", rooms: " + std::to_string(roomVisibility.NumVisible());
 		timebase = time;
 		frame = 0;
 		const auto title = "SimpleGallery - " + frameRateText;
@@ -667,56 +861,153 @@ void displayCallback()
 	glutSwapBuffers();
 }
 
+// Binds a program's uniform block if the program uses it
+void BindUniformBlock(GLuint program, const char* name, GLuint binding)
+{
+	const auto index = glGetUniformBlockIndex(program, name);
+	if (index != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, index, binding);
+}
+
 bool oneTimeInit()
 {
-	shader.Setup("shaders/full");
+	shaders.Setup("shaders/full", NUM_OF_DIR_LIGHTS, NUM_OF_SPOT_LIGHTS);
+	// Window::Init requests the last screenshot through the loader
+	TextureLoader::Instance().Init();
 	mainWindow.Init();
-	mainWindow.SetShader(&shader);
-
-	GLuint k = glGetUniformBlockIndex(shader(), "Matrices");
-	glUniformBlockBinding(shader(), k, matricesUniLoc);
-	glUniformBlockBinding(shader(), glGetUniformBlockIndex(shader(), "Material"), materialUniLoc);
-	texUnit = glGetUniformLocation(shader(), "texUnit");
-
-	maze.SetModelFile("models/maze/", "maze.obj");
-	portrait.SetModelFile("models/screenshot-portrait/", "screenshot-portrait.obj");
-	portraits.SetModelFile("models/portraits/", "portraits.obj");
-	benches.SetModelFile("models/benches/", "benches.obj");
-	ground.SetModelFile("models/floor/", "floor.obj");
-	fan.SetModelFile("models/fan/", "fan.obj");
-	pedestal.SetModelFile("models/pedestal/", "pedestal.obj");
-	table.SetModelFile("models/table/", "table.obj");
-	vases.SetModelFile("models/vases/", "vases.obj");
-	ceilingLamp.SetModelFile("models/ceiling-lamp/", "ceiling-lamp.obj");
-	star.SetModelFile("models/star/", "star.obj");
-	pie.SetModelFile("models/pie/", "pie.obj");
-	pentCrystal.SetModelFile("models/pent-crystal/", "pent-crystal.obj");
-	pentPrism.SetModelFile("models/pent-prism/", "pent-prism.obj");
-
-	glEnable(GL_DEPTH_TEST);
-	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+	mainWindow.SetShaders(&shaders);
+	roomVisibility.Setup(pointLightLocations, NUM_OF_POINT_LIGHTS, ROOM_SIZE);
+
+	// Every permutation gets the same bindings, unlit ones have no Lights block
+	for (auto i = 0; i < ShaderPermutations::NumPrograms; ++i)
+	{
+		auto& shader = shaders[i];
+		BindUniformBlock(shader(), "Matrices", matricesUniLoc);
+		BindUniformBlock(shader(), "Material", materialUniLoc);
+		BindUniformBlock(shader(), "Instances", instancesUniLoc);
+		BindUniformBlock(shader(), "Lights", lightsUniLoc);
+		shader.Use();
+		const auto& uniforms = shader.Locations();
+		GLState::Instance().Uniform1i(uniforms.compactVertices, VertexArena::Instance().Format() == VertexFormat::Compact);
+		GLState::Instance().Uniform1i(uniforms.texArrayUnit, TextureLoader::ArrayUnit);
+	}
+
+	// Flat quads don't need welding or smoothing, the showcase pieces on the
+	// pedestals get the full quality preset. Models that never move are
+	// merged into world space batches, one per material, texture and room.
+	struct ModelFile
+	{
+		Model* model;
+		const char* dirName;
+		const char* modelName;
+		ImportProfile profile;
+		bool isStatic;
+	};
+	const ModelFile modelFiles[] = {
+		{&maze, "models/maze/", "maze.obj", ImportProfile::Balanced, true},
+		{&portrait, "models/screenshot-portrait/", "screenshot-portrait.obj", ImportProfile::Fast, true},
+		{&portraits, "models/portraits/", "portraits.obj", ImportProfile::Fast, true},
+		{&benches, "models/benches/", "benches.obj", ImportProfile::Balanced, true},
+		{&ground, "models/floor/", "floor.obj", ImportProfile::Fast, true},
+		{&fan, "models/fan/", "fan.obj", ImportProfile::Balanced, false},
+		{&pedestal, "models/pedestal/", "pedestal.obj", ImportProfile::Balanced, false},
+		{&table, "models/table/", "table.obj", ImportProfile::Balanced, true},
+		{&vases, "models/vases/", "vases.obj", ImportProfile::Balanced, true},
+		{&ceilingLamp, "models/ceiling-lamp/", "ceiling-lamp.obj", ImportProfile::Balanced, false},
+		{&star, "models/star/", "star.obj", ImportProfile::Quality, false},
+		{&pie, "models/pie/", "pie.obj", ImportProfile::Quality, false},
+		{&pentCrystal, "models/pent-crystal/", "pent-crystal.obj", ImportProfile::Quality, false},
+		{&pentPrism, "models/pent-prism/", "pent-prism.obj", ImportProfile::Quality, false},
+	};
+	const int numModels = sizeof(modelFiles) / sizeof(modelFiles[0]);
+
+	// Only the mip tails of the portraits are loaded at startup, and the
+	// portraits of a size share a texture array
+	portraits.streamTextures = true;
+	portraits.textureArrays = true;
+
+	// Import every model on the worker pool, one model per task, and upload
+	// each one on this (GL) thread as soon as its import finishes
+	struct ImportResult
+	{
+		Model* model;
+		bool success;
+	};
+	BlockingQueue<ImportResult> imported;
+	for (const auto& file : modelFiles)
+	{
+		file.model->importProfile = file.profile;
+		file.model->isStatic = file.isStatic;
+		if (file.isStatic)
+			file.model->staticBatchRegion = [](const glm::vec3& p) { return roomVisibility.RoomAt(p.x, p.z); };
+		ThreadPool::Instance().Submit([file, &imported]
+		{
+			imported.Push({file.model, file.model->Import(file.dirName, file.modelName)});
+		});
+	}
+
+	for (auto i = 0; i < numModels; ++i)
+	{
+		ImportResult result;
+		imported.Pop(result);
+		if (result.success)
+			result.model->Upload();
+	}
+
+	const auto& arena = VertexArena::Instance();
+	std::cout << "Vertex arena: " << arena.VertexBytes() / 1024 << " KiB of vertices, "
+		<< arena.IndexBytes() / 1024 << " KiB of indices in " << arena.NumBlocks() << " blocks, "
+		<< arena.Stride() << " bytes per vertex" << std::endl;
+
+	GLState::Instance().Enable(GL_DEPTH_TEST);
+	GLState::Instance().ClearColor(1.0f, 1.0f, 1.0f, 1.0f);
 
 	glGenBuffers(1, &CTM::MatricesUniBuffer);
-	glBindBuffer(GL_UNIFORM_BUFFER, CTM::MatricesUniBuffer);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, CTM::MatricesUniBuffer);
 	glBufferData(GL_UNIFORM_BUFFER, MatricesUniBufferSize, nullptr,GL_DYNAMIC_DRAW);
-	glBindBufferRange(GL_UNIFORM_BUFFER, matricesUniLoc, CTM::MatricesUniBuffer, 0, MatricesUniBufferSize);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	GLState::Instance().BindBufferRange(matricesUniLoc, CTM::MatricesUniBuffer, 0, MatricesUniBufferSize);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	instanceBuffer.Init();
+	lightBuffer.Init(lightsUniLoc);
+	renderQueue.Init({materialUniLoc, instancesUniLoc}, &instanceBuffer, &shaders);
 
 	return true;
 }
 
 int main(int argc, char* argv[])
 {
+	Trace::Instance().NameThread("Main");
+
+	// --cook only builds the model and texture caches then quits,
+	// --float-vertices uploads full precision vertices for comparison,
+	// --import-steps times each post-process step of a re-cook
+	auto cookOnly = false;
+	auto floatVertices = false;
+	for (auto i = 1; i < argc; ++i)
+	{
+		if (std::string(argv[i]) == "--cook")
+			cookOnly = true;
+		else if (std::string(argv[i]) == "--float-vertices")
+			floatVertices = true;
+		else if (std::string(argv[i]) == "--import-steps")
+			Model::importBreakdown = true;
+	}
+	VertexArena::Instance().SetFormat(floatVertices ? VertexFormat::Float : VertexFormat::Compact);
+
 	// GLUT init
-	glutInit(&argc, argv);
-	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_ALPHA | GLUT_DEPTH | GLUT_STENCIL | GLUT_MULTISAMPLE);
-	glutInitContextVersion(3, 3);
-	//glutInitContextFlags(GLUT_DEBUG | GLUT_FORWARD_COMPATIBLE);
-	glutInitContextProfile(GLUT_COMPATIBILITY_PROFILE); // TODO Change to core profile
-	glutInitWindowPosition((glutGet(GLUT_SCREEN_WIDTH) - WINDOW_WIDTH) / 2,
-	                       (glutGet(GLUT_SCREEN_HEIGHT) - WINDOW_HEIGHT) / 2);
-	glutInitWindowSize(WINDOW_WIDTH, WINDOW_HEIGHT);
-	glutCreateWindow(WINDOW_TITLE.c_str());
+	{
+		TraceZone zone("glutCreateWindow");
+		glutInit(&argc, argv);
+		glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_ALPHA | GLUT_DEPTH | GLUT_STENCIL | GLUT_MULTISAMPLE);
+		glutInitContextVersion(3, 3);
+		//glutInitContextFlags(GLUT_DEBUG | GLUT_FORWARD_COMPATIBLE);
+		glutInitContextProfile(GLUT_COMPATIBILITY_PROFILE); // TODO Change to core profile
+		glutInitWindowPosition((glutGet(GLUT_SCREEN_WIDTH) - WINDOW_WIDTH) / 2,
+		                       (glutGet(GLUT_SCREEN_HEIGHT) - WINDOW_HEIGHT) / 2);
+		glutInitWindowSize(WINDOW_WIDTH, WINDOW_HEIGHT);
+		glutCreateWindow(WINDOW_TITLE.c_str());
+	}
 
 	// GLUT callbacks
 	glutDisplayFunc(displayCallback);
@@ -729,7 +1020,10 @@ int main(int argc, char* argv[])
 
 	// GLEW init
 	glewExperimental = GL_TRUE;
-	glewInit();
+	{
+		TraceZone zone("glewInit");
+		glewInit();
+	}
 	if (glewIsSupported("GL_VERSION_3_3"))
 	{
 		std::cout << "Ready for OpenGL 3.3" << std::endl;
@@ -741,12 +1035,18 @@ int main(int argc, char* argv[])
 	}
 
 	// devIL init
-	ilInit();
+	{
+		TraceZone zone("ilInit");
+		ilInit();
+	}
 
 	// App init
-	if (!oneTimeInit())
 	{
-		return false;
+		TraceZone zone("oneTimeInit");
+		if (!oneTimeInit())
+		{
+			return false;
+		}
 	}
 
 	std::cout << "Vender: " << glGetString(GL_VENDOR) << std::endl;
@@ -754,11 +1054,30 @@ int main(int argc, char* argv[])
 	std::cout << "Version: " << glGetString(GL_VERSION) << std::endl;
 	std::cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << std::endl;
 
-	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
-	glutMainLoop();
+	if (cookOnly)
+	{
+		while (TextureLoader::Instance().Pending() > 0)
+		{
+			TextureLoader::Instance().Pump(1000.0);
+			glFinish();
+		}
+		std::cout << "Cooked all models and textures" << std::endl;
+		Trace::Instance().Record("Startup", "", Trace::Instance().Start(), Trace::Clock::now());
+		Trace::Instance().Write(startupTraceFile);
+	}
+	else
+	{
+		glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+		glutMainLoop();
+	}
 
 	// Cleanup
-	glDeleteBuffers(1, &CTM::MatricesUniBuffer);
+	VertexArena::Instance().Shutdown();
+	TextureLoader::Instance().Shutdown();
+	ThreadPool::Instance().Shutdown();
+	instanceBuffer.Shutdown();
+	lightBuffer.Shutdown();
+	GLState::Instance().DeleteBuffers(1, &CTM::MatricesUniBuffer);
 
 	return true;
 }
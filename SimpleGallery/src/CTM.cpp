@@ -3,6 +3,8 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include "GLState.h"
+
 GLuint CTM::MatricesUniBuffer;
 
 void CTM::PushMatrix()
@@ -22,34 +24,32 @@ void CTM::LoadIdentity()
 	_model = glm::mat4();
 }
 
-void CTM::SetModel() const
-{
-	glBindBuffer(GL_UNIFORM_BUFFER, MatricesUniBuffer);
-	glBufferSubData(GL_UNIFORM_BUFFER, ModelMatrixOffset, MatrixSize, glm::value_ptr(_model));
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
-}
-
 void CTM::SetView(const glm::mat4& view) const
 {
-	glBindBuffer(GL_UNIFORM_BUFFER, MatricesUniBuffer);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, MatricesUniBuffer);
 	glBufferSubData(GL_UNIFORM_BUFFER, ViewMatrixOffset, MatrixSize, glm::value_ptr(view));
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 void CTM::SetOrthographic(const GLfloat& left, const GLfloat& right, const GLfloat& bottom, const GLfloat& top, const GLfloat& near, const GLfloat& far) const
 {
 	const auto orthographicProjection = glm::ortho(left, right, bottom, top, near, far);
-	glBindBuffer(GL_UNIFORM_BUFFER, MatricesUniBuffer);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, MatricesUniBuffer);
 	glBufferSubData(GL_UNIFORM_BUFFER, ProjMatrixOffset, MatrixSize, glm::value_ptr(orthographicProjection));
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 void CTM::SetPerspective(const GLfloat& FOV, const GLfloat& aspectRatio, const GLfloat& nearPlane, const GLfloat& farPlane) const
 {
-	const auto perspectiveProjection = glm::perspective(glm::radians(FOV), aspectRatio, nearPlane, farPlane);
-	glBindBuffer(GL_UNIFORM_BUFFER, MatricesUniBuffer);
+	const auto perspectiveProjection = Perspective(FOV, aspectRatio, nearPlane, farPlane);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, MatricesUniBuffer);
 	glBufferSubData(GL_UNIFORM_BUFFER, ProjMatrixOffset, MatrixSize, glm::value_ptr(perspectiveProjection));
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+glm::mat4 CTM::Perspective(const GLfloat& FOV, const GLfloat& aspectRatio, const GLfloat& nearPlane, const GLfloat& farPlane)
+{
+	return glm::perspective(glm::radians(FOV), aspectRatio, nearPlane, farPlane);
 }
 
 void CTM::Translate(const glm::vec3& translate)
@@ -86,3 +86,8 @@ void CTM::MultMatrix(const GLfloat mat[16])
 {
 	_model = _model * glm::make_mat4(mat);
 }
+
+const glm::mat4& CTM::GetModel() const
+{
+	return _model;
+}
@@ -0,0 +1,63 @@
+#include "Frustum.h"
+
+#include <cmath>
+
+void TransformAabb(const glm::mat4& model, const float aabbMin[3], const float aabbMax[3], glm::vec3& outMin, glm::vec3& outMax)
+{
+	// The center is transformed and the half extents go through the
+	// absolute of the linear part
+	const glm::vec3 localCenter(0.5f * (aabbMin[0] + aabbMax[0]), 0.5f * (aabbMin[1] + aabbMax[1]), 0.5f * (aabbMin[2] + aabbMax[2]));
+	const glm::vec3 localExtent(0.5f * (aabbMax[0] - aabbMin[0]), 0.5f * (aabbMax[1] - aabbMin[1]), 0.5f * (aabbMax[2] - aabbMin[2]));
+	const auto center = glm::vec3(model * glm::vec4(localCenter, 1.0f));
+	glm::vec3 extent;
+	for (auto r = 0; r < 3; ++r)
+	{
+		extent[r] = std::fabs(model[0][r]) * localExtent.x + std::fabs(model[1][r]) * localExtent.y + std::fabs(model[2][r]) * localExtent.z;
+	}
+	outMin = center - extent;
+	outMax = center + extent;
+}
+
+void Frustum::Extract(const glm::mat4& viewProjection)
+{
+	// Rows of the matrix, glm is column major
+	glm::vec4 rows[4];
+	for (auto r = 0; r < 4; ++r)
+	{
+		rows[r] = glm::vec4(viewProjection[0][r], viewProjection[1][r], viewProjection[2][r], viewProjection[3][r]);
+	}
+
+	_planes[0] = rows[3] + rows[0];
+	_planes[1] = rows[3] - rows[0];
+	_planes[2] = rows[3] + rows[1];
+	_planes[3] = rows[3] - rows[1];
+	_planes[4] = rows[3] + rows[2];
+	_planes[5] = rows[3] - rows[2];
+
+	for (auto& plane : _planes)
+	{
+		plane /= glm::length(glm::vec3(plane));
+	}
+}
+
+bool Frustum::Intersects(const glm::mat4& model, const float aabbMin[3], const float aabbMax[3]) const
+{
+	// Nodes without meshes have an empty box
+	if (aabbMin[0] > aabbMax[0])
+		return false;
+
+	glm::vec3 worldMin, worldMax;
+	TransformAabb(model, aabbMin, aabbMax, worldMin, worldMax);
+	const auto center = 0.5f * (worldMin + worldMax);
+	const auto extent = 0.5f * (worldMax - worldMin);
+
+	for (const auto& plane : _planes)
+	{
+		const auto normal = glm::vec3(plane);
+		const auto distance = glm::dot(normal, center) + plane.w;
+		const auto radius = glm::dot(glm::abs(normal), extent);
+		if (distance + radius < 0.0f)
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,330 @@
+#include "GLState.h"
+
+#include <cstdio>
+
+GLState& GLState::Instance()
+{
+	// Never destroyed, models delete their textures from static destructors
+	static auto state = new GLState();
+	return *state;
+}
+
+bool GLState::changed(StateType type, bool differs)
+{
+	if (differs)
+	{
+		++_frame.issued[type];
+		return true;
+	}
+	++_frame.filtered[type];
+	return false;
+}
+
+int GLState::capabilitySlot(GLenum capability)
+{
+	switch (capability)
+	{
+	case GL_BLEND: return BlendSlot;
+	case GL_DEPTH_TEST: return DepthTestSlot;
+	case GL_STENCIL_TEST: return StencilTestSlot;
+	case GL_MULTISAMPLE: return MultisampleSlot;
+	case GL_CULL_FACE: return CullFaceSlot;
+	default: return -1;
+	}
+}
+
+int GLState::bufferSlot(GLenum target)
+{
+	switch (target)
+	{
+	case GL_ARRAY_BUFFER: return ArrayBufferSlot;
+	case GL_UNIFORM_BUFFER: return UniformBufferSlot;
+	case GL_COPY_WRITE_BUFFER: return CopyWriteBufferSlot;
+	case GL_PIXEL_UNPACK_BUFFER: return PixelUnpackBufferSlot;
+	default: return -1;
+	}
+}
+
+int GLState::textureSlot(GLenum target)
+{
+	return target == GL_TEXTURE_2D_ARRAY ? 1 : 0;
+}
+
+void GLState::UseProgram(GLuint program)
+{
+	if (changed(Program, program != _program))
+	{
+		glUseProgram(program);
+		_program = program;
+	}
+}
+
+void GLState::Enable(GLenum capability)
+{
+	const auto slot = capabilitySlot(capability);
+	if (slot < 0)
+	{
+		glEnable(capability);
+		++_frame.issued[Capability];
+	}
+	else if (changed(Capability, _capabilities[slot] != 1))
+	{
+		glEnable(capability);
+		_capabilities[slot] = 1;
+	}
+}
+
+void GLState::Disable(GLenum capability)
+{
+	const auto slot = capabilitySlot(capability);
+	if (slot < 0)
+	{
+		glDisable(capability);
+		++_frame.issued[Capability];
+	}
+	else if (changed(Capability, _capabilities[slot] != 0))
+	{
+		glDisable(capability);
+		_capabilities[slot] = 0;
+	}
+}
+
+void GLState::BlendFunc(GLenum source, GLenum destination)
+{
+	if (changed(Blend, source != _blendSource || destination != _blendDestination))
+	{
+		glBlendFunc(source, destination);
+		_blendSource = source;
+		_blendDestination = destination;
+	}
+}
+
+void GLState::PolygonMode(GLenum mode)
+{
+	if (changed(Raster, mode != _polygonMode))
+	{
+		glPolygonMode(GL_FRONT_AND_BACK, mode);
+		_polygonMode = mode;
+	}
+}
+
+void GLState::ClearColor(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha)
+{
+	if (changed(Raster, red != _clearColor[0] || green != _clearColor[1] || blue != _clearColor[2] || alpha != _clearColor[3]))
+	{
+		glClearColor(red, green, blue, alpha);
+		_clearColor[0] = red;
+		_clearColor[1] = green;
+		_clearColor[2] = blue;
+		_clearColor[3] = alpha;
+	}
+}
+
+void GLState::ColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha)
+{
+	if (changed(Raster, red != _colorMask[0] || green != _colorMask[1] || blue != _colorMask[2] || alpha != _colorMask[3]))
+	{
+		glColorMask(red, green, blue, alpha);
+		_colorMask[0] = red;
+		_colorMask[1] = green;
+		_colorMask[2] = blue;
+		_colorMask[3] = alpha;
+	}
+}
+
+void GLState::StencilFunc(GLenum func, GLint ref, GLuint mask)
+{
+	if (changed(Stencil, func != _stencilFunc || ref != _stencilRef || mask != _stencilMask))
+	{
+		glStencilFunc(func, ref, mask);
+		_stencilFunc = func;
+		_stencilRef = ref;
+		_stencilMask = mask;
+	}
+}
+
+void GLState::StencilOp(GLenum stencilFail, GLenum depthFail, GLenum depthPass)
+{
+	if (changed(Stencil, stencilFail != _stencilOp[0] || depthFail != _stencilOp[1] || depthPass != _stencilOp[2]))
+	{
+		glStencilOp(stencilFail, depthFail, depthPass);
+		_stencilOp[0] = stencilFail;
+		_stencilOp[1] = depthFail;
+		_stencilOp[2] = depthPass;
+	}
+}
+
+void GLState::BindVertexArray(GLuint vao)
+{
+	if (changed(VertexArray, vao != _vao))
+	{
+		glBindVertexArray(vao);
+		_vao = vao;
+	}
+}
+
+void GLState::BindTexture(GLenum target, GLuint texture)
+{
+	BindTexture(_activeUnit, target, texture);
+}
+
+void GLState::BindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+	auto& bound = _textures[unit][textureSlot(target)];
+	if (!changed(Texture, texture != bound))
+		return;
+
+	// Switching units only counts when it comes with a bind
+	if (unit != _activeUnit)
+	{
+		glActiveTexture(GL_TEXTURE0 + unit);
+		_activeUnit = unit;
+		++_frame.issued[Texture];
+	}
+	glBindTexture(target, texture);
+	bound = texture;
+}
+
+void GLState::BindBuffer(GLenum target, GLuint buffer)
+{
+	const auto slot = bufferSlot(target);
+	if (slot < 0)
+	{
+		glBindBuffer(target, buffer);
+		++_frame.issued[Buffer];
+	}
+	else if (changed(Buffer, buffer != _buffers[slot]))
+	{
+		glBindBuffer(target, buffer);
+		_buffers[slot] = buffer;
+	}
+}
+
+void GLState::BindBufferRange(GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+	if (index >= _uniformBlocks.size())
+		_uniformBlocks.resize(index + 1, {0, 0, 0});
+
+	auto& range = _uniformBlocks[index];
+	if (changed(UniformBlock, buffer != range.buffer || offset != range.offset || size != range.size))
+	{
+		glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+		range.buffer = buffer;
+		range.offset = offset;
+		range.size = size;
+		_buffers[UniformBufferSlot] = buffer;
+	}
+}
+
+GLState::UniformValue* GLState::uniform(GLint location)
+{
+	if (location < 0)
+		return nullptr;
+
+	// A program keeps its uniforms while another one is in use
+	auto itr = _uniforms.begin();
+	while (itr != _uniforms.end() && itr->program != _program)
+	{
+		++itr;
+	}
+	if (itr == _uniforms.end())
+	{
+		_uniforms.push_back({_program, {}});
+		itr = _uniforms.end() - 1;
+	}
+
+	auto& values = itr->values;
+	if (static_cast<size_t>(location) >= values.size())
+		values.resize(location + 1, UniformValue());
+	return &values[location];
+}
+
+void GLState::Uniform1i(GLint location, GLint value)
+{
+	auto cached = uniform(location);
+	if (cached && changed(Uniform, !cached->set || cached->i != value))
+	{
+		glUniform1i(location, value);
+		cached->set = true;
+		cached->i = value;
+	}
+}
+
+void GLState::Uniform3f(GLint location, GLfloat x, GLfloat y, GLfloat z)
+{
+	auto cached = uniform(location);
+	if (cached && changed(Uniform, !cached->set || cached->f[0] != x || cached->f[1] != y || cached->f[2] != z))
+	{
+		glUniform3f(location, x, y, z);
+		cached->set = true;
+		cached->f[0] = x;
+		cached->f[1] = y;
+		cached->f[2] = z;
+	}
+}
+
+void GLState::DeleteTextures(GLsizei n, const GLuint* textures)
+{
+	// GL unbinds deleted textures from every unit
+	for (auto i = 0; i < n; ++i)
+	{
+		for (auto& unit : _textures)
+		{
+			for (auto& bound : unit)
+			{
+				if (bound == textures[i])
+					bound = 0;
+			}
+		}
+	}
+	glDeleteTextures(n, textures);
+}
+
+void GLState::DeleteBuffers(GLsizei n, const GLuint* buffers)
+{
+	// GL resets every binding to a deleted buffer, indexed ones included
+	for (auto i = 0; i < n; ++i)
+	{
+		for (auto& bound : _buffers)
+		{
+			if (bound == buffers[i])
+				bound = 0;
+		}
+		for (auto& range : _uniformBlocks)
+		{
+			if (range.buffer == buffers[i])
+				range = {0, 0, 0};
+		}
+	}
+	glDeleteBuffers(n, buffers);
+}
+
+void GLState::DeleteVertexArrays(GLsizei n, const GLuint* vaos)
+{
+	for (auto i = 0; i < n; ++i)
+	{
+		if (_vao == vaos[i])
+			_vao = 0;
+	}
+	glDeleteVertexArrays(n, vaos);
+}
+
+void GLState::BeginFrame()
+{
+	_lastFrame = _frame;
+	_frame = {};
+}
+
+void GLState::ReportStats(const Stats& stats)
+{
+	static const char* names[NumStateTypes] = {
+		"program", "capability", "blend", "raster", "stencil",
+		"vertex array", "texture", "buffer", "uniform block", "uniform"
+	};
+
+	printf("GL state changes in a frame, issued / filtered:\n");
+	for (auto type = 0; type < NumStateTypes; ++type)
+	{
+		printf("  %-14s %6lu / %lu\n", names[type], stats.issued[type], stats.filtered[type]);
+	}
+}
@@ -0,0 +1,146 @@
+#include "InstanceBuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include "GLState.h"
+
+static_assert(sizeof(InstanceBuffer::Transform) == 112, "Transform must match the std140 size of an instances element");
+
+namespace
+{
+	// Bytes of a region until a frame needs more
+	const GLsizeiptr InitialRegionSize = 256 * 1024;
+	// Nanoseconds to wait for a fence before checking again
+	const GLuint64 FenceTimeout = 1000000000;
+}
+
+void InstanceBuffer::Init()
+{
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &_alignment);
+	glGenBuffers(1, &_buffer);
+	allocate(InitialRegionSize);
+}
+
+void InstanceBuffer::Shutdown()
+{
+	for (auto& fence : _fences)
+	{
+		if (fence)
+			glDeleteSync(fence);
+		fence = nullptr;
+	}
+	GLState::Instance().DeleteBuffers(1, &_buffer);
+	_buffer = 0;
+	_regionSize = 0;
+}
+
+void InstanceBuffer::allocate(GLsizeiptr regionSize)
+{
+	// Regions start on the offset alignment so every range in them does too
+	_regionSize = (regionSize + _alignment - 1) / _alignment * _alignment;
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, _buffer);
+	glBufferData(GL_UNIFORM_BUFFER, _regionSize * NumRegions, nullptr, GL_STREAM_DRAW);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	// Fresh storage, nothing in flight reads it
+	for (auto& fence : _fences)
+	{
+		if (fence)
+			glDeleteSync(fence);
+		fence = nullptr;
+	}
+}
+
+void InstanceBuffer::Begin()
+{
+	if (_fences[_region])
+		glDeleteSync(_fences[_region]);
+	_fences[_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	_region = (_region + 1) % NumRegions;
+	if (_fences[_region])
+	{
+		auto result = glClientWaitSync(_fences[_region], GL_SYNC_FLUSH_COMMANDS_BIT, FenceTimeout);
+		while (result == GL_TIMEOUT_EXPIRED)
+		{
+			result = glClientWaitSync(_fences[_region], 0, FenceTimeout);
+		}
+		glDeleteSync(_fences[_region]);
+		_fences[_region] = nullptr;
+	}
+
+	_staging.clear();
+	_uploaded = 0;
+}
+
+GLintptr InstanceBuffer::Add(const glm::mat4* matrices, GLsizei count)
+{
+	// Range offsets must be multiples of the driver's alignment
+	const auto offset = static_cast<GLintptr>((_staging.size() + _alignment - 1) / _alignment * _alignment);
+	const auto n = count < MaxInstances ? count : MaxInstances;
+	_staging.resize(offset + sizeof(Transform) * n);
+	auto transforms = reinterpret_cast<Transform *>(&_staging[offset]);
+	for (auto i = 0; i < n; ++i)
+	{
+		transforms[i] = MakeTransform(matrices[i]);
+	}
+	return offset;
+}
+
+InstanceBuffer::Transform InstanceBuffer::MakeTransform(const glm::mat4& model)
+{
+	// Columns of the same length at right angles, the normals only need
+	// renormalizing which full.frag does anyway
+	const auto linear = glm::mat3(model);
+	const auto x = glm::dot(linear[0], linear[0]);
+	const auto y = glm::dot(linear[1], linear[1]);
+	const auto z = glm::dot(linear[2], linear[2]);
+	const auto tolerance = 1e-4f * std::max(x, std::max(y, z));
+	const auto similarity = std::abs(x - y) <= tolerance && std::abs(x - z) <= tolerance
+		&& std::abs(glm::dot(linear[0], linear[1])) <= tolerance
+		&& std::abs(glm::dot(linear[0], linear[2])) <= tolerance
+		&& std::abs(glm::dot(linear[1], linear[2])) <= tolerance;
+	const auto normal = similarity ? linear : glm::transpose(glm::inverse(linear));
+
+	Transform transform;
+	transform.model = model;
+	for (auto c = 0; c < 3; ++c)
+	{
+		transform.normal[c] = glm::vec4(normal[c], 0.0f);
+	}
+	return transform;
+}
+
+void InstanceBuffer::Upload()
+{
+	if (_uploaded == _staging.size())
+		return;
+
+	// The last range still spans a whole block
+	const auto size = static_cast<GLsizeiptr>(_staging.size()) + BlockSize;
+	if (size > _regionSize)
+	{
+		// Draws already issued keep reading the orphaned storage, the whole
+		// frame goes to the new one as later draws may reuse earlier ranges
+		allocate(size * 2);
+		_uploaded = 0;
+		std::cout << "Instance buffer grown to " << _regionSize * NumRegions / 1024 << " KiB" << std::endl;
+	}
+
+	// Nothing in flight reads the region past what was uploaded, the fences
+	// keep older frames' regions apart
+	const auto bytes = _staging.size() - _uploaded;
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, _buffer);
+	auto data = glMapBufferRange(GL_UNIFORM_BUFFER, RegionOffset() + _uploaded, bytes,
+	                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (data)
+	{
+		memcpy(data, &_staging[_uploaded], bytes);
+		glUnmapBuffer(GL_UNIFORM_BUFFER);
+	}
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+	_uploaded = _staging.size();
+}
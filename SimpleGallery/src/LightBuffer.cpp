@@ -0,0 +1,49 @@
+#include "LightBuffer.h"
+
+#include <cstring>
+
+#include "GLState.h"
+
+static_assert(sizeof(LightBuffer::DirLight) == 64, "DirLight must match its std140 size");
+static_assert(sizeof(LightBuffer::PointLight) == 80, "PointLight must match its std140 size");
+static_assert(sizeof(LightBuffer::SpotLight) == 96, "SpotLight must match its std140 size");
+static_assert(sizeof(LightBuffer::Block) == 2512, "Block must match the std140 size of Lights");
+
+void LightBuffer::Init(GLuint bindingPoint)
+{
+	glGenBuffers(1, &_buffer);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, _buffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(Block), nullptr, GL_DYNAMIC_DRAW);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+	GLState::Instance().BindBufferRange(bindingPoint, _buffer, 0, sizeof(Block));
+	_valid = false;
+}
+
+void LightBuffer::Shutdown()
+{
+	GLState::Instance().DeleteBuffers(1, &_buffer);
+	_buffer = 0;
+	_valid = false;
+}
+
+bool LightBuffer::Upload()
+{
+	// Every byte is a member, pads included, so equal blocks compare equal
+	if (_valid && memcmp(&_block, &_uploaded, sizeof(Block)) == 0)
+		return false;
+
+	// Orphan so last frame's draws don't hold the upload back
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, _buffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(Block), &_block, GL_DYNAMIC_DRAW);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+	_uploaded = _block;
+	_valid = true;
+	return true;
+}
+
+void LightBuffer::Set(float (&dst)[3], const glm::vec3& value)
+{
+	dst[0] = value.x;
+	dst[1] = value.y;
+	dst[2] = value.z;
+}
@@ -0,0 +1,243 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <unordered_map>
+
+namespace MeshOptimizer
+{
+	float ACMR(const uint32_t* indices, size_t numIndices, size_t numVertices, unsigned int cacheSize)
+	{
+		if (numIndices < 3)
+			return 0.0f;
+
+		// A vertex is cached while fewer than cacheSize misses happened since it was loaded
+		std::vector<size_t> loadedAt(numVertices, 0);
+		size_t misses = 0;
+		for (size_t i = 0; i < numIndices; ++i)
+		{
+			const auto v = indices[i];
+			if (loadedAt[v] == 0 || misses - loadedAt[v] >= cacheSize)
+			{
+				++misses;
+				loadedAt[v] = misses;
+			}
+		}
+		return static_cast<float>(misses) / (numIndices / 3);
+	}
+
+	// Next fanning vertex: the candidate that stays in the cache longest
+	// after its remaining triangles are emitted, else a dead end vertex
+	static int64_t nextVertex(const std::vector<uint32_t>& candidates, const std::vector<uint32_t>& live,
+	                          const std::vector<size_t>& cacheTime, size_t timestamp, unsigned int cacheSize,
+	                          std::vector<uint32_t>& deadEnd, size_t& cursor)
+	{
+		int64_t best = -1;
+		int64_t bestPriority = -1;
+		for (auto v : candidates)
+		{
+			if (live[v] == 0)
+				continue;
+
+			int64_t priority = 0;
+			if (timestamp - cacheTime[v] + 2 * live[v] <= cacheSize)
+				priority = static_cast<int64_t>(timestamp - cacheTime[v]);
+			if (priority > bestPriority)
+			{
+				bestPriority = priority;
+				best = v;
+			}
+		}
+		if (best >= 0)
+			return best;
+
+		while (!deadEnd.empty())
+		{
+			const auto v = deadEnd.back();
+			deadEnd.pop_back();
+			if (live[v] > 0)
+				return v;
+		}
+
+		while (cursor < live.size())
+		{
+			if (live[cursor] > 0)
+				return static_cast<int64_t>(cursor++);
+			++cursor;
+		}
+		return -1;
+	}
+
+	void OptimizeVertexCache(uint32_t* indices, size_t numIndices, size_t numVertices, unsigned int cacheSize)
+	{
+		const auto numTriangles = numIndices / 3;
+		if (numTriangles == 0 || numVertices == 0)
+			return;
+
+		// Triangles using each vertex, as ranges into one array
+		std::vector<uint32_t> live(numVertices, 0);
+		for (size_t i = 0; i < numTriangles * 3; ++i)
+			++live[indices[i]];
+
+		std::vector<size_t> firstTriangle(numVertices + 1, 0);
+		for (size_t v = 0; v < numVertices; ++v)
+			firstTriangle[v + 1] = firstTriangle[v] + live[v];
+		std::vector<uint32_t> adjacency(firstTriangle[numVertices]);
+		std::vector<size_t> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+		for (size_t t = 0; t < numTriangles; ++t)
+		{
+			for (auto k = 0; k < 3; ++k)
+				adjacency[filled[indices[t * 3 + k]]++] = static_cast<uint32_t>(t);
+		}
+
+		std::vector<size_t> cacheTime(numVertices, 0);
+		std::vector<bool> emitted(numTriangles, false);
+		std::vector<uint32_t> deadEnd;
+		std::vector<uint32_t> candidates;
+		std::vector<uint32_t> output;
+		output.reserve(numTriangles * 3);
+
+		size_t timestamp = cacheSize + 1;
+		size_t cursor = 1;
+		int64_t fanning = 0;
+		while (fanning >= 0)
+		{
+			const auto f = static_cast<uint32_t>(fanning);
+			candidates.clear();
+			for (auto a = firstTriangle[f]; a < firstTriangle[f + 1]; ++a)
+			{
+				const auto t = adjacency[a];
+				if (emitted[t])
+					continue;
+
+				for (auto k = 0; k < 3; ++k)
+				{
+					const auto v = indices[t * 3 + k];
+					output.push_back(v);
+					deadEnd.push_back(v);
+					candidates.push_back(v);
+					--live[v];
+					if (timestamp - cacheTime[v] > cacheSize)
+						cacheTime[v] = timestamp++;
+				}
+				emitted[t] = true;
+			}
+			fanning = nextVertex(candidates, live, cacheTime, timestamp, cacheSize, deadEnd, cursor);
+		}
+
+		std::copy(output.begin(), output.end(), indices);
+	}
+
+	void OptimizeVertexFetch(uint32_t* indices, size_t numIndices, size_t numVertices, std::vector<uint32_t>& remap)
+	{
+		const auto unused = static_cast<uint32_t>(-1);
+		remap.assign(numVertices, unused);
+
+		uint32_t next = 0;
+		for (size_t i = 0; i < numIndices; ++i)
+		{
+			auto& target = remap[indices[i]];
+			if (target == unused)
+				target = next++;
+			indices[i] = target;
+		}
+
+		for (auto& target : remap)
+		{
+			if (target == unused)
+				target = next++;
+		}
+	}
+
+	void RemapStream(float* stream, size_t numVertices, unsigned int components, const std::vector<uint32_t>& remap)
+	{
+		std::vector<float> copy(stream, stream + numVertices * components);
+		for (size_t v = 0; v < numVertices; ++v)
+		{
+			for (unsigned int c = 0; c < components; ++c)
+				stream[remap[v] * components + c] = copy[v * components + c];
+		}
+	}
+
+	void SimplifyClusters(const uint32_t* indices, size_t numIndices, const float* positions, size_t numVertices,
+	                      const float aabbMin[3], float cellSize, std::vector<uint32_t>& output)
+	{
+		output.clear();
+		if (numIndices < 3 || numVertices == 0 || cellSize <= 0.0f)
+			return;
+
+		// Cells are keyed by their 21 bit coordinates on each axis
+		std::unordered_map<uint64_t, uint32_t> cellIndex;
+		std::vector<uint32_t> cellOf(numVertices);
+		std::vector<float> sums;
+		std::vector<uint32_t> counts;
+		for (size_t v = 0; v < numVertices; ++v)
+		{
+			uint64_t key = 0;
+			for (auto k = 0; k < 3; ++k)
+			{
+				const auto cell = static_cast<uint64_t>(std::floor((positions[v * 3 + k] - aabbMin[k]) / cellSize));
+				key |= (cell & 0x1FFFFF) << (21 * k);
+			}
+
+			auto found = cellIndex.find(key);
+			if (found == cellIndex.end())
+			{
+				found = cellIndex.emplace(key, static_cast<uint32_t>(counts.size())).first;
+				sums.insert(sums.end(), 3, 0.0f);
+				counts.push_back(0);
+			}
+			const auto c = found->second;
+			cellOf[v] = c;
+			for (auto k = 0; k < 3; ++k)
+				sums[c * 3 + k] += positions[v * 3 + k];
+			++counts[c];
+		}
+
+		// Keep a real vertex per cell so its normal and texture coordinates come along
+		const auto none = static_cast<uint32_t>(-1);
+		std::vector<uint32_t> representative(counts.size(), none);
+		std::vector<float> bestDistance(counts.size(), 0.0f);
+		for (size_t v = 0; v < numVertices; ++v)
+		{
+			const auto c = cellOf[v];
+			auto distance = 0.0f;
+			for (auto k = 0; k < 3; ++k)
+			{
+				const auto d = positions[v * 3 + k] - sums[c * 3 + k] / counts[c];
+				distance += d * d;
+			}
+			if (representative[c] == none || distance < bestDistance[c])
+			{
+				representative[c] = static_cast<uint32_t>(v);
+				bestDistance[c] = distance;
+			}
+		}
+
+		// Rotating the smallest index first keeps the winding, so only true
+		// duplicates are merged and back to back faces both survive
+		std::vector<std::array<uint32_t, 3>> triangles;
+		triangles.reserve(numIndices / 3);
+		for (size_t i = 0; i + 2 < numIndices; i += 3)
+		{
+			std::array<uint32_t, 3> t = {
+				representative[cellOf[indices[i]]],
+				representative[cellOf[indices[i + 1]]],
+				representative[cellOf[indices[i + 2]]]
+			};
+			if (t[0] == t[1] || t[1] == t[2] || t[0] == t[2])
+				continue;
+
+			while (t[0] > t[1] || t[0] > t[2])
+				t = {t[1], t[2], t[0]};
+			triangles.push_back(t);
+		}
+		std::sort(triangles.begin(), triangles.end());
+		triangles.erase(std::unique(triangles.begin(), triangles.end()), triangles.end());
+
+		output.reserve(triangles.size() * 3);
+		for (const auto& t : triangles)
+			output.insert(output.end(), t.begin(), t.end());
+	}
+}
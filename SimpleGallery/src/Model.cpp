@@ -2,64 +2,116 @@
 
 #include <iostream>
 #include <fstream>
-#include <IL/il.h>
-
-Model::~Model()
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <tuple>
+
+#include <assimp/Importer.hpp>
+#include <assimp/PostProcess.h>
+#include <assimp/Scene.h>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "Frustum.h"
+#include "GLState.h"
+#include "InstanceBuffer.h"
+#include "TextureLoader.h"
+#include "TextureRegistry.h"
+#include "Trace.h"
+
+bool Model::importBreakdown = false;
+
+// Post-process steps in the order Assimp itself runs them (PostStepRegistry),
+// for the per-step breakdown of an import
+static const struct
 {
-	textureIdMap.clear();
-
-	// clear meshes stuff
-	for (unsigned int i = 0; i < meshes.size(); ++i)
+	unsigned int flag;
+	const char* name;
+} postProcessSteps[] = {
+	{aiProcess_ValidateDataStructure, "ValidateDataStructure"},
+	{aiProcess_RemoveRedundantMaterials, "RemoveRedundantMaterials"},
+	{aiProcess_FindDegenerates, "FindDegenerates"},
+	{aiProcess_GenUVCoords, "GenUVCoords"},
+	{aiProcess_Triangulate, "Triangulate"},
+	{aiProcess_SortByPType, "SortByPType"},
+	{aiProcess_FindInvalidData, "FindInvalidData"},
+	{aiProcess_SplitLargeMeshes, "SplitLargeMeshes"},
+	{aiProcess_GenNormals, "GenNormals"},
+	{aiProcess_GenSmoothNormals, "GenSmoothNormals"},
+	{aiProcess_CalcTangentSpace, "CalcTangentSpace"},
+	{aiProcess_JoinIdenticalVertices, "JoinIdenticalVertices"},
+	{aiProcess_LimitBoneWeights, "LimitBoneWeights"},
+	{aiProcess_ImproveCacheLocality, "ImproveCacheLocality"},
+};
+
+unsigned int ImportProfileFlags(ImportProfile profile)
+{
+	const unsigned int fast = aiProcess_Triangulate | aiProcess_GenNormals | aiProcess_SortByPType;
+	switch (profile)
 	{
-		glDeleteVertexArrays(1, &(meshes[i].vao));
-		glDeleteTextures(1, &(meshes[i].texIndex));
-		glDeleteBuffers(1, &(meshes[i].uniformBlockIndex));
+	case ImportProfile::Fast:
+		return fast;
+	case ImportProfile::Balanced:
+		return (fast & ~aiProcess_GenNormals) | aiProcess_GenSmoothNormals | aiProcess_JoinIdenticalVertices
+			| aiProcess_RemoveRedundantMaterials | aiProcess_FindDegenerates | aiProcess_FindInvalidData;
+	default:
+		return aiProcessPreset_TargetRealtime_Quality;
 	}
 }
 
-void Model::get_bounding_box_for_node(const aiNode* nd,
-                                      aiVector3D* min,
-                                      aiVector3D* max)
-
+const char* ImportProfileName(ImportProfile profile)
 {
-	//aiMatrix4x4 prev;
-	unsigned int n = 0, t;
-
-	for (; n < nd->mNumMeshes; ++n)
+	switch (profile)
 	{
-		const aiMesh* mesh = scene->mMeshes[nd->mMeshes[n]];
-		for (t = 0; t < mesh->mNumVertices; ++t)
-		{
-			aiVector3D tmp = mesh->mVertices[t];
+	case ImportProfile::Fast:
+		return "fast";
+	case ImportProfile::Balanced:
+		return "balanced";
+	default:
+		return "quality";
+	}
+}
 
-			min->x = aisgl_min(min->x, tmp.x);
-			min->y = aisgl_min(min->y, tmp.y);
-			min->z = aisgl_min(min->z, tmp.z);
+// Streamed textures are at full resolution within this distance of the
+// viewer (half the room pitch) and one mip level coarser per doubling
+static const float FullDetailDistance = 6.5f;
 
-			max->x = aisgl_max(max->x, tmp.x);
-			max->y = aisgl_max(max->y, tmp.y);
-			max->z = aisgl_max(max->z, tmp.z);
-		}
+Model::~Model()
+{
+	// textures and materials can be shared between meshes, release each once
+	for (auto itr = textureIdMap.begin(); itr != textureIdMap.end(); ++itr)
+	{
+		if (textureLayers.find((*itr).first) == textureLayers.end())
+			TextureRegistry::Instance().Release((*itr).second);
+	}
+	textureIdMap.clear();
+	if (!arrayTextures.empty())
+	{
+		GLState::Instance().DeleteTextures(static_cast<GLsizei>(arrayTextures.size()), arrayTextures.data());
+		arrayTextures.clear();
 	}
 
-	for (n = 0; n < nd->mNumChildren; ++n)
+	for (auto itr = materialMap.begin(); itr != materialMap.end(); ++itr)
 	{
-		get_bounding_box_for_node(nd->mChildren[n], min, max);
+		GLState::Instance().DeleteBuffers(1, &(*itr).second);
 	}
-}
+	materialMap.clear();
 
+	if (staticTransforms != 0)
+	{
+		GLState::Instance().DeleteBuffers(1, &staticTransforms);
+	}
 
-void Model::get_bounding_box(aiVector3D* min, aiVector3D* max)
-{
-	min->x = min->y = min->z = 1e10f;
-	max->x = max->y = max->z = -1e10f;
-	get_bounding_box_for_node(scene->mRootNode, min, max);
+	// geometry belongs to the vertex arena
+	meshes.clear();
 }
 
-
 bool Model::Import3DFromFile()
 {
 	std::string pFile = dirName + modelname;
+	TraceZone zone("Model::Import3DFromFile", pFile);
 	//check if file exists
 	std::ifstream fin(pFile.c_str());
 	if (!fin.fail())
@@ -69,293 +121,640 @@ bool Model::Import3DFromFile()
 	else
 	{
 		printf("Couldn't open file: %s\n", pFile.c_str());
-		printf("%s\n", importer.GetErrorString());
 		return false;
 	}
 
-	scene = importer.ReadFile(pFile, aiProcessPreset_TargetRealtime_Quality);
+	// Materials live next to the model with the same name
+	std::string materialFile = pFile.substr(0, pFile.find_last_of('.')) + ".mtl";
+	std::string cacheFile = pFile + ".sgmc";
 
-	// If the import failed, report it
-	if (!scene)
+	const auto postProcess = ImportProfileFlags(importProfile);
+	if (ModelCache::Load(cacheFile, pFile, materialFile, postProcess, cooked))
 	{
-		printf("%s\n", importer.GetErrorString());
-		return false;
+		printf("Loaded %s from model cache.\n", pFile.c_str());
 	}
+	else
+	{
+		// Only needed to cook a stale cache, the scene is freed with it
+		Assimp::Importer importer;
 
-	// Now we can access the file's contents.
-	printf("Import of scene %s succeeded.\n", pFile.c_str());
+		// If the import failed, report it
+		if (!importWithProfile(importer, pFile))
+		{
+			printf("%s\n", importer.GetErrorString());
+			return false;
+		}
+
+		// Now we can access the file's contents.
+		printf("Import of scene %s succeeded.\n", pFile.c_str());
+
+		// A failed write only costs us the cache, the cooked scene is still usable
+		ModelCache::Cook(importer.GetScene(), pFile, materialFile, postProcess, cacheFile, cooked);
+	}
 
-	aiVector3D scene_min, scene_max; // , scene_center;
-	get_bounding_box(&scene_min, &scene_max);
+	const float* scene_min = cooked.header->sceneMin;
+	const float* scene_max = cooked.header->sceneMax;
 	float tmp;
-	tmp = scene_max.x - scene_min.x;
-	tmp = scene_max.y - scene_min.y > tmp ? scene_max.y - scene_min.y : tmp;
-	tmp = scene_max.z - scene_min.z > tmp ? scene_max.z - scene_min.z : tmp;
+	tmp = scene_max[0] - scene_min[0];
+	tmp = scene_max[1] - scene_min[1] > tmp ? scene_max[1] - scene_min[1] : tmp;
+	tmp = scene_max[2] - scene_min[2] > tmp ? scene_max[2] - scene_min[2] : tmp;
 	scaleFactor = 1.f / tmp;
 
-	// We're done. Everything will be cleaned up by the importer destructor
+	// We're done
 	return true;
 }
 
 
-int Model::LoadGLTextures()
+// The combined ReadFile is what gets cooked and what the profile costs. With
+// importBreakdown the file is read again and the steps applied one at a time
+bool Model::importWithProfile(Assimp::Importer& importer, const std::string& pFile)
 {
-	ILboolean success;
+	typedef std::chrono::steady_clock Clock;
+	importTimings.clear();
 
-	/* initialization of DevIL */
+	const auto start = Clock::now();
+	{
+		TraceZone readZone("Assimp::Importer::ReadFile", pFile);
+		importer.ReadFile(pFile, ImportProfileFlags(importProfile));
+	}
+	importTimings.push_back({"ReadFile + post-process", std::chrono::duration<double, std::milli>(Clock::now() - start).count()});
+	if (!importer.GetScene())
+		return false;
 
-	/* scan scene's materials for textures */
-	for (unsigned int m = 0; m < scene->mNumMaterials; ++m)
+	if (importBreakdown)
+		timeImportSteps(pFile);
+
+	std::string report = "Import profile " + std::string(ImportProfileName(importProfile)) + " for " + pFile + ":\n";
+	char line[96];
+	snprintf(line, sizeof(line), "    %-26s %9.2f ms\n", importTimings[0].name, importTimings[0].milliseconds);
+	report += line;
+	if (importTimings.size() > 1)
+	{
+		// Validation and the scene preprocessor run again before every step,
+		// so these add up to more than the combined read
+		report += "  breakdown, steps applied one at a time:\n";
+		auto total = 0.0;
+		for (size_t i = 1; i < importTimings.size(); ++i)
+		{
+			snprintf(line, sizeof(line), "    %-26s %9.2f ms\n", importTimings[i].name, importTimings[i].milliseconds);
+			report += line;
+			total += importTimings[i].milliseconds;
+		}
+		snprintf(line, sizeof(line), "    %-26s %9.2f ms\n", "Total", total);
+		report += line;
+	}
+	ModelCache::PrintReport(report);
+	return true;
+}
+
+
+void Model::timeImportSteps(const std::string& pFile)
+{
+	typedef std::chrono::steady_clock Clock;
+	Assimp::Importer importer;
+
+	auto start = Clock::now();
+	importer.ReadFile(pFile, 0);
+	importTimings.push_back({"ReadFile", std::chrono::duration<double, std::milli>(Clock::now() - start).count()});
+	if (!importer.GetScene())
+		return;
+
+	auto remaining = ImportProfileFlags(importProfile);
+	for (const auto& step : postProcessSteps)
 	{
-		int texIndex = 0;
-		aiString path; // filename
+		if (!(remaining & step.flag))
+			continue;
+		remaining &= ~step.flag;
 
-		aiReturn texFound = scene->mMaterials[m]->GetTexture(aiTextureType_DIFFUSE, texIndex, &path);
-		while (texFound == AI_SUCCESS)
+		start = Clock::now();
 		{
-			//fill map with textures, OpenGL image ids set to 0
-			textureIdMap[path.data] = 0;
-			// more textures?
-			texIndex++;
-			texFound = scene->mMaterials[m]->GetTexture(aiTextureType_DIFFUSE, texIndex, &path);
+			TraceZone stepZone(step.name, pFile);
+			importer.ApplyPostProcessing(step.flag);
 		}
+		importTimings.push_back({step.name, std::chrono::duration<double, std::milli>(Clock::now() - start).count()});
+		if (!importer.GetScene())
+			return;
 	}
 
-	int numTextures = textureIdMap.size();
+	// Steps missing from the table above still run, just timed together
+	if (remaining)
+	{
+		start = Clock::now();
+		importer.ApplyPostProcessing(remaining);
+		importTimings.push_back({"Other", std::chrono::duration<double, std::milli>(Clock::now() - start).count()});
+	}
+}
 
-	/* create and fill array with DevIL texture ids */
-	ILuint* imageIds = new ILuint[numTextures];
-	ilGenImages(numTextures, imageIds);
 
-	/* create and fill array with GL texture ids */
-	GLuint* textureIds = new GLuint[numTextures];
-	glGenTextures(numTextures, textureIds); /* Texture name generation */
+int Model::LoadGLTextures()
+{
+	TraceZone zone("Model::LoadGLTextures", dirName + modelname);
 
-	/* get iterator */
-	std::unordered_map<std::string, GLuint>::iterator itr = textureIdMap.begin();
-	int i = 0;
-	for (; itr != textureIdMap.end(); ++i , ++itr)
+	/* scan scene's materials for textures */
+	for (unsigned int m = 0; m < cooked.header->numMaterials; ++m)
 	{
-		//save IL image ID
-		std::string filename = (*itr).first; // get filename
-		filename = dirName + filename;
-		(*itr).second = textureIds[i]; // save texture id for filename in map
+		//fill map with textures, OpenGL image ids set to 0
+		if (cooked.materials[m].material.texCount > 0)
+			textureIdMap[cooked.materials[m].diffuseTexture] = 0;
+	}
 
-		ilBindImage(imageIds[i]); /* Binding of DevIL image name */
-		ilEnable(IL_ORIGIN_SET);
-		ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
-		success = ilLoadImage(filename.c_str());
+	/* images of the same size and format go into one texture array, so one
+	bind covers all of them. Only cooked images know their size up front,
+	the rest join on a later launch. */
+	if (textureArrays)
+	{
+		std::map<std::tuple<int, int, GLenum>, std::vector<std::string>> buckets;
+		for (auto itr = textureIdMap.begin(); itr != textureIdMap.end(); ++itr)
+		{
+			int width, height;
+			GLenum format;
+			if (TextureLoader::Instance().Probe(dirName + (*itr).first, width, height, format))
+				buckets[std::make_tuple(width, height, format)].push_back((*itr).first);
+		}
 
-		if (success)
+		for (const auto& bucket : buckets)
 		{
-			/* Convert image to RGBA */
-			ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
-
-			/* Create and load textures to OpenGL */
-			glBindTexture(GL_TEXTURE_2D, textureIds[i]);
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ilGetInteger(IL_IMAGE_WIDTH),
-			                          ilGetInteger(IL_IMAGE_HEIGHT), 0, GL_RGBA, GL_UNSIGNED_BYTE,
-			                          ilGetData());
-			glGenerateMipmap(GL_TEXTURE_2D);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glBindTexture(GL_TEXTURE_2D, 0);
-			std::cout << "Loaded texture " << filename << std::endl;
+			const auto& names = bucket.second;
+			if (names.size() < 2)
+				continue;
+
+			std::vector<std::string> filenames;
+			for (const auto& name : names)
+				filenames.push_back(dirName + name);
+			const auto array = TextureLoader::Instance().RequestArray(filenames, std::get<0>(bucket.first),
+			                                                          std::get<1>(bucket.first), std::get<2>(bucket.first), streamTextures);
+			for (size_t k = 0; k < names.size(); ++k)
+			{
+				textureIdMap[names[k]] = array;
+				textureLayers[names[k]] = static_cast<int>(k);
+			}
+			arrayTextures.push_back(array);
+			printf("%s: %u textures share a %dx%d texture array\n", (dirName + modelname).c_str(),
+			       static_cast<unsigned int>(names.size()), std::get<0>(bucket.first), std::get<1>(bucket.first));
 		}
-		else
-			printf("Couldn't load Image: %s\n", filename.c_str());
 	}
-	/* Because we have already copied image data into texture data
-	we can release memory used by image. */
-	ilDeleteImages(numTextures, imageIds);
 
-	//Cleanup
-	delete[] imageIds;
-	delete[] textureIds;
+	/* images shared with other models are only decoded once, new ones are
+	decoded in the background and sample a placeholder until resident */
+	for (auto itr = textureIdMap.begin(); itr != textureIdMap.end(); ++itr)
+	{
+		if (textureLayers.find((*itr).first) != textureLayers.end())
+			continue;
+		(*itr).second = TextureRegistry::Instance().Acquire(dirName + (*itr).first, streamTextures);
+	}
 
-	//return success;
 	return true;
 }
 
 
-//// Can't send color down as a pointer to aiColor4D because AI colors are ABGR.
-//void Color4f(const aiColor4D *color)
-//{
-//	glColor4f(color->r, color->g, color->b, color->a);
-//}
-
-void Model::set_float4(float f[4], float a, float b, float c, float d)
+ArenaRange Model::uploadMeshes(std::vector<GLint>& firstVertex, std::vector<GLsizeiptr>& firstIndexByte)
 {
-	f[0] = a;
-	f[1] = b;
-	f[2] = c;
-	f[3] = d;
-}
+	// Interleave every mesh of the model into one staging copy so the whole
+	// model goes into the vertex arena with a single upload
+	GLsizei numVertices = 0;
+	for (unsigned int n = 0; n < cooked.header->numMeshes; ++n)
+	{
+		numVertices += cooked.meshes[n].numVertices;
+	}
 
-void Model::color4_to_float4(const aiColor4D* c, float f[4])
-{
-	f[0] = c->r;
-	f[1] = c->g;
-	f[2] = c->b;
-	f[3] = c->a;
+	// meshes small enough get 16 bit indices, each mesh's indices are
+	// aligned to their own size within the model's index data
+	std::vector<Vertex> vertices(numVertices);
+	std::vector<char> indices;
+	size_t numShortMeshes = 0;
+	size_t numLodFaces = 0;
+	numVertices = 0;
+
+	for (unsigned int n = 0; n < cooked.header->numMeshes; ++n)
+	{
+		const ModelCache::MeshRecord& mesh = cooked.meshes[n];
+		const float* positions = cooked.Positions(mesh);
+		const float* normals = cooked.Normals(mesh);
+		const float* texCoords = cooked.TexCoords(mesh);
+
+		// missing streams are left zeroed
+		for (unsigned int k = 0; k < mesh.numVertices; ++k)
+		{
+			Vertex& v = vertices[numVertices + k];
+			memcpy(v.position, &positions[k * 3], sizeof(v.position));
+			if (normals)
+				memcpy(v.normal, &normals[k * 3], sizeof(v.normal));
+			if (texCoords)
+				memcpy(v.texCoord, &texCoords[k * 2], sizeof(v.texCoord));
+		}
+
+		// every level of detail back to back, they index the same vertices
+		unsigned int count = 0;
+		for (unsigned int lod = 0; lod < mesh.numLods; ++lod)
+			count += mesh.lodFaces[lod] * 3;
+		if (mesh.numVertices < 65536)
+		{
+			indices.resize((indices.size() + 1) & ~static_cast<size_t>(1));
+			firstIndexByte[n] = indices.size();
+			indices.resize(indices.size() + sizeof(GLushort) * count);
+			auto shorts = reinterpret_cast<GLushort *>(&indices[firstIndexByte[n]]);
+			for (unsigned int lod = 0; lod < mesh.numLods; ++lod)
+			{
+				const unsigned int* meshIndices = cooked.Indices(mesh, lod);
+				for (unsigned int k = 0; k < mesh.lodFaces[lod] * 3; ++k)
+					*shorts++ = static_cast<GLushort>(meshIndices[k]);
+			}
+			++numShortMeshes;
+		}
+		else
+		{
+			indices.resize((indices.size() + 3) & ~static_cast<size_t>(3));
+			firstIndexByte[n] = indices.size();
+			indices.resize(indices.size() + sizeof(GLuint) * count);
+			auto ints = reinterpret_cast<GLuint *>(&indices[firstIndexByte[n]]);
+			for (unsigned int lod = 0; lod < mesh.numLods; ++lod)
+			{
+				memcpy(ints, cooked.Indices(mesh, lod), sizeof(GLuint) * mesh.lodFaces[lod] * 3);
+				ints += mesh.lodFaces[lod] * 3;
+			}
+		}
+		numLodFaces += count / 3 - mesh.numFaces;
+
+		firstVertex[n] = numVertices;
+		numVertices += mesh.numVertices;
+	}
+	printf("%s: %u of %u meshes use 16 bit indices\n", (dirName + modelname).c_str(),
+	       static_cast<unsigned int>(numShortMeshes), cooked.header->numMeshes);
+	printf("%s: %u extra triangles for levels of detail\n", (dirName + modelname).c_str(),
+	       static_cast<unsigned int>(numLodFaces));
+
+	// compact vertices are quantized per mesh, the shader gets the box back per draw
+	std::vector<CompactVertex> packed;
+	const void* arenaVertices = vertices.data();
+	if (VertexArena::Instance().Format() == VertexFormat::Compact)
+	{
+		packed.resize(numVertices);
+		for (unsigned int n = 0; n < cooked.header->numMeshes; ++n)
+		{
+			const ModelCache::MeshRecord& mesh = cooked.meshes[n];
+			PackVertices(&vertices[firstVertex[n]], mesh.numVertices, mesh.aabbMin, mesh.aabbMax, &packed[firstVertex[n]]);
+		}
+		arenaVertices = packed.data();
+	}
+
+	return VertexArena::Instance().Upload(arenaVertices, numVertices, indices.data(), indices.size());
 }
 
 
 void Model::genVAOsAndUniformBuffer()
 {
+	TraceZone zone("Model::genVAOsAndUniformBuffer", dirName + modelname);
+
 	Mesh aMesh;
-	Material aMat;
-	GLuint buffer;
+
+	// static models draw from the batches genStaticBatches builds, their own
+	// meshes only keep bounds, levels of detail and materials
+	std::vector<GLint> firstVertex(cooked.header->numMeshes);
+	std::vector<GLsizeiptr> firstIndexByte(cooked.header->numMeshes);
+	const ArenaRange range = isStatic ? ArenaRange() : uploadMeshes(firstVertex, firstIndexByte);
 
 	// For each mesh
-	for (unsigned int n = 0; n < scene->mNumMeshes; ++n)
+	for (unsigned int n = 0; n < cooked.header->numMeshes; ++n)
 	{
-		const aiMesh* mesh = scene->mMeshes[n];
+		const ModelCache::MeshRecord& mesh = cooked.meshes[n];
+
+		aMesh.numFaces = mesh.numFaces;
+		aMesh.vao = range.vao;
+		aMesh.baseVertex = range.firstVertex + firstVertex[n];
+		aMesh.indexType = mesh.numVertices < 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+		aMesh.indexOffset = range.indexOffset + firstIndexByte[n];
+		const GLsizeiptr indexSize = aMesh.indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+		aMesh.numLods = mesh.numLods;
+		for (unsigned int lod = 0; lod < mesh.numLods; ++lod)
+		{
+			aMesh.lodFaces[lod] = mesh.lodFaces[lod];
+			aMesh.lodError[lod] = mesh.lodError[lod];
+			aMesh.lodOffset[lod] = lod == 0 ? aMesh.indexOffset : aMesh.lodOffset[lod - 1] + indexSize * mesh.lodFaces[lod - 1] * 3;
+		}
+		memcpy(aMesh.aabbMin, mesh.aabbMin, sizeof(aMesh.aabbMin));
+		memcpy(aMesh.aabbMax, mesh.aabbMax, sizeof(aMesh.aabbMax));
 
-		// create array with faces
-		// have to convert from Assimp format to array
-		unsigned int* faceArray;
-		faceArray = static_cast<unsigned int *>(malloc(sizeof(unsigned int) * mesh->mNumFaces * 3));
-		unsigned int faceIndex = 0;
+		// create material uniform buffer
+		const ModelCache::MaterialRecord& mtl = cooked.materials[mesh.materialIndex];
+		aMesh.texIndex = mtl.material.texCount > 0 ? textureIdMap[mtl.diffuseTexture] : 0;
 
-		for (unsigned int t = 0; t < mesh->mNumFaces; ++t)
+		if (materialMap.find(mtl.name) != materialMap.end())
 		{
-			const aiFace* face = &mesh->mFaces[t];
-
-			memcpy(&faceArray[faceIndex], face->mIndices, 3 * sizeof(unsigned int));
-			faceIndex += 3;
+			aMesh.uniformBlockIndex = materialMap[mtl.name];
+			std::cout << "Material already loaded " << mtl.name << std::endl;
 		}
-		aMesh.numFaces = scene->mMeshes[n]->mNumFaces;
+		else
+		{
+			if (mtl.hasOpacity)
+			{
+				opaque = true;
+			}
 
-		// generate Vertex Array for mesh
-		glGenVertexArrays(1, &(aMesh.vao));
-		glBindVertexArray(aMesh.vao);
+			// texture arrays are sampled at the material's layer
+			auto material = mtl.material;
+			const auto layer = textureLayers.find(mtl.diffuseTexture);
+			material.texLayer = material.texCount > 0 && layer != textureLayers.end() ? layer->second : -1;
 
-		// buffer for faces
-		glGenBuffers(1, &buffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * mesh->mNumFaces * 3, faceArray, GL_STATIC_DRAW);
+			glGenBuffers(1, &(aMesh.uniformBlockIndex));
+			GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, aMesh.uniformBlockIndex);
+			glBufferData(GL_UNIFORM_BUFFER, sizeof(Material), static_cast<const void *>(&material), GL_STATIC_DRAW);
+			GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
 
-		// buffer for vertex positions
-		if (mesh->HasPositions())
-		{
-			glGenBuffers(1, &buffer);
-			glBindBuffer(GL_ARRAY_BUFFER, buffer);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * mesh->mNumVertices, mesh->mVertices, GL_STATIC_DRAW);
-			glEnableVertexAttribArray(vertexLoc);
-			glVertexAttribPointer(vertexLoc, 3, GL_FLOAT, 0, 0, nullptr);
+			std::cout << "Loaded material " << mtl.name << std::endl;
+			materialMap[mtl.name] = aMesh.uniformBlockIndex;
 		}
 
-		// buffer for vertex normals
-		if (mesh->HasNormals())
+		meshes.push_back(aMesh);
+	}
+}
+
+
+void Model::genNodes()
+{
+	nodes.resize(cooked.header->numNodes);
+	for (unsigned int n = 0; n < cooked.header->numNodes; ++n)
+	{
+		const ModelCache::NodeRecord& nd = cooked.nodes[n];
+		memcpy(nodes[n].transform, nd.transform, sizeof(nodes[n].transform));
+		nodes[n].firstMesh = nd.firstMesh;
+		nodes[n].numMeshes = nd.numMeshes;
+		nodes[n].firstChild = nd.firstChild;
+		nodes[n].numChildren = nd.numChildren;
+	}
+	links.assign(cooked.links, cooked.links + cooked.header->numLinks);
+
+	// Children always come after their parent, so walking backwards has
+	// every child's bounds ready before its parent needs them
+	for (auto n = nodes.size(); n-- > 0;)
+	{
+		auto& nd = nodes[n];
+		auto bmin = glm::vec3(FLT_MAX);
+		auto bmax = glm::vec3(-FLT_MAX);
+		for (unsigned int k = 0; k < nd.numMeshes; ++k)
 		{
-			glGenBuffers(1, &buffer);
-			glBindBuffer(GL_ARRAY_BUFFER, buffer);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 3 * mesh->mNumVertices, mesh->mNormals, GL_STATIC_DRAW);
-			glEnableVertexAttribArray(normalLoc);
-			glVertexAttribPointer(normalLoc, 3, GL_FLOAT, 0, 0, nullptr);
+			const auto& mesh = meshes[links[nd.firstMesh + k]];
+			bmin = glm::min(bmin, glm::make_vec3(mesh.aabbMin));
+			bmax = glm::max(bmax, glm::make_vec3(mesh.aabbMax));
 		}
-
-		// buffer for vertex texture coordinates
-		if (mesh->HasTextureCoords(0))
+		for (unsigned int k = 0; k < nd.numChildren; ++k)
 		{
-			float* texCoords = static_cast<float *>(malloc(sizeof(float) * 2 * mesh->mNumVertices));
-			for (unsigned int k = 0; k < mesh->mNumVertices; ++k)
-			{
-				texCoords[k * 2] = mesh->mTextureCoords[0][k].x;
-				texCoords[k * 2 + 1] = mesh->mTextureCoords[0][k].y;
-			}
-			glGenBuffers(1, &buffer);
-			glBindBuffer(GL_ARRAY_BUFFER, buffer);
-			glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 2 * mesh->mNumVertices, texCoords, GL_STATIC_DRAW);
-			glEnableVertexAttribArray(texCoordLoc);
-			glVertexAttribPointer(texCoordLoc, 2, GL_FLOAT, 0, 0, nullptr);
+			const auto& child = nodes[links[nd.firstChild + k]];
+			if (child.aabbMin[0] > child.aabbMax[0])
+				continue;
+
+			// the child transform may rotate the box
+			glm::vec3 parentMin, parentMax;
+			TransformAabb(glm::make_mat4(child.transform), child.aabbMin, child.aabbMax, parentMin, parentMax);
+			bmin = glm::min(bmin, parentMin);
+			bmax = glm::max(bmax, parentMax);
 		}
+		memcpy(nd.aabbMin, glm::value_ptr(bmin), sizeof(nd.aabbMin));
+		memcpy(nd.aabbMax, glm::value_ptr(bmax), sizeof(nd.aabbMax));
+	}
+}
 
-		// unbind buffers
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+void Model::ForEachMesh(const std::function<void(unsigned int mesh, const glm::mat4& transform)>& visit) const
+{
+	if (nodes.empty())
+		return;
 
-		// create material uniform buffer
-		aiMaterial* mtl = scene->mMaterials[mesh->mMaterialIndex];
-		aiString name;
-		if (AI_SUCCESS != mtl->Get(AI_MATKEY_NAME, name))
+	struct PendingNode
+	{
+		const Node* node;
+		glm::mat4 parent;
+	};
+	std::vector<PendingNode> stack;
+	stack.push_back({&nodes[0], glm::mat4()});
+
+	while (!stack.empty())
+	{
+		const auto pending = stack.back();
+		stack.pop_back();
+		const auto& nd = *pending.node;
+		const auto transform = pending.parent * glm::make_mat4(nd.transform);
+
+		for (unsigned int n = 0; n < nd.numMeshes; ++n)
 		{
-			std::cerr << "Somethign happened when we try to get the material's name" << std::endl;
-			throw std::runtime_error("Somethign happened when we try to get the material's name");
+			visit(links[nd.firstMesh + n], transform);
 		}
 
-		aiString texPath; //contains filename of texture
-		if (AI_SUCCESS == mtl->GetTexture(aiTextureType_DIFFUSE, 0, &texPath))
+		for (unsigned int n = 0; n < nd.numChildren; ++n)
 		{
-			//bind texture
-			unsigned int texId = textureIdMap[texPath.data];
-			aMesh.texIndex = texId;
-			aMat.texCount = 1;
+			stack.push_back({&nodes[links[nd.firstChild + n]], transform});
 		}
-		else
+	}
+}
+
+void Model::genTextureBounds()
+{
+	std::unordered_map<GLuint, size_t> slots;
+	streamedTextures.clear();
+
+	ForEachMesh([&](unsigned int index, const glm::mat4& transform)
+	{
+		const auto& mesh = meshes[index];
+		const auto texture = mesh.texIndex;
+		if (texture == 0)
+			return;
+
+		auto slot = slots.find(texture);
+		if (slot == slots.end())
 		{
-			aMat.texCount = 0;
+			slot = slots.insert(std::make_pair(texture, streamedTextures.size())).first;
+			streamedTextures.push_back({texture, glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX)});
 		}
+		auto& bounds = streamedTextures[slot->second];
+
+		// the node transform may rotate the box
+		glm::vec3 worldMin, worldMax;
+		TransformAabb(transform, mesh.aabbMin, mesh.aabbMax, worldMin, worldMax);
+		bounds.min = glm::min(bounds.min, worldMin);
+		bounds.max = glm::max(bounds.max, worldMax);
+	});
+}
+
+void Model::genStaticBatches()
+{
+	TraceZone zone("Model::genStaticBatches", dirName + modelname);
+	staticBatches.clear();
+	if (nodes.empty())
+		return;
+
+	// every mesh reference with its world matrix, grouped by the state a draw
+	// binds and by region so a batch can still be culled on its own
+	struct Member
+	{
+		unsigned int mesh;
+		glm::mat4 world;
+	};
+	std::map<std::tuple<GLuint, GLuint, int>, std::vector<Member>> groups;
+	unsigned int numMeshDraws = 0;
 
-		if (materialMap.find(name.C_Str()) != materialMap.end())
+	ForEachMesh([&](unsigned int index, const glm::mat4& transform)
+	{
+		const auto& mesh = meshes[index];
+		const auto center = glm::vec3(transform * glm::vec4(0.5f * (glm::make_vec3(mesh.aabbMin) + glm::make_vec3(mesh.aabbMax)), 1.0f));
+		const auto region = staticBatchRegion ? staticBatchRegion(center) : 0;
+		groups[std::make_tuple(mesh.uniformBlockIndex, mesh.texIndex, region)].push_back({index, transform});
+		++numMeshDraws;
+	});
+
+	// Every batch goes into one staging copy, laid out like genVAOsAndUniformBuffer
+	// lays out meshes, so the whole model is a single arena upload
+	std::vector<Vertex> vertices;
+	std::vector<char> indices;
+	std::vector<GLint> firstVertex;
+	std::vector<GLsizeiptr> firstIndexByte;
+
+	for (const auto& group : groups)
+	{
+		const auto& members = group.second;
+		Mesh batch = {};
+		batch.uniformBlockIndex = std::get<0>(group.first);
+		batch.texIndex = std::get<1>(group.first);
+		batch.numLods = 1;
+
+		// vertices pre-transformed into world space, missing streams are left zeroed
+		const auto first = vertices.size();
+		std::vector<GLuint> memberVertex;
+		auto bmin = glm::vec3(FLT_MAX);
+		auto bmax = glm::vec3(-FLT_MAX);
+		for (const auto& member : members)
 		{
-			aMesh.uniformBlockIndex = materialMap[name.C_Str()];
-			std::cout << "Material already loaded " << name.C_Str() << std::endl;
+			const ModelCache::MeshRecord& record = cooked.meshes[member.mesh];
+			const float* positions = cooked.Positions(record);
+			const float* normals = cooked.Normals(record);
+			const float* texCoords = cooked.TexCoords(record);
+			const auto normalMatrix = glm::transpose(glm::inverse(glm::mat3(member.world)));
+
+			memberVertex.push_back(static_cast<GLuint>(vertices.size() - first));
+			vertices.resize(vertices.size() + record.numVertices);
+			auto v = &vertices[vertices.size() - record.numVertices];
+			for (unsigned int k = 0; k < record.numVertices; ++k, ++v)
+			{
+				const auto position = glm::vec3(member.world * glm::vec4(glm::make_vec3(&positions[k * 3]), 1.0f));
+				memcpy(v->position, glm::value_ptr(position), sizeof(v->position));
+				bmin = glm::min(bmin, position);
+				bmax = glm::max(bmax, position);
+				if (normals)
+				{
+					const auto normal = glm::normalize(normalMatrix * glm::make_vec3(&normals[k * 3]));
+					memcpy(v->normal, glm::value_ptr(normal), sizeof(v->normal));
+				}
+				if (texCoords)
+					memcpy(v->texCoord, &texCoords[k * 2], sizeof(v->texCoord));
+			}
+			batch.numLods = std::max(batch.numLods, static_cast<int>(record.numLods));
 		}
-		else
+		memcpy(batch.aabbMin, glm::value_ptr(bmin), sizeof(batch.aabbMin));
+		memcpy(batch.aabbMax, glm::value_ptr(bmax), sizeof(batch.aabbMax));
+
+		const auto numVertices = vertices.size() - first;
+		batch.indexType = numVertices < 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+		const size_t indexSize = batch.indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+		indices.resize((indices.size() + indexSize - 1) & ~(indexSize - 1));
+		firstVertex.push_back(static_cast<GLint>(first));
+		firstIndexByte.push_back(static_cast<GLsizeiptr>(indices.size()));
+
+		// level n of a batch is level n of every member, or its coarsest one.
+		// Errors are in the members' units, the world matrix scales them.
+		for (auto lod = 0; lod < batch.numLods; ++lod)
 		{
-			auto opacity = 1.0f;
-			if (AI_SUCCESS == mtl->Get(AI_MATKEY_OPACITY, opacity))
+			batch.lodFaces[lod] = 0;
+			batch.lodError[lod] = 0.0f;
+			for (size_t m = 0; m < members.size(); ++m)
 			{
-				opaque = true;
+				const ModelCache::MeshRecord& record = cooked.meshes[members[m].mesh];
+				const auto level = std::min(static_cast<uint32_t>(lod), record.numLods - 1);
+				const unsigned int* memberIndices = cooked.Indices(record, level);
+				const auto count = record.lodFaces[level] * 3;
+
+				const auto byte = indices.size();
+				indices.resize(byte + indexSize * count);
+				if (batch.indexType == GL_UNSIGNED_SHORT)
+				{
+					auto shorts = reinterpret_cast<GLushort *>(&indices[byte]);
+					for (unsigned int k = 0; k < count; ++k)
+						shorts[k] = static_cast<GLushort>(memberVertex[m] + memberIndices[k]);
+				}
+				else
+				{
+					auto ints = reinterpret_cast<GLuint *>(&indices[byte]);
+					for (unsigned int k = 0; k < count; ++k)
+						ints[k] = memberVertex[m] + memberIndices[k];
+				}
+
+				const auto& world = members[m].world;
+				const auto scale = std::max(glm::length(glm::vec3(world[0])), std::max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+				batch.lodFaces[lod] += record.lodFaces[level];
+				batch.lodError[lod] = std::max(batch.lodError[lod], record.lodError[level] * scale);
 			}
+		}
+		batch.numFaces = batch.lodFaces[0];
+		staticBatches.push_back(batch);
+	}
 
-			float c[4];
-			set_float4(c, 0.0f, 0.0f, 0.0f, opacity);
-			aiColor4D diffuse;
-			if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_DIFFUSE, &diffuse))
-				color4_to_float4(&diffuse, c);
-			memcpy(aMat.diffuse, c, sizeof(c));
-			aMat.diffuse[3] = opacity;
-
-			set_float4(c, 0.0f, 0.0f, 0.0f, opacity);
-			aiColor4D ambient;
-			if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_AMBIENT, &ambient))
-				color4_to_float4(&ambient, c);
-			memcpy(aMat.ambient, c, sizeof(c));
-			aMat.ambient[3] = opacity;
-
-			set_float4(c, 0.0f, 0.0f, 0.0f, opacity);
-			aiColor4D specular;
-			if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_SPECULAR, &specular))
-				color4_to_float4(&specular, c);
-			memcpy(aMat.specular, c, sizeof(c));
-			aMat.specular[3] = opacity;
-
-			set_float4(c, 0.0f, 0.0f, 0.0f, 1.0f);
-			aiColor4D emission;
-			if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_EMISSIVE, &emission))
-				color4_to_float4(&emission, c);
-			memcpy(aMat.emissive, c, sizeof(c));
-
-			float shininess = 0.0;
-			unsigned int max;
-			aiGetMaterialFloatArray(mtl, AI_MATKEY_SHININESS, &shininess, &max);
-			aMat.shininess = shininess;
+	if (staticBatches.empty())
+		return;
 
-			glGenBuffers(1, &(aMesh.uniformBlockIndex));
-			glBindBuffer(GL_UNIFORM_BUFFER, aMesh.uniformBlockIndex);
-			glBufferData(GL_UNIFORM_BUFFER, sizeof(aMat), static_cast<void *>(&aMat), GL_STATIC_DRAW);
-			glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	// compact vertices are quantized per batch, like per mesh otherwise
+	std::vector<CompactVertex> packed;
+	const void* arenaVertices = vertices.data();
+	if (VertexArena::Instance().Format() == VertexFormat::Compact)
+	{
+		packed.resize(vertices.size());
+		for (size_t b = 0; b < staticBatches.size(); ++b)
+		{
+			const auto end = b + 1 < staticBatches.size() ? static_cast<size_t>(firstVertex[b + 1]) : vertices.size();
+			PackVertices(&vertices[firstVertex[b]], static_cast<GLsizei>(end - firstVertex[b]),
+			             staticBatches[b].aabbMin, staticBatches[b].aabbMax, &packed[firstVertex[b]]);
+		}
+		arenaVertices = packed.data();
+	}
 
-			std::cout << "Loaded material " << name.C_Str() << std::endl;
-			materialMap[name.C_Str()] = aMesh.uniformBlockIndex;
+	const ArenaRange range = VertexArena::Instance().Upload(arenaVertices, static_cast<GLsizei>(vertices.size()), indices.data(), indices.size());
+	for (size_t b = 0; b < staticBatches.size(); ++b)
+	{
+		auto& batch = staticBatches[b];
+		batch.vao = range.vao;
+		batch.baseVertex = range.firstVertex + firstVertex[b];
+		batch.indexOffset = range.indexOffset + firstIndexByte[b];
+		const GLsizeiptr indexSize = batch.indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+		for (auto lod = 0; lod < batch.numLods; ++lod)
+		{
+			batch.lodOffset[lod] = lod == 0 ? batch.indexOffset : batch.lodOffset[lod - 1] + indexSize * batch.lodFaces[lod - 1] * 3;
 		}
+	}
 
-		meshes.push_back(aMesh);
+	// the batches are already in world space, every draw binds this identity
+	// transform; a bound range always spans the whole Instances block
+	std::vector<char> transforms(InstanceBuffer::BlockSize);
+	const auto identity = InstanceBuffer::MakeTransform(glm::mat4());
+	memcpy(transforms.data(), &identity, sizeof(identity));
+	glGenBuffers(1, &staticTransforms);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, staticTransforms);
+	glBufferData(GL_UNIFORM_BUFFER, transforms.size(), transforms.data(), GL_STATIC_DRAW);
+	GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	printf("%s: %u meshes merged into %u static batches\n", (dirName + modelname).c_str(),
+	       numMeshDraws, static_cast<unsigned int>(staticBatches.size()));
+}
+
+void Model::UpdateTextureStreaming(const glm::vec3& viewer) const
+{
+	for (const auto& bounds : streamedTextures)
+	{
+		const auto distance = glm::length(glm::clamp(viewer, bounds.min, bounds.max) - viewer);
+		const auto level = distance <= FullDetailDistance ? 0 : static_cast<int>(std::ceil(std::log2(distance / FullDetailDistance)));
+		TextureLoader::Instance().SetStreamLevel(bounds.texture, level);
 	}
 }
+
+void Model::releaseCookedScene()
+{
+	// vertex data is on the GPU and the tables above are copied, the mapped
+	// cache file or the freshly cooked blob isn't needed anymore
+	printf("Released %llu KiB of cooked data for %s\n",
+	       static_cast<unsigned long long>(cooked.header->fileSize / 1024), (dirName + modelname).c_str());
+	cooked.Release();
+}
@@ -0,0 +1,604 @@
+#include "ModelCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "MeshOptimizer.h"
+#include "Trace.h"
+
+namespace ModelCache
+{
+	static const size_t DataAlignment = 16;
+
+	// Clustering cells across the largest extent of a mesh for each level of detail
+	static const float LodGridSize[MaxMeshLods] = {0.0f, 64.0f, 32.0f, 16.0f};
+	// A level is only kept if it drops at least this share of the previous level's triangles
+	static const float LodMinReduction = 0.25f;
+
+	static size_t alignUp(size_t value, size_t alignment)
+	{
+		return (value + alignment - 1) & ~(alignment - 1);
+	}
+
+	// 64-bit FNV-1a over the whole file
+	static uint64_t hashFile(const std::string& path)
+	{
+		std::ifstream fin(path.c_str(), std::ifstream::binary);
+		uint64_t hash = 14695981039346656037ULL;
+		char buffer[64 * 1024];
+		while (fin)
+		{
+			fin.read(buffer, sizeof(buffer));
+			const auto count = fin.gcount();
+			for (std::streamsize i = 0; i < count; ++i)
+			{
+				hash ^= static_cast<unsigned char>(buffer[i]);
+				hash *= 1099511628211ULL;
+			}
+		}
+		return hash;
+	}
+
+	void PrintReport(const std::string& report)
+	{
+		fwrite(report.data(), 1, report.size(), stdout);
+	}
+
+	SourceStamp StampFile(const std::string& path, bool computeHash)
+	{
+		SourceStamp stamp = {0, 0, 0};
+		StampFile(path, computeHash, stamp);
+		return stamp;
+	}
+
+	bool StampFile(const std::string& path, bool computeHash, SourceStamp& stamp)
+	{
+		stamp = {0, 0, 0};
+#ifdef _WIN32
+		struct _stat64 info;
+		if (_stat64(path.c_str(), &info) != 0)
+			return false;
+#else
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0)
+			return false;
+#endif
+		stamp.mtime = static_cast<uint64_t>(info.st_mtime);
+		stamp.size = static_cast<uint64_t>(info.st_size);
+		if (computeHash)
+			stamp.hash = hashFile(path);
+		return true;
+	}
+
+	bool IsFresh(const std::string& path, SourceStamp& recorded, bool& restamped)
+	{
+		auto current = StampFile(path, false);
+		if (current.mtime == recorded.mtime && current.size == recorded.size)
+			return true;
+		if (current.size != recorded.size)
+			return false;
+
+		current.hash = hashFile(path);
+		if (current.hash != recorded.hash)
+			return false;
+
+		recorded = current;
+		restamped = true;
+		return true;
+	}
+
+	MappedFile::~MappedFile()
+	{
+		Close();
+	}
+
+	bool MappedFile::Open(const std::string& path)
+	{
+		Close();
+#ifdef _WIN32
+		auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr)
+		{
+			CloseHandle(file);
+			return false;
+		}
+
+		auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (view == nullptr)
+		{
+			CloseHandle(mapping);
+			CloseHandle(file);
+			return false;
+		}
+
+		_file = file;
+		_mapping = mapping;
+		_data = static_cast<const char *>(view);
+		_size = static_cast<size_t>(size.QuadPart);
+#else
+		auto fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0)
+		{
+			close(fd);
+			return false;
+		}
+
+		auto view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (view == MAP_FAILED)
+			return false;
+
+		_data = static_cast<const char *>(view);
+		_size = static_cast<size_t>(info.st_size);
+#endif
+		return true;
+	}
+
+	void MappedFile::Close()
+	{
+		if (_data == nullptr)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(_data);
+		CloseHandle(static_cast<HANDLE>(_mapping));
+		CloseHandle(static_cast<HANDLE>(_file));
+#else
+		munmap(const_cast<char *>(_data), _size);
+#endif
+		_data = nullptr;
+		_size = 0;
+		_file = nullptr;
+		_mapping = nullptr;
+	}
+
+	const char* CookedScene::base() const
+	{
+		return reinterpret_cast<const char *>(header);
+	}
+
+	const float* CookedScene::Positions(const MeshRecord& mesh) const
+	{
+		return mesh.positions ? reinterpret_cast<const float *>(base() + mesh.positions) : nullptr;
+	}
+
+	const float* CookedScene::Normals(const MeshRecord& mesh) const
+	{
+		return mesh.normals ? reinterpret_cast<const float *>(base() + mesh.normals) : nullptr;
+	}
+
+	const float* CookedScene::TexCoords(const MeshRecord& mesh) const
+	{
+		return mesh.texCoords ? reinterpret_cast<const float *>(base() + mesh.texCoords) : nullptr;
+	}
+
+	const unsigned int* CookedScene::Indices(const MeshRecord& mesh) const
+	{
+		return reinterpret_cast<const unsigned int *>(base() + mesh.indices);
+	}
+
+	const unsigned int* CookedScene::Indices(const MeshRecord& mesh, uint32_t lod) const
+	{
+		return reinterpret_cast<const unsigned int *>(base() + mesh.lodIndices[lod]);
+	}
+
+	void CookedScene::Release()
+	{
+		header = nullptr;
+		materials = nullptr;
+		meshes = nullptr;
+		nodes = nullptr;
+		links = nullptr;
+		std::vector<char>().swap(blob);
+		mapped.Close();
+	}
+
+	// Points the scene's tables into a cooked blob after validating its size
+	static bool attach(CookedScene& scene, const char* data, size_t size)
+	{
+		if (size < sizeof(Header))
+			return false;
+
+		auto header = reinterpret_cast<const Header *>(data);
+		if (header->magic != Magic || header->version != Version || header->fileSize != size)
+			return false;
+
+		size_t offset = sizeof(Header);
+		scene.materials = reinterpret_cast<const MaterialRecord *>(data + offset);
+		offset += sizeof(MaterialRecord) * header->numMaterials;
+		scene.meshes = reinterpret_cast<const MeshRecord *>(data + offset);
+		offset += sizeof(MeshRecord) * header->numMeshes;
+		scene.nodes = reinterpret_cast<const NodeRecord *>(data + offset);
+		offset += sizeof(NodeRecord) * header->numNodes;
+		scene.links = reinterpret_cast<const uint32_t *>(data + offset);
+		offset += sizeof(uint32_t) * header->numLinks;
+		if (offset > size)
+			return false;
+
+		scene.header = header;
+		return true;
+	}
+
+	bool Load(const std::string& cachePath, const std::string& modelPath, const std::string& materialPath, uint32_t postProcess, CookedScene& scene)
+	{
+		TraceZone zone("ModelCache::Load", cachePath);
+		Header header;
+		{
+			std::ifstream fin(cachePath.c_str(), std::ifstream::binary);
+			if (!fin.read(reinterpret_cast<char *>(&header), sizeof(header)))
+				return false;
+		}
+		if (header.magic != Magic || header.version != Version)
+		{
+			printf("Model cache %s is from another version\n", cachePath.c_str());
+			return false;
+		}
+		if (header.postProcess != postProcess)
+		{
+			printf("Model cache %s was cooked with another import profile\n", cachePath.c_str());
+			return false;
+		}
+
+		auto restamped = false;
+		if (!IsFresh(modelPath, header.model, restamped) || !IsFresh(materialPath, header.materials, restamped))
+		{
+			printf("Model cache %s is out of date\n", cachePath.c_str());
+			return false;
+		}
+
+		// Contents unchanged but the sources were touched, record the new mtime
+		// so the next launch doesn't have to hash them again
+		if (restamped)
+		{
+			std::fstream fout(cachePath.c_str(), std::fstream::in | std::fstream::out | std::fstream::binary);
+			fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		}
+
+		if (!scene.mapped.Open(cachePath) || !attach(scene, scene.mapped.Data(), scene.mapped.Size()))
+		{
+			scene.Release();
+			return false;
+		}
+
+		return true;
+	}
+
+	static void copyString(char* dst, size_t capacity, const char* src)
+	{
+		strncpy(dst, src, capacity - 1);
+		dst[capacity - 1] = '\0';
+	}
+
+	static void cookMaterial(const aiMaterial* mtl, MaterialRecord& record)
+	{
+		memset(&record, 0, sizeof(record));
+
+		aiString name;
+		if (AI_SUCCESS == mtl->Get(AI_MATKEY_NAME, name))
+			copyString(record.name, sizeof(record.name), name.C_Str());
+
+		aiString texPath;
+		if (AI_SUCCESS == mtl->GetTexture(aiTextureType_DIFFUSE, 0, &texPath))
+		{
+			copyString(record.diffuseTexture, sizeof(record.diffuseTexture), texPath.C_Str());
+			record.material.texCount = 1;
+		}
+
+		auto opacity = 1.0f;
+		if (AI_SUCCESS == mtl->Get(AI_MATKEY_OPACITY, opacity))
+			record.hasOpacity = 1;
+
+		auto& mat = record.material;
+		aiColor4D color;
+		mat.diffuse[3] = mat.ambient[3] = mat.specular[3] = opacity;
+		if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_DIFFUSE, &color))
+			memcpy(mat.diffuse, &color, sizeof(float) * 3);
+		if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_AMBIENT, &color))
+			memcpy(mat.ambient, &color, sizeof(float) * 3);
+		if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_SPECULAR, &color))
+			memcpy(mat.specular, &color, sizeof(float) * 3);
+
+		mat.emissive[3] = 1.0f;
+		if (AI_SUCCESS == aiGetMaterialColor(mtl, AI_MATKEY_COLOR_EMISSIVE, &color))
+			memcpy(mat.emissive, &color, sizeof(float) * 4);
+
+		float shininess = 0.0f;
+		unsigned int max;
+		aiGetMaterialFloatArray(mtl, AI_MATKEY_SHININESS, &shininess, &max);
+		mat.shininess = shininess;
+	}
+
+	static void collectNodes(const aiNode* nd, std::vector<const aiNode *>& nodes)
+	{
+		nodes.push_back(nd);
+		for (unsigned int n = 0; n < nd->mNumChildren; ++n)
+			collectNodes(nd->mChildren[n], nodes);
+	}
+
+	bool Cook(const aiScene* source, const std::string& modelPath, const std::string& materialPath, uint32_t postProcess, const std::string& cachePath, CookedScene& scene)
+	{
+		TraceZone zone("ModelCache::Cook", cachePath);
+		scene.Release();
+
+		std::vector<const aiNode *> nodes;
+		collectNodes(source->mRootNode, nodes);
+		std::unordered_map<const aiNode *, uint32_t> nodeIndex;
+		for (uint32_t i = 0; i < nodes.size(); ++i)
+			nodeIndex[nodes[i]] = i;
+
+		// Node ranges into the links table
+		std::vector<NodeRecord> nodeRecords(nodes.size());
+		std::vector<uint32_t> links;
+		for (size_t i = 0; i < nodes.size(); ++i)
+		{
+			auto nd = nodes[i];
+			auto m = nd->mTransformation;
+			// OpenGL matrices are column major
+			m.Transpose();
+			memcpy(nodeRecords[i].transform, &m, sizeof(float) * 16);
+
+			nodeRecords[i].firstMesh = static_cast<uint32_t>(links.size());
+			nodeRecords[i].numMeshes = nd->mNumMeshes;
+			links.insert(links.end(), nd->mMeshes, nd->mMeshes + nd->mNumMeshes);
+
+			nodeRecords[i].firstChild = static_cast<uint32_t>(links.size());
+			nodeRecords[i].numChildren = nd->mNumChildren;
+			for (unsigned int n = 0; n < nd->mNumChildren; ++n)
+				links.push_back(nodeIndex[nd->mChildren[n]]);
+		}
+
+		Header header;
+		memset(&header, 0, sizeof(header));
+		header.magic = Magic;
+		header.version = Version;
+		header.model = StampFile(modelPath, true);
+		header.materials = StampFile(materialPath, true);
+		header.numMaterials = source->mNumMaterials;
+		header.numMeshes = source->mNumMeshes;
+		header.numNodes = static_cast<uint32_t>(nodeRecords.size());
+		header.numLinks = static_cast<uint32_t>(links.size());
+		header.postProcess = postProcess;
+
+		// Lay out the vertex streams after the tables
+		auto offset = sizeof(Header)
+			+ sizeof(MaterialRecord) * header.numMaterials
+			+ sizeof(MeshRecord) * header.numMeshes
+			+ sizeof(NodeRecord) * header.numNodes
+			+ sizeof(uint32_t) * header.numLinks;
+
+		std::vector<MeshRecord> meshRecords(source->mNumMeshes);
+		for (unsigned int n = 0; n < source->mNumMeshes; ++n)
+		{
+			const aiMesh* mesh = source->mMeshes[n];
+			auto& record = meshRecords[n];
+			memset(&record, 0, sizeof(record));
+			record.numVertices = mesh->mNumVertices;
+			record.numFaces = mesh->mNumFaces;
+			record.materialIndex = mesh->mMaterialIndex;
+
+			offset = alignUp(offset, DataAlignment);
+			record.positions = offset;
+			offset += sizeof(float) * 3 * mesh->mNumVertices;
+			if (mesh->HasNormals())
+			{
+				record.flags |= HasNormals;
+				offset = alignUp(offset, DataAlignment);
+				record.normals = offset;
+				offset += sizeof(float) * 3 * mesh->mNumVertices;
+			}
+			if (mesh->HasTextureCoords(0))
+			{
+				record.flags |= HasTexCoords;
+				offset = alignUp(offset, DataAlignment);
+				record.texCoords = offset;
+				offset += sizeof(float) * 2 * mesh->mNumVertices;
+			}
+			offset = alignUp(offset, DataAlignment);
+			record.indices = offset;
+			offset += sizeof(unsigned int) * 3 * mesh->mNumFaces;
+		}
+		header.fileSize = offset;
+
+		auto& blob = scene.blob;
+		blob.assign(offset, 0);
+
+		// Materials
+		auto cursor = sizeof(Header);
+		for (unsigned int m = 0; m < source->mNumMaterials; ++m, cursor += sizeof(MaterialRecord))
+			cookMaterial(source->mMaterials[m], *reinterpret_cast<MaterialRecord *>(&blob[cursor]));
+
+		// Vertex streams and bounding boxes, coarser levels of detail are
+		// appended after everything else once their sizes are known
+		std::vector<std::vector<uint32_t>> lodData(source->mNumMeshes);
+		std::string report = "Optimized meshes of " + modelPath + ":\n";
+		for (unsigned int n = 0; n < source->mNumMeshes; ++n)
+		{
+			const aiMesh* mesh = source->mMeshes[n];
+			auto& record = meshRecords[n];
+
+			record.aabbMin[0] = record.aabbMin[1] = record.aabbMin[2] = 1e10f;
+			record.aabbMax[0] = record.aabbMax[1] = record.aabbMax[2] = -1e10f;
+			auto positions = reinterpret_cast<float *>(&blob[record.positions]);
+			for (unsigned int t = 0; t < mesh->mNumVertices; ++t)
+			{
+				const auto& v = mesh->mVertices[t];
+				const float p[3] = {v.x, v.y, v.z};
+				memcpy(&positions[t * 3], p, sizeof(p));
+				for (auto k = 0; k < 3; ++k)
+				{
+					record.aabbMin[k] = p[k] < record.aabbMin[k] ? p[k] : record.aabbMin[k];
+					record.aabbMax[k] = p[k] > record.aabbMax[k] ? p[k] : record.aabbMax[k];
+				}
+			}
+
+			if (record.normals)
+				memcpy(&blob[record.normals], mesh->mNormals, sizeof(float) * 3 * mesh->mNumVertices);
+
+			if (record.texCoords)
+			{
+				auto texCoords = reinterpret_cast<float *>(&blob[record.texCoords]);
+				for (unsigned int k = 0; k < mesh->mNumVertices; ++k)
+				{
+					texCoords[k * 2] = mesh->mTextureCoords[0][k].x;
+					texCoords[k * 2 + 1] = mesh->mTextureCoords[0][k].y;
+				}
+			}
+
+			// Faces are triangulated by the post-processing preset, anything
+			// else (points, lines) becomes a degenerate triangle
+			auto indices = reinterpret_cast<unsigned int *>(&blob[record.indices]);
+			for (unsigned int t = 0; t < mesh->mNumFaces; ++t)
+			{
+				const aiFace* face = &mesh->mFaces[t];
+				for (unsigned int k = 0; k < 3; ++k)
+					indices[t * 3 + k] = face->mIndices[k < face->mNumIndices ? k : 0];
+			}
+
+			// Triangles for the post-transform cache, then vertices in first use order
+			const auto numIndices = mesh->mNumFaces * 3;
+			const auto acmrBefore = MeshOptimizer::ACMR(indices, numIndices, mesh->mNumVertices);
+			MeshOptimizer::OptimizeVertexCache(indices, numIndices, mesh->mNumVertices);
+			std::vector<uint32_t> remap;
+			MeshOptimizer::OptimizeVertexFetch(indices, numIndices, mesh->mNumVertices, remap);
+			MeshOptimizer::RemapStream(positions, mesh->mNumVertices, 3, remap);
+			if (record.normals)
+				MeshOptimizer::RemapStream(reinterpret_cast<float *>(&blob[record.normals]), mesh->mNumVertices, 3, remap);
+			if (record.texCoords)
+				MeshOptimizer::RemapStream(reinterpret_cast<float *>(&blob[record.texCoords]), mesh->mNumVertices, 2, remap);
+
+			char line[128];
+			snprintf(line, sizeof(line), "    mesh %u: %u triangles, ACMR %.3f -> %.3f",
+			         n, mesh->mNumFaces, acmrBefore, MeshOptimizer::ACMR(indices, numIndices, mesh->mNumVertices));
+			report += line;
+
+			// Each level is clustered from the full mesh rather than the previous
+			// level so errors don't accumulate
+			record.numLods = 1;
+			record.lodFaces[0] = mesh->mNumFaces;
+			record.lodIndices[0] = record.indices;
+			auto extent = 0.0f;
+			for (auto k = 0; k < 3; ++k)
+				extent = std::max(extent, record.aabbMax[k] - record.aabbMin[k]);
+			for (uint32_t lod = 1; lod < MaxMeshLods && extent > 0.0f; ++lod)
+			{
+				const auto cellSize = extent / LodGridSize[lod];
+				std::vector<uint32_t> lodIndices;
+				MeshOptimizer::SimplifyClusters(indices, numIndices, positions, mesh->mNumVertices, record.aabbMin, cellSize, lodIndices);
+				const auto faces = static_cast<uint32_t>(lodIndices.size() / 3);
+				if (faces == 0)
+					break;
+				if (faces > (1.0f - LodMinReduction) * record.lodFaces[record.numLods - 1])
+					continue;
+
+				MeshOptimizer::OptimizeVertexCache(lodIndices.data(), lodIndices.size(), mesh->mNumVertices);
+				record.lodFaces[record.numLods] = faces;
+				// A vertex moves at most a cell diagonal
+				record.lodError[record.numLods] = cellSize * 1.7320508f;
+				lodData[n].insert(lodData[n].end(), lodIndices.begin(), lodIndices.end());
+				++record.numLods;
+
+				snprintf(line, sizeof(line), record.numLods == 2 ? ", LODs %u" : "/%u", faces);
+				report += line;
+			}
+			report += "\n";
+		}
+
+		offset = blob.size();
+		for (unsigned int n = 0; n < source->mNumMeshes; ++n)
+		{
+			auto& record = meshRecords[n];
+			offset = alignUp(offset, DataAlignment);
+			blob.resize(offset + sizeof(uint32_t) * lodData[n].size());
+			if (!lodData[n].empty())
+				memcpy(&blob[offset], lodData[n].data(), sizeof(uint32_t) * lodData[n].size());
+			for (uint32_t lod = 1; lod < record.numLods; ++lod)
+			{
+				record.lodIndices[lod] = offset;
+				offset += sizeof(uint32_t) * 3 * record.lodFaces[lod];
+			}
+		}
+		blob.resize(offset);
+		header.fileSize = offset;
+		PrintReport(report);
+
+		// Scene bounds only cover meshes reachable from the node hierarchy
+		for (auto k = 0; k < 3; ++k)
+		{
+			header.sceneMin[k] = 1e10f;
+			header.sceneMax[k] = -1e10f;
+		}
+		for (const auto& node : nodeRecords)
+		{
+			for (uint32_t i = 0; i < node.numMeshes; ++i)
+			{
+				const auto& record = meshRecords[links[node.firstMesh + i]];
+				for (auto k = 0; k < 3; ++k)
+				{
+					header.sceneMin[k] = record.aabbMin[k] < header.sceneMin[k] ? record.aabbMin[k] : header.sceneMin[k];
+					header.sceneMax[k] = record.aabbMax[k] > header.sceneMax[k] ? record.aabbMax[k] : header.sceneMax[k];
+				}
+			}
+		}
+
+		memcpy(&blob[0], &header, sizeof(header));
+		cursor = sizeof(Header) + sizeof(MaterialRecord) * header.numMaterials;
+		if (!meshRecords.empty())
+			memcpy(&blob[cursor], meshRecords.data(), sizeof(MeshRecord) * meshRecords.size());
+		cursor += sizeof(MeshRecord) * header.numMeshes;
+		if (!nodeRecords.empty())
+			memcpy(&blob[cursor], nodeRecords.data(), sizeof(NodeRecord) * nodeRecords.size());
+		cursor += sizeof(NodeRecord) * header.numNodes;
+		if (!links.empty())
+			memcpy(&blob[cursor], links.data(), sizeof(uint32_t) * links.size());
+
+		attach(scene, blob.data(), blob.size());
+
+		// Write to a temporary file first so a crash never leaves a torn cache behind
+		const auto tempPath = cachePath + ".tmp";
+		{
+			std::ofstream fout(tempPath.c_str(), std::ofstream::binary | std::ofstream::trunc);
+			if (!fout.write(blob.data(), blob.size()))
+			{
+				fprintf(stderr, "Couldn't write model cache %s\n", tempPath.c_str());
+				return false;
+			}
+		}
+		std::remove(cachePath.c_str());
+		if (std::rename(tempPath.c_str(), cachePath.c_str()) != 0)
+		{
+			fprintf(stderr, "Couldn't write model cache %s\n", cachePath.c_str());
+			return false;
+		}
+
+		printf("Cooked model cache %s\n", cachePath.c_str());
+		return true;
+	}
+}
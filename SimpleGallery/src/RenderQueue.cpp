@@ -0,0 +1,148 @@
+#include "RenderQueue.h"
+
+#include <cstring>
+
+#include "GLState.h"
+#include "TextureLoader.h"
+#include "VertexArena.h"
+
+void RenderQueue::Init(const Bindings& bindings, InstanceBuffer* transforms, const ShaderPermutations* shaders)
+{
+	_bindings = bindings;
+	_transforms = transforms;
+	_shaders = shaders;
+}
+
+GLintptr RenderQueue::AddTransform(const glm::mat4& model)
+{
+	return _transforms->Add(&model, 1);
+}
+
+uint64_t RenderQueue::makeKey(unsigned int variant, GLuint material, GLuint texture, GLuint vao) const
+{
+	// Queue order breaks ties, so packets of one node stay together
+	const auto sequence = static_cast<uint64_t>(_packets.size());
+	return (static_cast<uint64_t>(_pass) & 0x3) << 62
+		| (static_cast<uint64_t>(variant) & 0xF) << 58
+		| (static_cast<uint64_t>(material) & 0xFFFF) << 42
+		| (static_cast<uint64_t>(texture) & 0xFFFF) << 26
+		| (static_cast<uint64_t>(vao) & 0x3FF) << 16
+		| (sequence & 0xFFFF);
+}
+
+void RenderQueue::Add(const Mesh& mesh, int lod, GLuint material, GLuint texture, unsigned int variant, GLintptr transform)
+{
+	AddInstanced(mesh, lod, material, texture, variant, FrameTransforms, transform, 1);
+}
+
+void RenderQueue::AddInstanced(const Mesh& mesh, int lod, GLuint material, GLuint texture, unsigned int variant,
+                               GLuint buffer, GLintptr instanceOffset, GLsizei instanceCount)
+{
+	DrawPacket packet;
+	packet.key = makeKey(variant, material, texture, mesh.vao);
+	packet.mesh = &mesh;
+	packet.lod = lod;
+	packet.material = material;
+	packet.texture = texture;
+	packet.variant = variant;
+	packet.instanceBuffer = buffer;
+	packet.instanceOffset = instanceOffset;
+	packet.instanceCount = instanceCount;
+	_packets.push_back(packet);
+}
+
+// LSD radix sort over the key bytes, bytes every key shares are skipped
+void RenderQueue::sort()
+{
+	_order.resize(_packets.size());
+	for (size_t i = 0; i < _packets.size(); ++i)
+	{
+		_order[i].key = _packets[i].key;
+		_order[i].packet = static_cast<uint32_t>(i);
+	}
+	_scratch.resize(_order.size());
+
+	for (auto shift = 0; shift < 64; shift += 8)
+	{
+		size_t counts[256];
+		memset(counts, 0, sizeof(counts));
+		for (const auto& entry : _order)
+		{
+			++counts[(entry.key >> shift) & 0xFF];
+		}
+		if (counts[(_order[0].key >> shift) & 0xFF] == _order.size())
+			continue;
+
+		size_t offset = 0;
+		for (auto& count : counts)
+		{
+			const auto bucket = count;
+			count = offset;
+			offset += bucket;
+		}
+		for (const auto& entry : _order)
+		{
+			_scratch[counts[(entry.key >> shift) & 0xFF]++] = entry;
+		}
+		_order.swap(_scratch);
+	}
+}
+
+void RenderQueue::Submit()
+{
+	if (_packets.empty())
+		return;
+
+	sort();
+	_transforms->Upload();
+
+	// GLState drops the binds that match the previous packet's, sorting is
+	// what makes most of them match
+	auto& state = GLState::Instance();
+	const auto compact = VertexArena::Instance().Format() == VertexFormat::Compact;
+	for (const auto& entry : _order)
+	{
+		const auto& packet = _packets[entry.packet];
+		const auto& mesh = *packet.mesh;
+
+		const auto& program = _shaders->Select(packet.variant);
+		state.UseProgram(program());
+		state.BindBufferRange(_bindings.materialUniLoc, packet.material, 0, sizeof(Material));
+		// Texture arrays have a unit of their own
+		if (packet.variant & ShaderVariant::TextureArray)
+			state.BindTexture(TextureLoader::ArrayUnit, GL_TEXTURE_2D_ARRAY, packet.texture);
+		else
+			state.BindTexture(0, GL_TEXTURE_2D, packet.texture);
+		state.BindVertexArray(mesh.vao);
+		// Compact positions are relative to the mesh's bounding box
+		if (compact)
+		{
+			const auto& uniforms = program.Locations();
+			state.Uniform3f(uniforms.positionScale, mesh.aabbMax[0] - mesh.aabbMin[0], mesh.aabbMax[1] - mesh.aabbMin[1], mesh.aabbMax[2] - mesh.aabbMin[2]);
+			state.Uniform3fv(uniforms.positionBias, mesh.aabbMin);
+		}
+
+		const auto count = mesh.lodFaces[packet.lod] * 3;
+		const auto indices = reinterpret_cast<void *>(mesh.lodOffset[packet.lod]);
+		if (packet.instanceBuffer == FrameTransforms)
+		{
+			state.BindBufferRange(_bindings.instancesUniLoc, _transforms->Buffer(),
+			                      _transforms->RegionOffset() + packet.instanceOffset, InstanceBuffer::BlockSize);
+		}
+		else
+		{
+			state.BindBufferRange(_bindings.instancesUniLoc, packet.instanceBuffer,
+			                      packet.instanceOffset, InstanceBuffer::BlockSize);
+		}
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, count, mesh.indexType, indices, packet.instanceCount, mesh.baseVertex);
+		++_frame.draws;
+	}
+
+	_packets.clear();
+}
+
+void RenderQueue::BeginFrame()
+{
+	_lastFrame = _frame;
+	_frame = {};
+}
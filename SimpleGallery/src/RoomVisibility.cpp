@@ -0,0 +1,192 @@
+#include "RoomVisibility.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Frustum.h"
+
+// The maze model has the doorways, these are kept generous so a room is
+// never hidden while part of it shows through a doorway
+static const GLfloat DoorwayHalfWidth = 2.0f;
+static const GLfloat DoorwayHeight = 6.0f;
+// The camera can fly over the walls, every room is visible from up there
+static const GLfloat WallHeight = 6.0f;
+
+void RoomVisibility::Setup(const GLfloat centers[][2], int numRooms, GLfloat roomSize)
+{
+	_roomSize = roomSize;
+	_rooms.assign(numRooms, Room());
+	_portals.clear();
+	_visible.assign(numRooms, true);
+
+	for (auto i = 0; i < numRooms; ++i)
+	{
+		_rooms[i].center = glm::vec2(centers[i][0], centers[i][1]);
+	}
+
+	// Neighbours share a wall halfway between their centers
+	const auto epsilon = roomSize * 0.01f;
+	for (auto a = 0; a < numRooms; ++a)
+	{
+		for (auto b = a + 1; b < numRooms; ++b)
+		{
+			const auto delta = _rooms[b].center - _rooms[a].center;
+			const auto alongX = std::fabs(std::fabs(delta.x) - roomSize) < epsilon && std::fabs(delta.y) < epsilon;
+			const auto alongZ = std::fabs(std::fabs(delta.y) - roomSize) < epsilon && std::fabs(delta.x) < epsilon;
+			if (!alongX && !alongZ)
+				continue;
+
+			const auto middle = 0.5f * (_rooms[a].center + _rooms[b].center);
+			// Direction along the wall
+			const auto side = alongX ? glm::vec3(0.0f, 0.0f, DoorwayHalfWidth) : glm::vec3(DoorwayHalfWidth, 0.0f, 0.0f);
+			const glm::vec3 bottom(middle.x, 0.0f, middle.y);
+			const glm::vec3 top(middle.x, DoorwayHeight, middle.y);
+
+			Portal portal;
+			portal.rooms[0] = a;
+			portal.rooms[1] = b;
+			portal.corners[0] = bottom - side;
+			portal.corners[1] = bottom + side;
+			portal.corners[2] = top + side;
+			portal.corners[3] = top - side;
+
+			_rooms[a].portals.push_back(static_cast<int>(_portals.size()));
+			_rooms[b].portals.push_back(static_cast<int>(_portals.size()));
+			_portals.push_back(portal);
+		}
+	}
+}
+
+int RoomVisibility::RoomAt(GLfloat x, GLfloat z) const
+{
+	const auto half = _roomSize * 0.5f;
+	for (size_t i = 0; i < _rooms.size(); ++i)
+	{
+		if (std::fabs(x - _rooms[i].center.x) <= half && std::fabs(z - _rooms[i].center.y) <= half)
+			return static_cast<int>(i);
+	}
+	return -1;
+}
+
+void RoomVisibility::Update(const glm::vec3& eye, const glm::mat4& viewProjection)
+{
+	const auto room = RoomAt(eye.x, eye.z);
+	if (room < 0 || eye.y < 0.0f || eye.y > WallHeight)
+	{
+		_visible.assign(_rooms.size(), true);
+		return;
+	}
+
+	_visible.assign(_rooms.size(), false);
+	std::vector<bool> onPath(_rooms.size(), false);
+	flood(room, {-1.0f, -1.0f, 1.0f, 1.0f}, eye, viewProjection, onPath);
+}
+
+// Sutherland-Hodgman against the near plane (z > -w in clip space)
+int RoomVisibility::clipToNearPlane(const Portal& portal, const glm::mat4& viewProjection, glm::vec4 clipped[8])
+{
+	glm::vec4 corners[4];
+	for (auto k = 0; k < 4; ++k)
+	{
+		corners[k] = viewProjection * glm::vec4(portal.corners[k], 1.0f);
+	}
+
+	auto count = 0;
+	for (auto k = 0; k < 4; ++k)
+	{
+		const auto& a = corners[k];
+		const auto& b = corners[(k + 1) % 4];
+		const auto da = a.z + a.w;
+		const auto db = b.z + b.w;
+		if (da >= 0.0f)
+			clipped[count++] = a;
+		if ((da >= 0.0f) != (db >= 0.0f))
+			clipped[count++] = a + (b - a) * (da / (da - db));
+	}
+	return count;
+}
+
+void RoomVisibility::flood(int room, const Rect& rect, const glm::vec3& eye, const glm::mat4& viewProjection, std::vector<bool>& onPath)
+{
+	_visible[room] = true;
+	onPath[room] = true;
+
+	for (auto p : _rooms[room].portals)
+	{
+		const auto& portal = _portals[p];
+		const auto next = portal.rooms[0] == room ? portal.rooms[1] : portal.rooms[0];
+		if (onPath[next])
+			continue;
+
+		// Only look through a doorway from the room's side of it
+		const auto toNext = _rooms[next].center - _rooms[room].center;
+		const auto wall = 0.5f * (_rooms[next].center + _rooms[room].center);
+		if (glm::dot(glm::vec2(eye.x, eye.z) - wall, toNext) >= 0.0f)
+			continue;
+
+		// Screen bounds of the doorway, clipped to the near plane first so a
+		// doorway beside or behind the camera doesn't cover the whole screen
+		glm::vec4 clipped[8];
+		const auto numClipped = clipToNearPlane(portal, viewProjection, clipped);
+		if (numClipped == 0)
+			continue;
+
+		Rect bounds = {1.0f, 1.0f, -1.0f, -1.0f};
+		for (auto k = 0; k < numClipped; ++k)
+		{
+			const auto x = clipped[k].x / clipped[k].w;
+			const auto y = clipped[k].y / clipped[k].w;
+			bounds.minX = std::min(bounds.minX, x);
+			bounds.minY = std::min(bounds.minY, y);
+			bounds.maxX = std::max(bounds.maxX, x);
+			bounds.maxY = std::max(bounds.maxY, y);
+		}
+
+		Rect narrowed;
+		narrowed.minX = std::max(rect.minX, bounds.minX);
+		narrowed.minY = std::max(rect.minY, bounds.minY);
+		narrowed.maxX = std::min(rect.maxX, bounds.maxX);
+		narrowed.maxY = std::min(rect.maxY, bounds.maxY);
+		if (narrowed.minX >= narrowed.maxX || narrowed.minY >= narrowed.maxY)
+			continue;
+
+		flood(next, narrowed, eye, viewProjection, onPath);
+	}
+
+	onPath[room] = false;
+}
+
+bool RoomVisibility::Visible(int room) const
+{
+	return room < 0 || _visible[room];
+}
+
+bool RoomVisibility::Visible(GLfloat x, GLfloat z) const
+{
+	return Visible(RoomAt(x, z));
+}
+
+bool RoomVisibility::Intersects(const glm::mat4& model, const float aabbMin[3], const float aabbMax[3]) const
+{
+	// World space x, z extent of the transformed box
+	glm::vec3 worldMin, worldMax;
+	TransformAabb(model, aabbMin, aabbMax, worldMin, worldMax);
+
+	const auto room = RoomAt(0.5f * (worldMin.x + worldMax.x), 0.5f * (worldMin.z + worldMax.z));
+	if (room < 0)
+		return true;
+
+	// Boxes reaching into another room stay, they may show through it
+	const auto half = _roomSize * 0.5f;
+	const auto& c = _rooms[room].center;
+	if (worldMin.x < c.x - half || worldMax.x > c.x + half ||
+		worldMin.z < c.y - half || worldMax.z > c.y + half)
+		return true;
+
+	return _visible[room];
+}
+
+int RoomVisibility::NumVisible() const
+{
+	return static_cast<int>(std::count(_visible.begin(), _visible.end(), true));
+}
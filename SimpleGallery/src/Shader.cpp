@@ -3,20 +3,25 @@
 #include <fstream>
 #include <sstream>
 
+#include "GLState.h"
+#include "Trace.h"
+
 Shader::Shader(const char* path)
 {
 	Setup(path);
 }
 
-void Shader::Setup(const char* path)
+void Shader::Setup(const char* path, const std::string& defines)
 {
 	auto vertexPath = path + _vertexShaderExt;
 	auto fragmentPath = path + _fragmentShaderExt;
-	Setup(vertexPath.c_str(), fragmentPath.c_str());
+	Setup(vertexPath.c_str(), fragmentPath.c_str(), nullptr, defines);
 }
 
-void Shader::Setup(const char* vertexPath, const char* fragmentPath, const char* geometryPath)
+void Shader::Setup(const char* vertexPath, const char* fragmentPath, const char* geometryPath, const std::string& defines)
 {
+	TraceZone zone("Shader::Setup", vertexPath);
+
 	// 1. Retrieve the vertex/fragment source code from filePath
 	std::string vertexCode;
 	std::string fragmentCode;
@@ -57,6 +62,9 @@ void Shader::Setup(const char* vertexPath, const char* fragmentPath, const char*
 	{
 		std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
 	}
+	insertDefines(vertexCode, defines);
+	insertDefines(fragmentCode, defines);
+	insertDefines(geometryCode, defines);
 	auto vShaderCode = vertexCode.c_str();
 	auto fShaderCode = fragmentCode.c_str();
 	// 2. Compile shaders
@@ -89,6 +97,7 @@ void Shader::Setup(const char* vertexPath, const char* fragmentPath, const char*
 	glAttachShader(this->_program, geometry);
 	glLinkProgram(this->_program);
 	checkCompileErrors(this->_program, "PROGRAM");
+	resolveUniforms();
 	// Delete the shaders as they're linked into our program now and no longer necessery
 	glDeleteShader(vertex);
 	glDeleteShader(fragment);
@@ -98,7 +107,7 @@ void Shader::Setup(const char* vertexPath, const char* fragmentPath, const char*
 
 void Shader::Use() const
 {
-	glUseProgram(_program);
+	GLState::Instance().UseProgram(_program);
 }
 
 const GLuint& Shader::operator()() const
@@ -106,6 +115,27 @@ const GLuint& Shader::operator()() const
 	return _program;
 }
 
+void Shader::resolveUniforms()
+{
+	_uniforms.texUnit = glGetUniformLocation(_program, "texUnit");
+	_uniforms.texArrayUnit = glGetUniformLocation(_program, "texArrayUnit");
+	_uniforms.compactVertices = glGetUniformLocation(_program, "compactVertices");
+	_uniforms.positionScale = glGetUniformLocation(_program, "positionScale");
+	_uniforms.positionBias = glGetUniformLocation(_program, "positionBias");
+}
+
+void Shader::insertDefines(std::string& code, const std::string& defines)
+{
+	if (defines.empty() || code.empty())
+		return;
+
+	// #version has to stay first, #line keeps error messages pointing at
+	// the lines of the file
+	const auto end = code.find('\n');
+	const auto at = end == std::string::npos ? code.size() : end + 1;
+	code.insert(at, (end == std::string::npos ? "\n" : "") + defines + "#line 2\n");
+}
+
 void Shader::checkCompileErrors(const GLuint& shader, const std::string& type)
 {
 	GLint success;
@@ -0,0 +1,71 @@
+#include "ShaderPermutations.h"
+
+#include "Trace.h"
+
+const int ShaderPermutations::PointLightBuckets[NumPointLightBuckets] = {2, 5, 10};
+
+std::string ShaderPermutations::defines(Sampling sampling, int pointLights, int dirLights, int spotLights)
+{
+	std::string code;
+	if (sampling == Texture2D)
+		code += "#define TEXTURE_2D\n";
+	else if (sampling == TextureArray)
+		code += "#define TEXTURE_ARRAY\n";
+
+	if (pointLights >= 0)
+	{
+		code += "#define LIGHTING\n";
+		code += "#define DIR_LIGHTS " + std::to_string(dirLights) + "\n";
+		code += "#define SPOT_LIGHTS " + std::to_string(spotLights) + "\n";
+		code += "#define POINT_LIGHTS " + std::to_string(pointLights) + "\n";
+	}
+	return code;
+}
+
+void ShaderPermutations::Setup(const char* path, int dirLights, int spotLights)
+{
+	TraceZone zone("ShaderPermutations::Setup", path);
+
+	// The unlit programs come first, then NumSamplings per point light bucket
+	for (auto s = 0; s < NumSamplings; ++s)
+	{
+		const auto sampling = static_cast<Sampling>(s);
+		_programs[s].Setup(path, defines(sampling, -1, dirLights, spotLights));
+		for (auto b = 0; b < NumPointLightBuckets; ++b)
+		{
+			_programs[NumSamplings * (1 + b) + s].Setup(path, defines(sampling, PointLightBuckets[b], dirLights, spotLights));
+		}
+	}
+}
+
+void ShaderPermutations::SetMode(bool lighting, bool textured)
+{
+	_lighting = lighting;
+	_textured = textured;
+}
+
+int ShaderPermutations::SetPointLights(int count)
+{
+	_bucket = 0;
+	while (_bucket < NumPointLightBuckets - 1 && PointLightBuckets[_bucket] < count)
+	{
+		++_bucket;
+	}
+	return PointLightBuckets[_bucket];
+}
+
+const Shader& ShaderPermutations::Select(unsigned int variant) const
+{
+	// A forced texture is a 2D texture like the material's own
+	auto sampling = MaterialColor;
+	if (_textured)
+	{
+		if (variant & ShaderVariant::ForceTextured)
+			sampling = Texture2D;
+		else if (variant & ShaderVariant::TextureArray)
+			sampling = TextureArray;
+		else if (variant & ShaderVariant::Textured)
+			sampling = Texture2D;
+	}
+	return _programs[_lighting ? NumSamplings * (1 + _bucket) + sampling : sampling];
+}
@@ -0,0 +1,446 @@
+#include "TextureCook.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "ModelCache.h"
+
+namespace TextureCook
+{
+	struct FileHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		ModelCache::SourceStamp source;
+		uint32_t format;
+		uint32_t width;
+		uint32_t height;
+		uint32_t numLevels;
+		uint64_t dataSize;
+	};
+
+	struct LevelRecord
+	{
+		uint32_t width;
+		uint32_t height;
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	// 2x2 box filter, odd edges reuse the last row/column
+	static void downsample(const unsigned char* src, int width, int height, unsigned char* dst, int dstWidth, int dstHeight)
+	{
+		for (auto y = 0; y < dstHeight; ++y)
+		{
+			const auto y0 = y * 2 < height ? y * 2 : height - 1;
+			const auto y1 = y * 2 + 1 < height ? y * 2 + 1 : height - 1;
+			for (auto x = 0; x < dstWidth; ++x)
+			{
+				const auto x0 = x * 2 < width ? x * 2 : width - 1;
+				const auto x1 = x * 2 + 1 < width ? x * 2 + 1 : width - 1;
+				for (auto c = 0; c < 4; ++c)
+				{
+					const auto sum = src[(y0 * width + x0) * 4 + c] + src[(y0 * width + x1) * 4 + c]
+						+ src[(y1 * width + x0) * 4 + c] + src[(y1 * width + x1) * 4 + c];
+					dst[(y * dstWidth + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+	}
+
+	static uint16_t packRgb565(const int c[3])
+	{
+		return static_cast<uint16_t>(((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3));
+	}
+
+	static void unpackRgb565(uint16_t packed, int c[3])
+	{
+		const auto r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+		c[0] = (r << 3) | (r >> 2);
+		c[1] = (g << 2) | (g >> 4);
+		c[2] = (b << 3) | (b >> 2);
+	}
+
+	// DXT1 colour block from the bounding box of the block's colours, inset
+	// slightly so the endpoints aren't dragged by outliers
+	static void encodeColorBlock(const unsigned char block[64], unsigned char* out)
+	{
+		int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+		for (auto i = 0; i < 16; ++i)
+		{
+			for (auto c = 0; c < 3; ++c)
+			{
+				const int v = block[i * 4 + c];
+				lo[c] = v < lo[c] ? v : lo[c];
+				hi[c] = v > hi[c] ? v : hi[c];
+			}
+		}
+		for (auto c = 0; c < 3; ++c)
+		{
+			const auto inset = (hi[c] - lo[c]) >> 4;
+			lo[c] += inset;
+			hi[c] -= inset;
+		}
+
+		auto c0 = packRgb565(hi), c1 = packRgb565(lo);
+		uint32_t indices = 0;
+		if (c0 < c1)
+		{
+			const auto t = c0;
+			c0 = c1;
+			c1 = t;
+		}
+
+		if (c0 != c1)
+		{
+			int palette[4][3];
+			unpackRgb565(c0, palette[0]);
+			unpackRgb565(c1, palette[1]);
+			for (auto c = 0; c < 3; ++c)
+			{
+				palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+				palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+			}
+
+			for (auto i = 0; i < 16; ++i)
+			{
+				auto best = 0, bestError = 1 << 30;
+				for (auto p = 0; p < 4; ++p)
+				{
+					auto error = 0;
+					for (auto c = 0; c < 3; ++c)
+					{
+						const auto d = block[i * 4 + c] - palette[p][c];
+						error += d * d;
+					}
+					if (error < bestError)
+					{
+						bestError = error;
+						best = p;
+					}
+				}
+				indices |= static_cast<uint32_t>(best) << (i * 2);
+			}
+		}
+
+		out[0] = c0 & 0xff;
+		out[1] = c0 >> 8;
+		out[2] = c1 & 0xff;
+		out[3] = c1 >> 8;
+		memcpy(out + 4, &indices, 4);
+	}
+
+	// DXT5 alpha block, 8 interpolated values between the block's min and max
+	static void encodeAlphaBlock(const unsigned char block[64], unsigned char* out)
+	{
+		int a0 = 0, a1 = 255;
+		for (auto i = 0; i < 16; ++i)
+		{
+			const int a = block[i * 4 + 3];
+			a0 = a > a0 ? a : a0;
+			a1 = a < a1 ? a : a1;
+		}
+
+		uint64_t indices = 0;
+		if (a0 != a1)
+		{
+			int palette[8] = {a0, a1};
+			for (auto p = 1; p < 7; ++p)
+				palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+
+			for (auto i = 0; i < 16; ++i)
+			{
+				auto best = 0, bestError = 1 << 30;
+				for (auto p = 0; p < 8; ++p)
+				{
+					const auto d = block[i * 4 + 3] - palette[p];
+					if (d * d < bestError)
+					{
+						bestError = d * d;
+						best = p;
+					}
+				}
+				indices |= static_cast<uint64_t>(best) << (i * 3);
+			}
+		}
+
+		out[0] = static_cast<unsigned char>(a0);
+		out[1] = static_cast<unsigned char>(a1);
+		for (auto b = 0; b < 6; ++b)
+			out[2 + b] = static_cast<unsigned char>(indices >> (b * 8));
+	}
+
+	static size_t compressedSize(int width, int height, GLenum format)
+	{
+		const size_t blockBytes = format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? 16 : 8;
+		return ((width + 3) / 4) * ((height + 3) / 4) * blockBytes;
+	}
+
+	static void compressLevel(const unsigned char* rgba, int width, int height, GLenum format, unsigned char* out)
+	{
+		unsigned char block[64];
+		for (auto by = 0; by < height; by += 4)
+		{
+			for (auto bx = 0; bx < width; bx += 4)
+			{
+				// Blocks hanging over the edge repeat the last texel
+				for (auto y = 0; y < 4; ++y)
+				{
+					const auto sy = by + y < height ? by + y : height - 1;
+					for (auto x = 0; x < 4; ++x)
+					{
+						const auto sx = bx + x < width ? bx + x : width - 1;
+						memcpy(&block[(y * 4 + x) * 4], &rgba[(sy * width + sx) * 4], 4);
+					}
+				}
+
+				if (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+				{
+					encodeAlphaBlock(block, out);
+					out += 8;
+				}
+				encodeColorBlock(block, out);
+				out += 8;
+			}
+		}
+	}
+
+	void Cook(const unsigned char* rgba, int width, int height, bool compress, CookedImage& image)
+	{
+		auto opaque = true;
+		for (auto i = 0; i < width * height && opaque; ++i)
+			opaque = rgba[i * 4 + 3] == 255;
+
+		image.format = !compress ? GL_RGBA : opaque ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		image.width = width;
+		image.height = height;
+		image.levels.clear();
+		image.data.clear();
+
+		std::vector<unsigned char> current(rgba, rgba + width * height * 4), next;
+		auto w = width, h = height;
+		for (;;)
+		{
+			Level level;
+			level.width = w;
+			level.height = h;
+			level.offset = image.data.size();
+			level.size = image.Compressed() ? compressedSize(w, h, image.format) : current.size();
+			image.data.resize(level.offset + level.size);
+			if (image.Compressed())
+				compressLevel(current.data(), w, h, image.format, &image.data[level.offset]);
+			else
+				memcpy(&image.data[level.offset], current.data(), level.size);
+			image.levels.push_back(level);
+
+			if (w == 1 && h == 1)
+				break;
+
+			const auto nw = w > 1 ? w / 2 : 1, nh = h > 1 ? h / 2 : 1;
+			next.resize(nw * nh * 4);
+			downsample(current.data(), w, h, next.data(), nw, nh);
+			current.swap(next);
+			w = nw;
+			h = nh;
+		}
+		image.firstLevel = 0;
+		image.numLevels = static_cast<int>(image.levels.size());
+	}
+
+	static bool readHeader(std::ifstream& fin, FileHeader& header, std::vector<LevelRecord>& records)
+	{
+		if (!fin.read(reinterpret_cast<char *>(&header), sizeof(header)))
+			return false;
+		if (header.magic != Magic || header.version != Version)
+			return false;
+
+		records.resize(header.numLevels);
+		return records.empty() || fin.read(reinterpret_cast<char *>(records.data()), sizeof(LevelRecord) * records.size());
+	}
+
+	// Reads the contiguous data of levels [first, last], offsets are rebased to the slice
+	static bool readLevels(std::ifstream& fin, const FileHeader& header, const std::vector<LevelRecord>& records, int first, int last, CookedImage& image)
+	{
+		if (first < 0 || last >= static_cast<int>(records.size()) || first > last)
+			return false;
+
+		const auto dataStart = sizeof(FileHeader) + sizeof(LevelRecord) * records.size();
+		const auto begin = records[first].offset;
+		const auto end = records[last].offset + records[last].size;
+
+		image.format = header.format;
+		image.width = header.width;
+		image.height = header.height;
+		image.firstLevel = first;
+		image.numLevels = static_cast<int>(records.size());
+		image.levels.resize(last - first + 1);
+		for (auto i = first; i <= last; ++i)
+		{
+			auto& level = image.levels[i - first];
+			level.width = records[i].width;
+			level.height = records[i].height;
+			level.offset = static_cast<size_t>(records[i].offset - begin);
+			level.size = static_cast<size_t>(records[i].size);
+		}
+
+		image.data.resize(static_cast<size_t>(end - begin));
+		fin.seekg(static_cast<std::streamoff>(dataStart + begin), std::ifstream::beg);
+		return !!fin.read(reinterpret_cast<char *>(image.data.data()), image.data.size());
+	}
+
+	bool Load(const std::string& cachePath, const std::string& sourcePath, bool compress, CookedImage& image, int maxSize)
+	{
+		std::ifstream fin(cachePath.c_str(), std::ifstream::binary);
+		FileHeader header;
+		std::vector<LevelRecord> records;
+		if (!readHeader(fin, header, records) || records.empty())
+			return false;
+		// Cooked for a driver with different S3TC support
+		if ((header.format != GL_RGBA) != compress)
+			return false;
+
+		auto restamped = false;
+		if (!ModelCache::IsFresh(sourcePath, header.source, restamped))
+			return false;
+
+		const auto last = static_cast<int>(records.size()) - 1;
+		const auto first = maxSize > 0 ? TailLevel(header.width, header.height, maxSize) : 0;
+		if (!readLevels(fin, header, records, first < last ? first : last, last, image))
+			return false;
+		fin.close();
+
+		// Source was touched but not changed, save rehashing it next launch
+		if (restamped)
+		{
+			std::fstream fout(cachePath.c_str(), std::fstream::in | std::fstream::out | std::fstream::binary);
+			fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		}
+		return true;
+	}
+
+	bool LoadInfo(const std::string& cachePath, const std::string& sourcePath, bool compress, CookedImage& image)
+	{
+		std::ifstream fin(cachePath.c_str(), std::ifstream::binary);
+		FileHeader header;
+		std::vector<LevelRecord> records;
+		if (!readHeader(fin, header, records) || records.empty())
+			return false;
+		if ((header.format != GL_RGBA) != compress)
+			return false;
+
+		auto restamped = false;
+		if (!ModelCache::IsFresh(sourcePath, header.source, restamped))
+			return false;
+
+		image.format = header.format;
+		image.width = header.width;
+		image.height = header.height;
+		image.firstLevel = 0;
+		image.numLevels = static_cast<int>(records.size());
+		image.levels.clear();
+		image.data.clear();
+		return true;
+	}
+
+	bool RecordedHash(const std::string& cachePath, const std::string& sourcePath, uint64_t& hash)
+	{
+		std::ifstream fin(cachePath.c_str(), std::ifstream::binary);
+		FileHeader header;
+		std::vector<LevelRecord> records;
+		if (!readHeader(fin, header, records))
+			return false;
+
+		ModelCache::SourceStamp current;
+		if (!ModelCache::StampFile(sourcePath, false, current) || current.mtime != header.source.mtime || current.size != header.source.size)
+			return false;
+		hash = header.source.hash;
+		return true;
+	}
+
+	bool LoadLevels(const std::string& cachePath, int first, int last, CookedImage& image)
+	{
+		std::ifstream fin(cachePath.c_str(), std::ifstream::binary);
+		FileHeader header;
+		std::vector<LevelRecord> records;
+		return readHeader(fin, header, records) && readLevels(fin, header, records, first, last, image);
+	}
+
+	bool Save(const std::string& cachePath, const std::string& sourcePath, const CookedImage& image)
+	{
+		FileHeader header;
+		memset(&header, 0, sizeof(header));
+		header.magic = Magic;
+		header.version = Version;
+		header.source = ModelCache::StampFile(sourcePath, true);
+		header.format = image.format;
+		header.width = image.width;
+		header.height = image.height;
+		header.numLevels = static_cast<uint32_t>(image.levels.size());
+		header.dataSize = image.data.size();
+
+		std::vector<LevelRecord> records(image.levels.size());
+		for (size_t i = 0; i < records.size(); ++i)
+		{
+			records[i].width = image.levels[i].width;
+			records[i].height = image.levels[i].height;
+			records[i].offset = image.levels[i].offset;
+			records[i].size = image.levels[i].size;
+		}
+
+		const auto tempPath = cachePath + ".tmp";
+		{
+			std::ofstream fout(tempPath.c_str(), std::ofstream::binary | std::ofstream::trunc);
+			fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			if (!records.empty())
+				fout.write(reinterpret_cast<const char *>(records.data()), sizeof(LevelRecord) * records.size());
+			fout.write(reinterpret_cast<const char *>(image.data.data()), image.data.size());
+			if (!fout)
+			{
+				fprintf(stderr, "Couldn't write cooked texture %s\n", tempPath.c_str());
+				return false;
+			}
+		}
+		std::remove(cachePath.c_str());
+		if (std::rename(tempPath.c_str(), cachePath.c_str()) != 0)
+		{
+			fprintf(stderr, "Couldn't write cooked texture %s\n", cachePath.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	size_t LevelSize(int width, int height, GLenum format)
+	{
+		return format != GL_RGBA ? compressedSize(width, height, format) : static_cast<size_t>(width) * height * 4;
+	}
+
+	int TailLevel(int width, int height, int maxSize)
+	{
+		auto level = 0;
+		while (width > maxSize || height > maxSize)
+		{
+			width = width > 1 ? width / 2 : 1;
+			height = height > 1 ? height / 2 : 1;
+			++level;
+		}
+		return level;
+	}
+
+	void KeepLevels(CookedImage& image, int first, int last)
+	{
+		const auto begin = first - image.firstLevel, end = last - image.firstLevel + 1;
+		if (begin <= 0 && end >= static_cast<int>(image.levels.size()))
+			return;
+
+		const auto offset = image.levels[begin].offset;
+		const auto size = image.levels[end - 1].offset + image.levels[end - 1].size - offset;
+		image.data.erase(image.data.begin() + offset + size, image.data.end());
+		image.data.erase(image.data.begin(), image.data.begin() + offset);
+		image.levels.erase(image.levels.begin() + end, image.levels.end());
+		image.levels.erase(image.levels.begin(), image.levels.begin() + begin);
+		for (auto& level : image.levels)
+			level.offset -= offset;
+		image.firstLevel = first;
+	}
+}
@@ -0,0 +1,608 @@
+#include "TextureLoader.h"
+
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+#include <IL/il.h>
+
+#include "GLState.h"
+#include "Trace.h"
+
+std::mutex TextureLoader::_decodeMutex;
+
+TextureLoader& TextureLoader::Instance()
+{
+	static TextureLoader loader;
+	return loader;
+}
+
+void TextureLoader::Init()
+{
+	for (auto& slot : _slots)
+	{
+		glGenBuffers(1, &slot.pbo);
+		slot.capacity = 0;
+		slot.fence = nullptr;
+	}
+	_nextSlot = 0;
+
+	// Without S3TC textures are still cooked, just with uncompressed mips
+	_compress = GLEW_EXT_texture_compression_s3tc == GL_TRUE;
+	std::cout << "Texture compression " << (_compress ? "S3TC" : "unavailable, using RGBA8") << std::endl;
+}
+
+void TextureLoader::Shutdown()
+{
+	// Decodes still queued on the pool bail out early
+	_cancelled = true;
+
+	for (auto& slot : _slots)
+	{
+		if (slot.fence)
+			glDeleteSync(slot.fence);
+		GLState::Instance().DeleteBuffers(1, &slot.pbo);
+		slot = UploadSlot();
+	}
+	_ready.clear();
+	_streams.clear();
+	_inFlight.clear();
+}
+
+GLuint TextureLoader::Request(const std::string& filename, bool cook)
+{
+	return request(filename, false, cook);
+}
+
+GLuint TextureLoader::RequestStreamed(const std::string& filename)
+{
+	return request(filename, true, true);
+}
+
+void TextureLoader::Discard(const GLuint& texture)
+{
+	auto itr = _inFlight.find(texture);
+	if (itr != _inFlight.end())
+		itr->second = true;
+	else
+		GLState::Instance().DeleteTextures(1, &texture);
+}
+
+void TextureLoader::SetStreamLevel(const GLuint& texture, int level)
+{
+	auto itr = _streams.find(texture);
+	if (itr != _streams.end())
+		itr->second.wantedLevel = level > 0 ? level : 0;
+}
+
+GLuint TextureLoader::request(const std::string& filename, bool streamed, bool cook)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	setPlaceholder(texture);
+	++_pending;
+
+	if (streamed)
+	{
+		StreamState stream;
+		stream.filename = filename;
+		stream.format = GL_RGBA;
+		stream.residentLevel = -1;
+		stream.tailLevel = -1;
+		stream.finestLevel = 0;
+		stream.wantedLevel = INT_MAX;
+		stream.loading = true;
+		_streams[texture] = stream;
+	}
+	else
+	{
+		_inFlight[texture] = false;
+	}
+
+	queueDecode(texture, filename, -1, streamed, cook);
+	return texture;
+}
+
+bool TextureLoader::Probe(const std::string& filename, int& width, int& height, GLenum& format) const
+{
+	TextureCook::CookedImage info;
+	if (!TextureCook::LoadInfo(filename + ".sgtx", filename, _compress, info))
+		return false;
+	width = info.width;
+	height = info.height;
+	format = info.format;
+	return true;
+}
+
+GLuint TextureLoader::RequestArray(const std::vector<std::string>& filenames, int width, int height, GLenum format, bool streamed)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+
+	ArrayState array;
+	array.filenames = filenames;
+	array.width = width;
+	array.height = height;
+	array.format = format;
+	array.pendingLayers = static_cast<int>(filenames.size());
+	array.failed = false;
+
+	// Streamed arrays start with the mip tail, like streamed textures.
+	// Layers still decoding read whatever the driver cleared the storage to.
+	const auto last = TextureCook::TailLevel(width, height, 1);
+	const auto tail = TextureCook::TailLevel(width, height, StreamTailSize);
+	array.loadingLevel = streamed ? (tail < last ? tail : last) : 0;
+	allocateArrayLevels(texture, array, array.loadingLevel, last);
+
+	GLState::Instance().BindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, array.loadingLevel);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, last);
+	GLState::Instance().BindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	_arrays[texture] = array;
+	_pending += static_cast<int>(filenames.size());
+
+	if (streamed)
+	{
+		StreamState stream;
+		stream.filename = filenames.front();
+		stream.format = format;
+		stream.residentLevel = -1;
+		stream.tailLevel = -1;
+		stream.finestLevel = 0;
+		stream.wantedLevel = INT_MAX;
+		stream.loading = true;
+		_streams[texture] = stream;
+	}
+
+	for (size_t k = 0; k < filenames.size(); ++k)
+	{
+		queueDecode(texture, filenames[k], static_cast<int>(k), streamed, true);
+	}
+	return texture;
+}
+
+void TextureLoader::queueDecode(const GLuint& texture, const std::string& filename, int layer, bool streamed, bool cook)
+{
+	ThreadPool::Instance().Submit([this, texture, filename, layer, streamed, cook]
+	{
+		DecodedImage image;
+		image.texture = texture;
+		image.filename = filename;
+		image.refinement = false;
+		image.layer = layer;
+		image.cook = cook;
+		if (streamed)
+			decodeTail(image);
+		else
+			decode(image);
+		_decoded.Push(std::move(image));
+	});
+}
+
+void TextureLoader::queueRefinement(const GLuint& texture, const std::string& filename, int layer, int level)
+{
+	ThreadPool::Instance().Submit([this, texture, filename, layer, level]
+	{
+		DecodedImage image;
+		image.texture = texture;
+		image.filename = filename;
+		image.refinement = true;
+		image.layer = layer;
+		image.cook = true;
+		image.cooked.firstLevel = level;
+		decodeRefinement(image);
+		_decoded.Push(std::move(image));
+	});
+}
+
+void TextureLoader::Pump(double budgetMs)
+{
+	DecodedImage image;
+	while (_decoded.TryPop(image))
+	{
+		_ready.push_back(std::move(image));
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	while (!_ready.empty())
+	{
+		const auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if (elapsed > budgetMs)
+			break;
+
+		auto& next = _ready.front();
+		auto inFlight = next.layer < 0 ? _inFlight.find(next.texture) : _inFlight.end();
+		if (inFlight != _inFlight.end() && inFlight->second)
+		{
+			// Nothing samples it anymore, free the name now it can't be written
+			GLState::Instance().DeleteTextures(1, &next.texture);
+			_inFlight.erase(inFlight);
+			--_pending;
+			_ready.pop_front();
+			continue;
+		}
+
+		auto stream = _streams.find(next.texture);
+		auto array = next.layer >= 0 ? _arrays.find(next.texture) : _arrays.end();
+		if (next.success && array != _arrays.end())
+		{
+			const auto& cooked = next.cooked;
+			if (cooked.format != array->second.format || cooked.width != array->second.width || cooked.height != array->second.height)
+			{
+				std::cerr << "Texture " << next.filename << " no longer matches its texture array" << std::endl;
+				next.success = false;
+			}
+		}
+
+		if (next.success)
+		{
+			// All unpack buffers are still being read by the GPU, retry next frame
+			if (!upload(next))
+				break;
+			if (array == _arrays.end() && stream != _streams.end())
+			{
+				stream->second.format = next.cooked.format;
+				stream->second.residentLevel = next.cooked.firstLevel;
+				if (!next.refinement)
+					stream->second.tailLevel = next.cooked.firstLevel;
+			}
+			if (!next.refinement)
+				std::cout << "Loaded texture " << next.filename << std::endl;
+		}
+		else if (next.refinement)
+		{
+			// Keep what is resident rather than retrying every frame
+			if (array != _arrays.end())
+				array->second.failed = true;
+			else if (stream != _streams.end())
+				stream->second.finestLevel = stream->second.residentLevel;
+		}
+		else
+		{
+			printf("Couldn't load Image: %s\n", next.filename.c_str());
+		}
+
+		if (array != _arrays.end())
+		{
+			if (--array->second.pendingLayers == 0)
+				finishArrayLevel(next.texture, array->second, next.refinement);
+		}
+		else if (stream != _streams.end())
+		{
+			stream->second.loading = false;
+		}
+		if (inFlight != _inFlight.end())
+			_inFlight.erase(inFlight);
+		if (!next.refinement)
+			--_pending;
+		_ready.pop_front();
+	}
+
+	updateStreams();
+}
+
+void TextureLoader::updateStreams()
+{
+	for (auto& pair : _streams)
+	{
+		auto& stream = pair.second;
+		if (stream.loading || stream.tailLevel < 0)
+			continue;
+
+		// The tail always stays resident
+		auto wanted = stream.wantedLevel < stream.finestLevel ? stream.finestLevel : stream.wantedLevel;
+		wanted = wanted < stream.tailLevel ? wanted : stream.tailLevel;
+		if (wanted > stream.residentLevel)
+		{
+			evict(pair.first, stream, wanted);
+		}
+		else if (wanted < stream.residentLevel)
+		{
+			// Next finer level only, the tail gets sharper one step at a time
+			stream.loading = true;
+			const auto level = stream.residentLevel - 1;
+			auto array = _arrays.find(pair.first);
+			if (array == _arrays.end())
+			{
+				queueRefinement(pair.first, stream.filename, -1, level);
+				continue;
+			}
+
+			// Every layer gets the level before it's sampled
+			auto& layers = array->second;
+			allocateArrayLevels(pair.first, layers, level, level);
+			layers.loadingLevel = level;
+			layers.pendingLayers = static_cast<int>(layers.filenames.size());
+			layers.failed = false;
+			for (size_t k = 0; k < layers.filenames.size(); ++k)
+			{
+				queueRefinement(pair.first, layers.filenames[k], static_cast<int>(k), level);
+			}
+		}
+	}
+}
+
+void TextureLoader::evict(const GLuint& texture, StreamState& stream, int level) const
+{
+	const auto target = IsArray(texture) ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+	GLState::Instance().BindTexture(target, texture);
+	glTexParameteri(target, GL_TEXTURE_BASE_LEVEL, level);
+
+	// Respecifying as 0x0 gives the storage of the finer levels back
+	for (auto i = stream.residentLevel; i < level; ++i)
+	{
+		if (target == GL_TEXTURE_2D_ARRAY && stream.format != GL_RGBA)
+			glCompressedTexImage3D(target, i, stream.format, 0, 0, 0, 0, 0, nullptr);
+		else if (target == GL_TEXTURE_2D_ARRAY)
+			glTexImage3D(target, i, GL_RGBA, 0, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		else if (stream.format != GL_RGBA)
+			glCompressedTexImage2D(target, i, stream.format, 0, 0, 0, 0, nullptr);
+		else
+			glTexImage2D(target, i, GL_RGBA, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	}
+	GLState::Instance().BindTexture(target, 0);
+	stream.residentLevel = level;
+}
+
+void TextureLoader::decode(DecodedImage& image) const
+{
+	TraceZone zone("TextureLoader::decode", image.filename);
+	image.success = false;
+	if (_cancelled)
+		return;
+
+	if (!image.cook)
+	{
+		image.success = decodeSource(image);
+		return;
+	}
+
+	const auto cachePath = image.filename + ".sgtx";
+	if (TextureCook::Load(cachePath, image.filename, _compress, image.cooked))
+	{
+		image.success = true;
+		return;
+	}
+
+	if (!decodeSource(image))
+		return;
+
+	if (TextureCook::Save(cachePath, image.filename, image.cooked))
+		printf("Cooked texture %s\n", cachePath.c_str());
+}
+
+void TextureLoader::decodeTail(DecodedImage& image) const
+{
+	TraceZone zone("TextureLoader::decodeTail", image.filename);
+	image.success = false;
+	if (_cancelled)
+		return;
+
+	const auto cachePath = image.filename + ".sgtx";
+	if (TextureCook::Load(cachePath, image.filename, _compress, image.cooked, StreamTailSize))
+	{
+		image.success = true;
+		return;
+	}
+
+	// First launch, the whole chain is cooked and saved but only the tail kept
+	if (!decodeSource(image))
+		return;
+	TextureCook::Save(cachePath, image.filename, image.cooked);
+
+	const auto& cooked = image.cooked;
+	const auto tail = TextureCook::TailLevel(cooked.width, cooked.height, StreamTailSize);
+	TextureCook::KeepLevels(image.cooked, tail < cooked.numLevels ? tail : cooked.numLevels - 1, cooked.numLevels - 1);
+}
+
+void TextureLoader::decodeRefinement(DecodedImage& image) const
+{
+	image.success = false;
+	if (_cancelled)
+		return;
+
+	const auto level = image.cooked.firstLevel;
+	if (TextureCook::LoadLevels(image.filename + ".sgtx", level, level, image.cooked))
+	{
+		image.success = true;
+		return;
+	}
+
+	// Cooked file couldn't be written, cook again and keep the one level
+	if (decodeSource(image) && level < image.cooked.numLevels)
+		TextureCook::KeepLevels(image.cooked, level, level);
+	else
+		image.success = false;
+}
+
+bool TextureLoader::decodeSource(DecodedImage& image) const
+{
+	std::vector<unsigned char> pixels;
+	int width = 0, height = 0;
+	{
+		std::lock_guard<std::mutex> lock(_decodeMutex);
+		TraceZone zone("ilLoadImage", image.filename);
+
+		auto imageId = ilGenImage();
+		ilBindImage(imageId); /* Binding of DevIL image name */
+		ilEnable(IL_ORIGIN_SET);
+		ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
+
+		if (ilLoadImage(image.filename.c_str()))
+		{
+			/* Convert image to RGBA */
+			ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
+
+			width = ilGetInteger(IL_IMAGE_WIDTH);
+			height = ilGetInteger(IL_IMAGE_HEIGHT);
+			const auto data = ilGetData();
+			pixels.assign(data, data + width * height * 4);
+		}
+
+		/* Pixels are copied out, release memory used by image. */
+		ilBindImage(0);
+		ilDeleteImage(imageId);
+	}
+
+	if (pixels.empty())
+		return false;
+
+	// Mips and compression run outside the lock, other workers can decode meanwhile
+	TraceZone zone("TextureCook::Cook", image.filename);
+	TextureCook::Cook(pixels.data(), width, height, _compress, image.cooked);
+	image.success = true;
+	return true;
+}
+
+bool TextureLoader::upload(const DecodedImage& image)
+{
+	TraceZone zone("TextureLoader::upload", image.filename);
+	auto& slot = _slots[_nextSlot];
+	if (slot.fence)
+	{
+		if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+			return false;
+		glDeleteSync(slot.fence);
+		slot.fence = nullptr;
+	}
+
+	const auto& cooked = image.cooked;
+	const auto size = static_cast<GLsizeiptr>(cooked.data.size());
+	GLState::Instance().BindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+	if (size > slot.capacity)
+	{
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+		slot.capacity = size;
+	}
+
+	// The fence above guarantees the GPU is done with this buffer
+	auto dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (dst)
+	{
+		memcpy(dst, cooked.data.data(), cooked.data.size());
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		if (image.layer >= 0)
+		{
+			/* Array storage is allocated already, fill this image's layer */
+			GLState::Instance().BindTexture(GL_TEXTURE_2D_ARRAY, image.texture);
+			for (size_t i = 0; i < cooked.levels.size(); ++i)
+			{
+				const auto& level = cooked.levels[i];
+				const auto target = cooked.firstLevel + static_cast<GLint>(i);
+				const auto offset = reinterpret_cast<const void *>(level.offset);
+				if (cooked.Compressed())
+					glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, target, 0, 0, image.layer, level.width, level.height, 1, cooked.format, level.size, offset);
+				else
+					glTexSubImage3D(GL_TEXTURE_2D_ARRAY, target, 0, 0, image.layer, level.width, level.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, offset);
+			}
+			GLState::Instance().BindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		}
+		else
+		{
+			/* Load every precomputed level, source is the bound unpack buffer */
+			GLState::Instance().BindTexture(GL_TEXTURE_2D, image.texture);
+			for (size_t i = 0; i < cooked.levels.size(); ++i)
+			{
+				const auto& level = cooked.levels[i];
+				const auto target = cooked.firstLevel + static_cast<GLint>(i);
+				const auto offset = reinterpret_cast<const void *>(level.offset);
+				if (cooked.Compressed())
+					glCompressedTexImage2D(GL_TEXTURE_2D, target, cooked.format, level.width, level.height, 0, level.size, offset);
+				else
+					glTexImage2D(GL_TEXTURE_2D, target, GL_RGBA, level.width, level.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, offset);
+			}
+			// Streamed textures hold only part of the chain, sample from its finest level
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, cooked.firstLevel);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, cooked.numLevels - 1);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			GLState::Instance().BindTexture(GL_TEXTURE_2D, 0);
+		}
+
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+	else
+	{
+		std::cerr << "Couldn't map unpack buffer for " << image.filename << std::endl;
+	}
+	GLState::Instance().BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	_nextSlot = (_nextSlot + 1) % NumUploadSlots;
+	return true;
+}
+
+void TextureLoader::setPlaceholder(const GLuint& texture) const
+{
+	// Single mid grey texel, complete without mipmaps
+	const unsigned char grey[4] = {128, 128, 128, 255};
+	GLState::Instance().BindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	GLState::Instance().BindTexture(GL_TEXTURE_2D, 0);
+}
+
+void TextureLoader::allocateArrayLevels(const GLuint& texture, const ArrayState& array, int first, int last) const
+{
+	const auto layers = static_cast<GLsizei>(array.filenames.size());
+	GLState::Instance().BindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	for (auto level = first; level <= last; ++level)
+	{
+		const auto width = array.width >> level > 0 ? array.width >> level : 1;
+		const auto height = array.height >> level > 0 ? array.height >> level : 1;
+		if (array.format != GL_RGBA)
+		{
+			const auto size = static_cast<GLsizei>(TextureCook::LevelSize(width, height, array.format) * layers);
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, array.format, width, height, layers, 0, size, nullptr);
+		}
+		else
+		{
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA, width, height, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
+	}
+	GLState::Instance().BindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void TextureLoader::finishArrayLevel(const GLuint& texture, ArrayState& array, bool refinement)
+{
+	auto stream = _streams.find(texture);
+	if (!refinement)
+	{
+		std::cout << "Loaded texture array of " << array.filenames.size() << " layers, "
+			<< array.width << "x" << array.height << std::endl;
+		if (stream != _streams.end())
+		{
+			stream->second.residentLevel = array.loadingLevel;
+			stream->second.tailLevel = array.loadingLevel;
+			stream->second.loading = false;
+		}
+		return;
+	}
+
+	auto& state = stream->second;
+	if (array.failed)
+	{
+		// A level some layer lacks is never sampled, give its storage back
+		// and keep what is resident rather than retrying every frame
+		const auto resident = state.residentLevel;
+		state.residentLevel = array.loadingLevel;
+		evict(texture, state, resident);
+		state.finestLevel = resident;
+	}
+	else
+	{
+		GLState::Instance().BindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, array.loadingLevel);
+		GLState::Instance().BindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		state.residentLevel = array.loadingLevel;
+	}
+	state.loading = false;
+}
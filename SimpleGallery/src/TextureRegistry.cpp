@@ -0,0 +1,121 @@
+#include "TextureRegistry.h"
+
+#include <iostream>
+
+#include "GLState.h"
+#include "ModelCache.h"
+#include "TextureCook.h"
+#include "TextureLoader.h"
+#include "Trace.h"
+
+TextureRegistry& TextureRegistry::Instance()
+{
+	// Never destroyed, models release their textures from static destructors
+	static auto registry = new TextureRegistry();
+	return *registry;
+}
+
+GLuint TextureRegistry::Acquire(const std::string& filename, bool streamed)
+{
+	TraceZone zone("TextureRegistry::Acquire", filename);
+	ModelCache::SourceStamp stamp;
+	if (!ModelCache::StampFile(filename, false, stamp))
+	{
+		// Nothing to key a missing file by, it gets a placeholder of its own
+		++_misses;
+		return streamed ? TextureLoader::Instance().RequestStreamed(filename) : TextureLoader::Instance().Request(filename);
+	}
+
+	// Warm launches take the hash recorded when the file was cooked, the
+	// file is only read again if it changed since
+	if (!TextureCook::RecordedHash(filename + ".sgtx", filename, stamp.hash))
+		ModelCache::StampFile(filename, true, stamp);
+
+	auto itr = _entries.find(stamp.hash);
+	if (itr != _entries.end() && itr->second.fileSize == stamp.size)
+	{
+		++_hits;
+		++itr->second.refCount;
+		++itr->second.acquires;
+		std::cout << "Texture " << filename << " shares " << itr->second.filename << std::endl;
+		return itr->second.texture;
+	}
+
+	++_misses;
+	Entry entry;
+	entry.texture = streamed ? TextureLoader::Instance().RequestStreamed(filename) : TextureLoader::Instance().Request(filename);
+	entry.fileSize = stamp.size;
+	entry.filename = filename;
+	entry.refCount = 1;
+	entry.acquires = 1;
+	_entries[stamp.hash] = entry;
+	_keys[entry.texture] = stamp.hash;
+	return entry.texture;
+}
+
+void TextureRegistry::Release(const GLuint& texture)
+{
+	auto key = _keys.find(texture);
+	if (key == _keys.end())
+	{
+		// Missing files aren't shared
+		GLState::Instance().DeleteTextures(1, &texture);
+		return;
+	}
+
+	auto itr = _entries.find(key->second);
+	if (--itr->second.refCount > 0)
+		return;
+
+	GLState::Instance().DeleteTextures(1, &itr->second.texture);
+	_entries.erase(itr);
+	_keys.erase(key);
+}
+
+void TextureRegistry::ReportStats() const
+{
+	size_t resident = 0, saved = 0;
+	for (const auto& pair : _entries)
+	{
+		const auto bytes = residentBytes(pair.second.texture);
+		resident += bytes;
+		saved += bytes * (pair.second.acquires - 1);
+	}
+
+	std::cout << "Texture registry: " << _entries.size() << " textures, "
+		<< _hits << " hits, " << _misses << " misses, "
+		<< resident / 1024 << " KiB resident, "
+		<< saved / 1024 << " KiB saved by sharing" << std::endl;
+}
+
+// Sums the storage of every mip level from the base level down, levels above
+// it are either evicted or not streamed in yet
+size_t TextureRegistry::residentBytes(const GLuint& texture)
+{
+	size_t bytes = 0;
+	GLint baseLevel = 0;
+	GLState::Instance().BindTexture(GL_TEXTURE_2D, texture);
+	glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, &baseLevel);
+	for (auto level = baseLevel;; ++level)
+	{
+		GLint width = 0, height = 0, compressed = GL_FALSE;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_HEIGHT, &height);
+		if (width == 0 || height == 0)
+			break;
+
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED, &compressed);
+		if (compressed)
+		{
+			GLint size = 0;
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+			bytes += size;
+		}
+		else
+		{
+			bytes += static_cast<size_t>(width) * height * 4;
+		}
+	}
+	GLState::Instance().BindTexture(GL_TEXTURE_2D, 0);
+	return bytes;
+}
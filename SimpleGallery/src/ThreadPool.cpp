@@ -0,0 +1,56 @@
+#include "ThreadPool.h"
+
+#include "Trace.h"
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+{
+	if (numThreads == 0)
+	{
+		// Leave a core for the GL thread, which keeps uploading while we load
+		const auto cores = std::thread::hardware_concurrency();
+		numThreads = cores > 1 ? cores - 1 : 1;
+	}
+
+	for (unsigned int i = 0; i < numThreads; ++i)
+	{
+		_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	Shutdown();
+}
+
+ThreadPool& ThreadPool::Instance()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+	_tasks.Push(std::move(task));
+}
+
+void ThreadPool::Shutdown()
+{
+	_tasks.Close();
+	for (auto& worker : _workers)
+	{
+		if (worker.joinable())
+			worker.join();
+	}
+	_workers.clear();
+}
+
+void ThreadPool::workerLoop(unsigned int index)
+{
+	Trace::Instance().NameThread("Worker " + std::to_string(index + 1));
+
+	std::function<void()> task;
+	while (_tasks.Pop(task))
+	{
+		task();
+	}
+}
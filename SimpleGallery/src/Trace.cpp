@@ -0,0 +1,128 @@
+#include "Trace.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+Trace& Trace::Instance()
+{
+	// Never destroyed, worker threads may still record during static destruction
+	static auto trace = new Trace();
+	return *trace;
+}
+
+Trace::Trace() : _start(Clock::now())
+{
+}
+
+void Trace::NameThread(const std::string& name)
+{
+	if (!_enabled)
+		return;
+
+	const auto thread = threadId();
+	std::lock_guard<std::mutex> lock(_mutex);
+	_threadNames.push_back({thread, name});
+}
+
+void Trace::Record(const char* name, const std::string& detail, Clock::time_point start, Clock::time_point end)
+{
+	if (!_enabled)
+		return;
+
+	Event event;
+	event.name = name;
+	event.detail = detail;
+	event.start = std::chrono::duration_cast<std::chrono::microseconds>(start - _start).count();
+	event.duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+	event.thread = threadId();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_events.push_back(std::move(event));
+}
+
+bool Trace::Write(const std::string& path)
+{
+	_enabled = false;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	std::ofstream fout(path.c_str(), std::ofstream::trunc);
+	fout << "{\"traceEvents\":[\n";
+	auto first = true;
+	for (const auto& thread : _threadNames)
+	{
+		fout << (first ? "" : ",\n")
+			<< "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread.thread
+			<< ",\"args\":{\"name\":\"" << escape(thread.name) << "\"}}";
+		first = false;
+	}
+	for (const auto& event : _events)
+	{
+		fout << (first ? "" : ",\n")
+			<< "{\"name\":\"" << escape(event.name) << "\",\"cat\":\"startup\",\"ph\":\"X\",\"pid\":1"
+			<< ",\"tid\":" << event.thread << ",\"ts\":" << event.start << ",\"dur\":" << event.duration;
+		if (!event.detail.empty())
+			fout << ",\"args\":{\"detail\":\"" << escape(event.detail) << "\"}";
+		fout << "}";
+		first = false;
+	}
+	fout << "\n]}\n";
+
+	if (!fout)
+	{
+		std::cerr << "Couldn't write trace " << path << std::endl;
+		return false;
+	}
+	std::cout << "Wrote " << _events.size() << " trace zones to " << path << std::endl;
+	_events.clear();
+	_threadNames.clear();
+	return true;
+}
+
+// Small sequential ids read better in the viewer than native thread ids
+int Trace::threadId()
+{
+	thread_local auto id = 0;
+	if (id == 0)
+		id = _nextThread++;
+	return id;
+}
+
+std::string Trace::escape(const std::string& text)
+{
+	std::string escaped;
+	for (auto c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+			escaped += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", c);
+			escaped += code;
+		}
+		else
+		{
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+TraceZone::TraceZone(const char* name, const std::string& detail) : _name(name)
+{
+	if (Trace::Instance().Enabled())
+	{
+		_detail = detail;
+		_start = Trace::Clock::now();
+	}
+}
+
+TraceZone::~TraceZone()
+{
+	if (Trace::Instance().Enabled())
+		Trace::Instance().Record(_name, _detail, _start, Trace::Clock::now());
+}
@@ -0,0 +1,198 @@
+#include "VertexArena.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+#include "GLState.h"
+
+// Round to nearest, overflow saturates to infinity and tiny values flush to zero
+static uint16_t toHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	const auto sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+	const auto exponent = static_cast<int>((bits >> 23) & 0xff) - 127 + 15;
+	const auto mantissa = bits & 0x7fffff;
+
+	if (exponent <= 0)
+		return sign;
+	if (exponent >= 31)
+		return static_cast<uint16_t>(sign | 0x7c00);
+
+	auto half = static_cast<uint32_t>(exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)
+		++half; // may carry into the exponent, which still rounds correctly
+	return static_cast<uint16_t>(sign | (half > 0x7c00 ? 0x7c00 : half));
+}
+
+static int16_t toSnorm16(float value)
+{
+	value = value < -1.0f ? -1.0f : value > 1.0f ? 1.0f : value;
+	return static_cast<int16_t>(std::floor(value * 32767.0f + 0.5f));
+}
+
+void PackVertices(const Vertex* vertices, GLsizei numVertices, const float aabbMin[3], const float aabbMax[3], CompactVertex* packed)
+{
+	float invExtent[3];
+	for (auto c = 0; c < 3; ++c)
+	{
+		const auto extent = aabbMax[c] - aabbMin[c];
+		invExtent[c] = extent > 0.0f ? 1.0f / extent : 0.0f;
+	}
+
+	for (GLsizei i = 0; i < numVertices; ++i)
+	{
+		const auto& v = vertices[i];
+		auto& p = packed[i];
+
+		for (auto c = 0; c < 3; ++c)
+		{
+			auto t = (v.position[c] - aabbMin[c]) * invExtent[c];
+			t = t < 0.0f ? 0.0f : t > 1.0f ? 1.0f : t;
+			p.position[c] = static_cast<uint16_t>(t * 65535.0f + 0.5f);
+		}
+		p.position[3] = 0;
+
+		// Octahedral: project onto |x| + |y| + |z| = 1, fold the lower half over
+		const auto length = std::fabs(v.normal[0]) + std::fabs(v.normal[1]) + std::fabs(v.normal[2]);
+		auto x = length > 0.0f ? v.normal[0] / length : 0.0f;
+		auto y = length > 0.0f ? v.normal[1] / length : 0.0f;
+		if (length > 0.0f && v.normal[2] < 0.0f)
+		{
+			const auto foldedX = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			const auto foldedY = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = foldedX;
+			y = foldedY;
+		}
+		p.normal[0] = toSnorm16(x);
+		p.normal[1] = toSnorm16(y);
+
+		p.texCoord[0] = toHalf(v.texCoord[0]);
+		p.texCoord[1] = toHalf(v.texCoord[1]);
+	}
+}
+
+VertexArena& VertexArena::Instance()
+{
+	// Never destroyed, Shutdown releases the GL objects while the context is alive
+	static auto arena = new VertexArena();
+	return *arena;
+}
+
+void VertexArena::SetFormat(VertexFormat format)
+{
+	if (!_blocks.empty())
+	{
+		std::cerr << "Vertex format can't change after geometry was uploaded" << std::endl;
+		return;
+	}
+	_format = format;
+}
+
+size_t VertexArena::VertexBytes() const
+{
+	size_t bytes = 0;
+	for (const auto& block : _blocks)
+		bytes += static_cast<size_t>(Stride()) * block.usedVertices;
+	return bytes;
+}
+
+size_t VertexArena::IndexBytes() const
+{
+	size_t bytes = 0;
+	for (const auto& block : _blocks)
+		bytes += static_cast<size_t>(block.usedIndexBytes);
+	return bytes;
+}
+
+ArenaRange VertexArena::Upload(const void* vertices, GLsizei numVertices, const void* indices, GLsizeiptr indexBytes)
+{
+	auto& block = blockFor(numVertices, indexBytes);
+
+	// Ranges start 4 byte aligned so 32 bit meshes inside stay aligned
+	block.usedIndexBytes = (block.usedIndexBytes + 3) & ~static_cast<GLsizeiptr>(3);
+
+	ArenaRange range;
+	range.vao = block.vao;
+	range.firstVertex = block.usedVertices;
+	range.indexOffset = block.usedIndexBytes;
+
+	GLState::Instance().BindBuffer(GL_ARRAY_BUFFER, block.vertexBuffer);
+	glBufferSubData(GL_ARRAY_BUFFER, Stride() * block.usedVertices, Stride() * numVertices, vertices);
+	GLState::Instance().BindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// The element buffer is VAO state, upload through the copy target instead
+	GLState::Instance().BindBuffer(GL_COPY_WRITE_BUFFER, block.indexBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, block.usedIndexBytes, indexBytes, indices);
+	GLState::Instance().BindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	block.usedVertices += numVertices;
+	block.usedIndexBytes += indexBytes;
+	return range;
+}
+
+void VertexArena::Shutdown()
+{
+	for (auto& block : _blocks)
+	{
+		GLState::Instance().DeleteVertexArrays(1, &block.vao);
+		GLState::Instance().DeleteBuffers(1, &block.vertexBuffer);
+		GLState::Instance().DeleteBuffers(1, &block.indexBuffer);
+	}
+	_blocks.clear();
+}
+
+VertexArena::Block& VertexArena::blockFor(GLsizei numVertices, GLsizeiptr indexBytes)
+{
+	for (auto& block : _blocks)
+	{
+		if (block.vertexCapacity - block.usedVertices >= numVertices && block.indexCapacity - block.usedIndexBytes >= indexBytes + 3)
+			return block;
+	}
+
+	// Oversized ranges get a block of their own
+	Block block;
+	block.vertexCapacity = numVertices > BlockVertices ? numVertices : BlockVertices;
+	block.indexCapacity = indexBytes > BlockIndexBytes ? indexBytes : BlockIndexBytes;
+	block.usedVertices = 0;
+	block.usedIndexBytes = 0;
+
+	glGenVertexArrays(1, &block.vao);
+	GLState::Instance().BindVertexArray(block.vao);
+
+	glGenBuffers(1, &block.indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, block.indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, block.indexCapacity, nullptr, GL_STATIC_DRAW);
+
+	glGenBuffers(1, &block.vertexBuffer);
+	GLState::Instance().BindBuffer(GL_ARRAY_BUFFER, block.vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, Stride() * block.vertexCapacity, nullptr, GL_STATIC_DRAW);
+	glEnableVertexAttribArray(vertexLoc);
+	glEnableVertexAttribArray(normalLoc);
+	glEnableVertexAttribArray(texCoordLoc);
+	if (_format == VertexFormat::Compact)
+	{
+		// Normalized integers arrive in the shader as [0, 1] and [-1, 1] floats
+		glVertexAttribPointer(vertexLoc, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(CompactVertex), reinterpret_cast<void *>(offsetof(CompactVertex, position)));
+		glVertexAttribPointer(normalLoc, 2, GL_SHORT, GL_TRUE, sizeof(CompactVertex), reinterpret_cast<void *>(offsetof(CompactVertex, normal)));
+		glVertexAttribPointer(texCoordLoc, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(CompactVertex), reinterpret_cast<void *>(offsetof(CompactVertex, texCoord)));
+	}
+	else
+	{
+		glVertexAttribPointer(vertexLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<void *>(offsetof(Vertex, position)));
+		glVertexAttribPointer(normalLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<void *>(offsetof(Vertex, normal)));
+		glVertexAttribPointer(texCoordLoc, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), reinterpret_cast<void *>(offsetof(Vertex, texCoord)));
+	}
+
+	GLState::Instance().BindVertexArray(0);
+	GLState::Instance().BindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	std::cout << "Vertex arena block " << _blocks.size() << ": " << block.vertexCapacity << " vertices, "
+		<< block.indexCapacity / 1024 << " KiB of indices" << std::endl;
+
+	_blocks.push_back(block);
+	return _blocks.back();
+}
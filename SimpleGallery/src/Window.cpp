@@ -7,6 +7,10 @@
 #include <IL/il.h>
 #include <IL/ilut.h>
 
+#include "GLState.h"
+#include "TextureLoader.h"
+#include "Trace.h"
+
 using std::cerr;
 using std::cout;
 using std::endl;
@@ -22,14 +26,16 @@ Window::Window(const int& w, const int& h) : width(w), height(h)
 
 Window::~Window()
 {
-    glDeleteBuffers(1, &blackMatId);
-    glDeleteBuffers(1, &whiteMatId);
-    glDeleteBuffers(1, &yellowMatId);
-    glDeleteTextures(1, &screenshotTexId);
+    GLState::Instance().DeleteBuffers(1, &blackMatId);
+    GLState::Instance().DeleteBuffers(1, &whiteMatId);
+    GLState::Instance().DeleteBuffers(1, &yellowMatId);
+    GLState::Instance().DeleteTextures(1, &screenshotTexId);
 }
 
 void Window::Init()
 {
+    TraceZone zone("Window::Init");
+
     cameraStartPos = glm::vec3(0.0f, 0.0f, 3.0f);
     camera.Setup(cameraStartPos);
 
@@ -43,10 +49,11 @@ void Window::Init()
     memcpy(blackMat.emissive, blackColor, sizeof(blackColor));
     blackMat.shininess = 0.6f * 128;
     blackMat.texCount = 0;
+    blackMat.texLayer = -1;
     glGenBuffers(1, &blackMatId);
-    glBindBuffer(GL_UNIFORM_BUFFER, blackMatId);
+    GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, blackMatId);
     glBufferData(GL_UNIFORM_BUFFER, sizeof(blackMat), static_cast<void *>(&blackMat), GL_STATIC_DRAW);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
 
     float whiteColor[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
     memcpy(whiteMat.ambient, whiteColor, sizeof(whiteColor));
@@ -55,10 +62,11 @@ void Window::Init()
     memcpy(whiteMat.emissive, whiteColor, sizeof(whiteColor));
     whiteMat.shininess = 0.6f * 128;
     whiteMat.texCount = 0;
+    whiteMat.texLayer = -1;
     glGenBuffers(1, &whiteMatId);
-    glBindBuffer(GL_UNIFORM_BUFFER, whiteMatId);
+    GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, whiteMatId);
     glBufferData(GL_UNIFORM_BUFFER, sizeof(whiteMat), static_cast<void *>(&whiteMat), GL_STATIC_DRAW);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
 
     float yellowColor[4] = { 1.0f, 1.0f, 0.0f, 1.0f };
     memcpy(yellowMat.ambient, yellowColor, sizeof(yellowColor));
@@ -67,10 +75,11 @@ void Window::Init()
     memcpy(yellowMat.emissive, yellowColor, sizeof(yellowColor));
     yellowMat.shininess = 0.6f * 128;
     yellowMat.texCount = 0;
+    yellowMat.texLayer = -1;
     glGenBuffers(1, &yellowMatId);
-    glBindBuffer(GL_UNIFORM_BUFFER, yellowMatId);
+    GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, yellowMatId);
     glBufferData(GL_UNIFORM_BUFFER, sizeof(yellowMat), static_cast<void *>(&yellowMat), GL_STATIC_DRAW);
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    GLState::Instance().BindBuffer(GL_UNIFORM_BUFFER, 0);
 
     currentMatId = blackMatId;
 
@@ -80,7 +89,6 @@ void Window::Init()
     antiAliasing = false;
     setAntiAliasing = false;
 
-    glGenTextures(1, &screenshotTexId);
     ifstream infile("screenshots/.screenshots", ifstream::binary);
     if (infile.is_open())
     {
@@ -97,26 +105,13 @@ void Window::Init()
         cout << "Last screenshot number: \"" << count << "\"" << endl;
 
         filename += to_string(count) + ".png";
-        auto imageID = ilGenImage();
-        ilBindImage(imageID);
-        ilEnable(IL_ORIGIN_SET);
-        ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
-        ilLoadImage(filename.c_str());
-        ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
-
-        glBindTexture(GL_TEXTURE_2D, screenshotTexId);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ilGetInteger(IL_IMAGE_WIDTH),
-            ilGetInteger(IL_IMAGE_HEIGHT), 0, GL_RGBA, GL_UNSIGNED_BYTE,
-            ilGetData());
-        glGenerateMipmap(GL_TEXTURE_2D);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        ilDeleteImage(imageID);
-        ilBindImage(0);
+        // Decoded on the worker pool, placeholder until it arrives. Not
+        // cooked, it's replaced as soon as another screenshot is taken.
+        screenshotTexId = TextureLoader::Instance().Request(filename, false);
+    }
+    else
+    {
+        glGenTextures(1, &screenshotTexId);
     }
     infile.close();
 
@@ -131,6 +126,8 @@ void Window::Init()
 
     textured = true;
 
+    levelOfDetail = true;
+
     for (auto i = 0; i < 9; ++i)
     {
         lights[i] = true;
@@ -161,26 +158,26 @@ void Window::SetDrawingMode()
     {
         lighting = false;
         textured = false;
-        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+        GLState::Instance().PolygonMode(GL_LINE);
         switch (wireframeMode)
         {
         case WireframeMode::BLACK_WHITE:
-            glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+            GLState::Instance().ClearColor(0.0f, 0.0f, 0.0f, 1.0f);
             currentMatId = whiteMatId;
             break;
         case WireframeMode::WHITE_BLACK:
-            glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+            GLState::Instance().ClearColor(1.0f, 1.0f, 1.0f, 1.0f);
             currentMatId = blackMatId;
             break;
         case WireframeMode::BLUE_YELLOW:
-            glClearColor(0.0f, 0.0f, 1.0f, 1.0f);
+            GLState::Instance().ClearColor(0.0f, 0.0f, 1.0f, 1.0f);
             currentMatId = yellowMatId;
             break;
         }
     } 
     else
     {
-        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        GLState::Instance().PolygonMode(GL_FILL);
         switch (solidMode)
         {
         case SolidMode::BASIC:
@@ -202,6 +199,9 @@ void Window::SetDrawingMode()
         }
     }
 
+    // The draws pick their program from the mode
+    _shaders->SetMode(lighting, textured);
+
     //setDrawingMode = false;
 }
 
@@ -211,11 +211,11 @@ void Window::SetAntiAliasing() const
 
     if (antiAliasing)
     {
-        glEnable(GL_MULTISAMPLE);
+        GLState::Instance().Enable(GL_MULTISAMPLE);
     } 
     else
     {
-        glDisable(GL_MULTISAMPLE);
+        GLState::Instance().Disable(GL_MULTISAMPLE);
     }
 
     //setAntiAliasing = false;
@@ -227,25 +227,20 @@ void Window::SetBlending() const
 
     if (blending)
     {
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        GLState::Instance().Enable(GL_BLEND);
+        GLState::Instance().BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     }
     else
     {
-        glDisable(GL_BLEND);
+        GLState::Instance().Disable(GL_BLEND);
     }
 
     //setBlending = false;
 }
 
-void Window::SetShader(Shader* shader)
+void Window::SetShaders(ShaderPermutations* shaders)
 {
-    _shader = shader;
-}
-
-void Window::SetTexture() const
-{
-    glUniform1i(glGetUniformLocation((*_shader)(), "isTextured"), textured);
+    _shaders = shaders;
 }
 
 void Window::SetTimeOfDay() const
@@ -254,20 +249,19 @@ void Window::SetTimeOfDay() const
 
     if (timeOfDay)
     {
-        glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+        GLState::Instance().ClearColor(1.0f, 1.0f, 1.0f, 1.0f);
     }
     else
     {
-        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        GLState::Instance().ClearColor(0.0f, 0.0f, 0.0f, 0.0f);
     }
 
     //setTimeOfDay = false;
 }
 
-void Window::SetViewMatrix(const Shader& shader) const
+void Window::SetViewMatrix() const
 {
     ctm.SetView(camera.GetViewMatrix());
-    glUniform3f(glGetUniformLocation(shader(), "viewPos"), camera.Position.x, camera.Position.y, camera.Position.z);
 }
 
 string Window::GetDisplayStateString()
@@ -332,6 +326,8 @@ void Window::HandleKey(unsigned char key, int x, int y)
 
         filename += to_string(count) + ".png";
 
+        // Workers may be decoding, they share DevIL's bound image
+        const auto devil = TextureLoader::LockDevIL();
         auto imageID = ilGenImage();
         ilBindImage(imageID);
         ilutGLScreen();
@@ -348,7 +344,11 @@ void Window::HandleKey(unsigned char key, int x, int y)
         }
         outfile.close();
 
-        glBindTexture(GL_TEXTURE_2D, screenshotTexId);
+        // A fresh texture, the last screenshot's may still be loading and
+        // its upload would land on top of this one
+        TextureLoader::Instance().Discard(screenshotTexId);
+        glGenTextures(1, &screenshotTexId);
+        GLState::Instance().BindTexture(GL_TEXTURE_2D, screenshotTexId);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ilGetInteger(IL_IMAGE_WIDTH),
             ilGetInteger(IL_IMAGE_HEIGHT), 0, GL_RGBA, GL_UNSIGNED_BYTE,
             ilGetData());
@@ -357,7 +357,7 @@ void Window::HandleKey(unsigned char key, int x, int y)
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        GLState::Instance().BindTexture(GL_TEXTURE_2D, 0);
 
         ilDeleteImage(imageID);
 
@@ -454,6 +454,14 @@ void Window::HandleKey(unsigned char key, int x, int y)
         return;
     }
 
+    // Level of detail control
+    if (key == 'g') // On/Off
+    {
+        levelOfDetail = !levelOfDetail;
+        cout << "Levels of detail turned " << (levelOfDetail ? "on" : "off") << endl;
+        return;
+    }
+
     // Flashlight controls
     if (key == 'f') // On/Off
     {